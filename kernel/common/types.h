@@ -7,6 +7,12 @@ typedef uint16_t ioport_t;
 typedef uint32_t phyaddr_t;
 typedef unsigned int size_t;
 
+// physically contiguous piece of a buffer
+struct SGEntry {
+	phyaddr_t addr;
+	unsigned int length;
+};
+
 #define PACKED __attribute__((packed))
 
 // helper functions
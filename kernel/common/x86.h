@@ -143,10 +143,26 @@ static inline unsigned int rcr2(void) {
 	return val;
 }
 
+static inline unsigned int rcr3(void) {
+	unsigned int val;
+	__asm__ volatile("movl %%cr3,%0" : "=r"(val));
+	return val;
+}
+
 static inline void lcr3(unsigned int val) {
 	__asm__ volatile("movl %0,%%cr3" : : "r"(val));
 }
 
+static inline void invlpg(void* addr) {
+	__asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+}
+
+static inline uint64_t rdtsc(void) {
+	uint64_t tsc;
+	__asm__ volatile("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
 // PAGEBREAK: 36
 // Layout of the trap frame built on the stack by the
 // hardware and by trap__asm__.S, and passed to trap().
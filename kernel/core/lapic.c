@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/spinlock.h>
 #include <common/x86.h>
 #include <core/mmu.h>
 #include <core/traps.h>
@@ -40,6 +41,7 @@
 #define DEASSERT 0x00000000
 #define LEVEL 0x00008000 // Level triggered
 #define BCAST 0x00080000 // Send to all APICs, including self.
+#define OTHERS 0x000C0000 // Send to all APICs, excluding self.
 #define BUSY 0x00001000
 #define FIXED 0x00000000
 #define ICRHI (0x0310 / 4) // Interrupt Command [63:32]
@@ -119,6 +121,18 @@ void lapiceoi(void) {
 		lapicw(EOI, 0);
 }
 
+// Send a fixed interrupt to every other CPU
+void lapic_ipi_others(int vector) {
+	if (!lapic)
+		return;
+	pushcli();
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, OTHERS | FIXED | ASSERT | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+	popcli();
+}
+
 // Spin for a given number of microseconds.
 // On real hardware would want to tune this dynamically.
 void microdelay(int us) {}
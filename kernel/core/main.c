@@ -22,11 +22,13 @@
 #include <core/proc.h>
 #include <core/traps.h>
 #include <defs.h>
+#include <driver/ahci/ahci.h>
 #include <driver/ata/ata.h>
 #include <driver/bochs-display/bochs-display.h>
 #include <driver/ioapic.h>
 #include <driver/pci/pci.h>
 #include <driver/ps2/ps2.h>
+#include <driver/ramdisk.h>
 #include <driver/rtc.h>
 #include <driver/uart.h>
 #include <driver/usb/usb.h>
@@ -37,6 +39,7 @@
 #include <hal/hal.h>
 #include <memlayout.h>
 #include <param.h>
+#include <proc/futex.h>
 #include <proc/kcall.h>
 #include <proc/pty.h>
 
@@ -55,6 +58,7 @@ struct BootGraphicsMode boot_graphics_mode;
 void kmain(uint32_t mb_sig, uint32_t mb_addr) {
 	kinit1(end, P2V(4 * 1024 * 1024)); // phys page allocator
 	kvmalloc(); // kernel page table
+	vmalloc_init(); // vmalloc area
 	cprintf("PanicOS alpha built on " __DATE__ " " __TIME__ " gcc " __VERSION__ "\n");
 	if (mb_sig == 0x2BADB002 && mb_addr < 0x100000) {
 		cprintf("[multiboot] Multiboot bootloader detected, info at %x\n", mb_addr);
@@ -75,6 +79,10 @@ void kmain(uint32_t mb_sig, uint32_t mb_addr) {
 			}
 			cprintf("[multiboot] Memory size %d MiB\n", memory_size / (1024 * 1024));
 		}
+		if ((mbinfo->flags & (1 << 2)) && mbinfo->cmdline < 0x100000) { // command line
+			cprintf("[multiboot] Command line %s\n", P2V(mbinfo->cmdline));
+			ramdisk_cmdline(P2V(mbinfo->cmdline));
+		}
 		if (mbinfo->flags & (1 << 12)) { // video mode
 			switch (mbinfo->framebuffer_type) {
 			case MULTIBOOT_FRAMEBUFFER_TYPE_EGA_TEXT:
@@ -144,11 +152,13 @@ void kmain(uint32_t mb_sig, uint32_t mb_addr) {
 			"under GNU General Public License v3+\n");
 	// subsystems
 	kcall_init();
+	workqueue_init();
 	hal_display_init();
 	hal_block_init();
 	hal_hid_init();
 	hal_power_init();
 	pty_init();
+	futex_init();
 	// onboard devices
 	ioapic_init();
 	uart_init();
@@ -162,7 +172,9 @@ void kmain(uint32_t mb_sig, uint32_t mb_addr) {
 	ps2_keyboard_init();
 	ps2_mouse_init();
 	ata_init();
+	ahci_init();
 	virtio_blk_init();
+	ramdisk_init();
 	bochs_display_init();
 	rtc_init();
 	// virtual filesystem
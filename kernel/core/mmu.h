@@ -36,9 +36,11 @@
 #define SEG_UCODE 3 // user code
 #define SEG_UDATA 4 // user data+stack
 #define SEG_TSS 5 // this process's task state
+#define SEG_UTLS 6 // user thread local storage
+#define SEG_DFTSS 7 // double fault task state
 
 // cpu->gdt[NSEGS] holds the above segments.
-#define NSEGS 6
+#define NSEGS 8
 
 #ifndef __ASSEMBLER__
 // Segment Descriptor
@@ -81,6 +83,7 @@ struct segdesc {
 #define STA_R 0x2 // Readable (executable segments)
 
 // System segment type bits
+#define STS_TG 0x5 // Task Gate
 #define STS_T32A 0x9 // Available 32-bit TSS
 #define STS_IG32 0xE // 32-bit Interrupt Gate
 #define STS_TG32 0xF // 32-bit Trap Gate
@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <common/spinlock.h>
 #include <common/x86.h>
 #include <core/mmu.h>
@@ -46,8 +47,28 @@ int cpuid() {
 	return mycpu() - cpus;
 }
 
+static void thread_free(struct proc* p) {
+	p->kstack = 0;
+	p->pgdir = 0;
+	p->pid = 0;
+	p->parent = 0;
+	p->leader = 0;
+	p->name[0] = 0;
+	p->killed = 0;
+	p->state = UNUSED;
+}
+
+// Free a zombie process, or a zombie thread which shares its leader's
+// address space. Freeing a leader also frees its zombie threads.
 void proc_free(struct proc* p) {
-	kfree(p->kstack);
+	if (p->leader != p) {
+		thread_free(p);
+		return;
+	}
+	for (struct proc* q = ptable.proc; q < &ptable.proc[NPROC]; q++) {
+		if (q != p && q->leader == p && q->state == ZOMBIE)
+			thread_free(q);
+	}
 	p->kstack = 0;
 	freevm(p->pgdir);
 	kfree(p->cwd.pathbuf);
@@ -58,6 +79,16 @@ void proc_free(struct proc* p) {
 	p->state = UNUSED;
 }
 
+// Return non-zero if any thread of leader p has not exited yet.
+// The ptable lock must be held.
+int proc_group_busy(struct proc* p) {
+	for (struct proc* q = ptable.proc; q < &ptable.proc[NPROC]; q++) {
+		if (q != p && q->leader == p && q->state != ZOMBIE && q->state != UNUSED)
+			return 1;
+	}
+	return 0;
+}
+
 // Must be called with interrupts disabled to avoid the caller being
 // rescheduled between reading lapicid and running through the loop.
 struct cpu* mycpu(void) {
@@ -109,11 +140,18 @@ static struct proc* allocproc(void) {
 found:
 	p->state = EMBRYO;
 	p->pid = nextpid++;
+	p->kthread = 0;
+	p->leader = p;
+	p->tls_base = 0;
+	initlock(&p->vmlock, "vmlock");
+	p->nice = 0;
+	p->affinity = PROC_AFFINITY_ALL;
+	p->sched_wait = 0;
 
 	release(&ptable.lock);
 
 	// Allocate kernel stack.
-	if ((p->kstack = kalloc()) == 0) {
+	if ((p->kstack = kstack_alloc(p - ptable.proc)) == 0) {
 		p->state = UNUSED;
 		return 0;
 	}
@@ -184,22 +222,30 @@ void userinit(void) {
 }
 
 // Grow current process's memory by n bytes.
-// Return 0 on success, -1 on failure.
+// Return the old heap end on success, -1 on failure.
 int growproc(int n) {
 	struct proc* curproc = myproc();
+	struct proc* group = curproc->leader;
 
+	acquire(&group->vmlock);
 	if (n > 0) {
-		if (allocuvm(curproc->pgdir, PROC_HEAP_BOTTOM + curproc->heap_size,
-					 PROC_HEAP_BOTTOM + curproc->heap_size + n, PTE_W | PTE_U) == 0)
+		if (allocuvm(curproc->pgdir, PROC_HEAP_BOTTOM + group->heap_size,
+					 PROC_HEAP_BOTTOM + group->heap_size + n, PTE_W | PTE_U) == 0) {
+			release(&group->vmlock);
 			return -1;
+		}
 	} else if (n < 0) {
-		if (deallocuvm(curproc->pgdir, PROC_HEAP_BOTTOM + curproc->heap_size,
-					   PROC_HEAP_BOTTOM + curproc->heap_size + n) == 0)
+		if (deallocuvm(curproc->pgdir, PROC_HEAP_BOTTOM + group->heap_size,
+					   PROC_HEAP_BOTTOM + group->heap_size + n) == 0) {
+			release(&group->vmlock);
 			return -1;
+		}
 	}
-	curproc->heap_size += n;
+	int oldend = PROC_HEAP_BOTTOM + group->heap_size;
+	group->heap_size += n;
+	release(&group->vmlock);
 	switchuvm(curproc);
-	return 0;
+	return oldend;
 }
 
 // Create a new process copying p as the parent.
@@ -209,6 +255,7 @@ int fork(void) {
 	int pid;
 	struct proc* np;
 	struct proc* curproc = myproc();
+	struct proc* group = curproc->leader; // image is described by the leader
 
 	// Allocate process.
 	if ((np = allocproc()) == 0) {
@@ -219,46 +266,45 @@ int fork(void) {
 		return -1;
 	}
 	// Copy process executable image
-	if (copyuvm(np->pgdir, curproc->pgdir, 0, curproc->sz) == 0) {
+	if (copyuvm(np->pgdir, curproc->pgdir, 0, group->sz) == 0) {
 		freevm(np->pgdir);
-		kfree(np->kstack);
 		np->kstack = 0;
 		np->state = UNUSED;
 		return -1;
 	}
 	// copy dynamic libraries
-	if (copyuvm(np->pgdir, curproc->pgdir, PROC_DYNAMIC_BOTTOM, curproc->dyn_base) == 0) {
+	if (copyuvm(np->pgdir, curproc->pgdir, PROC_DYNAMIC_BOTTOM, group->dyn_base) == 0) {
 		freevm(np->pgdir);
-		kfree(np->kstack);
 		np->kstack = 0;
 		np->state = UNUSED;
 		return -1;
 	}
 	// copy process stack
-	if (copyuvm(np->pgdir, curproc->pgdir, PROC_STACK_BOTTOM - curproc->stack_size,
+	if (copyuvm(np->pgdir, curproc->pgdir, PROC_STACK_BOTTOM - group->stack_size,
 				PROC_STACK_BOTTOM) == 0) {
 		freevm(np->pgdir);
-		kfree(np->kstack);
 		np->kstack = 0;
 		np->state = UNUSED;
 		return -1;
 	}
 	// copy process heap
 	if (copyuvm(np->pgdir, curproc->pgdir, PROC_HEAP_BOTTOM,
-				PROC_HEAP_BOTTOM + curproc->heap_size) == 0) {
+				PROC_HEAP_BOTTOM + group->heap_size) == 0) {
 		freevm(np->pgdir);
-		kfree(np->kstack);
 		np->kstack = 0;
 		np->state = UNUSED;
 		return -1;
 	}
 
-	np->sz = curproc->sz;
-	np->stack_size = curproc->stack_size;
-	np->heap_size = curproc->heap_size;
-	np->dyn_base = curproc->dyn_base;
-	np->pty = curproc->pty;
-	np->parent = curproc;
+	np->sz = group->sz;
+	np->stack_size = group->stack_size;
+	np->heap_size = group->heap_size;
+	np->dyn_base = group->dyn_base;
+	np->pty = group->pty;
+	np->parent = group;
+	np->tls_base = curproc->tls_base;
+	np->nice = curproc->nice;
+	np->affinity = curproc->affinity;
 	*np->tf = *curproc->tf;
 
 	// Clear %eax so that fork returns 0 in the child.
@@ -267,9 +313,9 @@ int fork(void) {
 	safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
 	// copy working directory
-	np->cwd.parts = curproc->cwd.parts;
+	np->cwd.parts = group->cwd.parts;
 	np->cwd.pathbuf = kalloc();
-	memmove(np->cwd.pathbuf, curproc->cwd.pathbuf, np->cwd.parts * 128);
+	memmove(np->cwd.pathbuf, group->cwd.pathbuf, np->cwd.parts * 128);
 
 	pid = np->pid;
 
@@ -282,9 +328,107 @@ int fork(void) {
 	return pid;
 }
 
+// Create a thread sharing the address space, files and working directory
+// of the current process. It starts at entry(arg) on the user stack ending
+// at stack, with its TLS segment based at tls.
+int thread_create(unsigned int entry, unsigned int arg, unsigned int stack, unsigned int tls) {
+	struct proc* np;
+	struct proc* curproc = myproc();
+	unsigned int ustack[2];
+
+	if ((np = allocproc()) == 0)
+		return -1;
+
+	// push arg and a fake return PC
+	ustack[0] = 0xffffffff;
+	ustack[1] = arg;
+	stack = (stack & ~3) - sizeof(ustack);
+	if (copyout(curproc->pgdir, stack, ustack, sizeof(ustack)) < 0) {
+		np->kstack = 0;
+		np->state = UNUSED;
+		return -1;
+	}
+
+	np->pgdir = curproc->pgdir;
+	np->leader = curproc->leader;
+	np->parent = curproc->leader;
+	np->tls_base = tls;
+	np->nice = curproc->nice;
+	np->affinity = curproc->affinity;
+	*np->tf = *curproc->tf;
+	np->tf->eip = entry;
+	np->tf->esp = stack;
+	np->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+	np->tf->eax = 0;
+	safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+	np->cwd.parts = 0;
+	np->cwd.pathbuf = 0; // the leader's cwd is used
+
+	acquire(&ptable.lock);
+	np->state = RUNNABLE;
+	release(&ptable.lock);
+
+	return np->pid;
+}
+
+// Wait for thread tid of the current process to exit and free it.
+int thread_join(int tid, int* status) {
+	struct proc* curproc = myproc();
+	struct proc* p;
+
+	acquire(&ptable.lock);
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+		if (p->pid == tid && p->state != UNUSED && p->leader == curproc->leader &&
+			p != p->leader && p != curproc)
+			break;
+	}
+	if (p == &ptable.proc[NPROC]) {
+		release(&ptable.lock);
+		return -1;
+	}
+	while (p->state != ZOMBIE) {
+		if (curproc->killed) {
+			release(&ptable.lock);
+			return -1;
+		}
+		sleep(p, &ptable.lock);
+	}
+	if (status)
+		*status = p->exit_status;
+	proc_free(p);
+	release(&ptable.lock);
+	return 0;
+}
+
+// Exit a thread which is not the leader of its process.
+static void thread_exit(struct proc* curproc) {
+	struct proc* p;
+
+	acquire(&ptable.lock);
+
+	// Joiners sleep on the thread, the leader waits for all threads
+	wakeup1(curproc);
+	wakeup1(curproc->leader);
+	if (curproc->leader->state == ZOMBIE)
+		wakeup1(curproc->leader->parent);
+
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+		if (p->parent == curproc) {
+			p->parent = initproc;
+			if (p->state == ZOMBIE)
+				wakeup1(initproc);
+		}
+	}
+
+	curproc->state = ZOMBIE;
+	sched();
+	panic("zombie exit");
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
+// Called from a thread, only that thread exits.
 void exit(int status) {
 	struct proc* curproc = myproc();
 	struct proc* p;
@@ -293,6 +437,23 @@ void exit(int status) {
 		panic("init exiting");
 
 	curproc->exit_status = status;
+	if (curproc->leader != curproc)
+		thread_exit(curproc);
+
+	// Stop other threads before tearing down the address space.
+	acquire(&ptable.lock);
+	while (proc_group_busy(curproc)) {
+		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+			if (p != curproc && p->leader == curproc) {
+				p->killed = 1;
+				if (p->state == SLEEPING)
+					p->state = RUNNABLE;
+			}
+		}
+		sleep(curproc, &ptable.lock);
+	}
+	release(&ptable.lock);
+
 	// Close all open files.
 	for (int i = 0; i < PROC_FILE_MAX; i++) {
 		if (curproc->files[i].used) {
@@ -324,6 +485,62 @@ void exit(int status) {
 	panic("zombie exit");
 }
 
+// First code run by a kernel thread, ptable.lock held from scheduler.
+static void kthread_entry(void (*fn)(void*), void* arg) {
+	release(&ptable.lock);
+	fn(arg);
+
+	// Kernel thread returned, let init reap it.
+	acquire(&ptable.lock);
+	myproc()->parent = initproc;
+	wakeup1(initproc);
+	myproc()->state = ZOMBIE;
+	sched();
+	panic("zombie kthread");
+}
+
+// Create a kernel thread running fn(arg) with no user address space on the CPUs
+// in affinity. The thread is runnable on return.
+struct proc* kthread_create(const char* name, void (*fn)(void*), void* arg,
+							unsigned int affinity) {
+	struct proc* p;
+	char* sp;
+
+	if ((p = allocproc()) == 0)
+		return 0;
+	if ((p->pgdir = setupkvm()) == 0) {
+		p->kstack = 0;
+		p->state = UNUSED;
+		return 0;
+	}
+	p->sz = p->stack_size = p->heap_size = 0;
+	p->kthread = 1;
+	p->parent = 0;
+
+	// kthread_entry(fn, arg) is entered by swtch returning to it
+	sp = p->kstack + KSTACKSIZE;
+	sp -= 4;
+	*(unsigned int*)sp = (unsigned int)arg;
+	sp -= 4;
+	*(unsigned int*)sp = (unsigned int)fn;
+	sp -= 4;
+	*(unsigned int*)sp = 0; // fake return address
+	sp -= sizeof *p->context;
+	p->context = (struct context*)sp;
+	memset(p->context, 0, sizeof *p->context);
+	p->context->eip = (unsigned int)kthread_entry;
+
+	safestrcpy(p->name, name, sizeof(p->name));
+	p->cwd.parts = 0;
+	p->cwd.pathbuf = kalloc();
+
+	acquire(&ptable.lock);
+	p->affinity = affinity;
+	p->state = RUNNABLE;
+	release(&ptable.lock);
+	return p;
+}
+
 // Wait for a child process to exit and return its pid.
 // Return -1 if this process has no children.
 int wait(void) {
@@ -336,10 +553,10 @@ int wait(void) {
 		// Scan through table looking for exited children.
 		havekids = 0;
 		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-			if (p->parent != curproc)
+			if (p->parent != curproc || p->leader != p)
 				continue;
 			havekids = 1;
-			if (p->state == ZOMBIE) {
+			if (p->state == ZOMBIE && !proc_group_busy(p)) {
 				// Found one.
 				pid = p->pid;
 				proc_free(p);
@@ -369,6 +586,37 @@ int wait(void) {
 	}
 }
 
+// Pick the next process for this CPU: the runnable process allowed here
+// with the best nice value, less one for each time it was passed over so
+// low priority processes still run. Ties go round robin from last.
+// The ptable lock must be held.
+static struct proc* sched_pick(unsigned int cpumask, struct proc* last) {
+	struct proc *p, *best = 0;
+	int best_prio = 0;
+
+	p = last;
+	for (int i = 0; i < NPROC; i++) {
+		if (++p == &ptable.proc[NPROC])
+			p = ptable.proc;
+		if (p->state != RUNNABLE || !(p->affinity & cpumask))
+			continue;
+		int prio = p->nice - (int)p->sched_wait;
+		if (!best || prio < best_prio) {
+			best = p;
+			best_prio = prio;
+		}
+	}
+	if (!best)
+		return 0;
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+		if (p != best && p->state == RUNNABLE && (p->affinity & cpumask) &&
+			p->sched_wait < PROC_NICE_MAX - PROC_NICE_MIN)
+			p->sched_wait++;
+	}
+	best->sched_wait = 0;
+	return best;
+}
+
 // PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -380,18 +628,16 @@ int wait(void) {
 void scheduler(void) {
 	struct proc* p;
 	struct cpu* c = mycpu();
+	unsigned int cpumask = 1 << cpuid();
+	struct proc* last = &ptable.proc[NPROC - 1];
 	c->proc = 0;
 
 	for (;;) {
 		// Enable interrupts on this processor.
 		sti();
 
-		// Loop over process table looking for process to run.
 		acquire(&ptable.lock);
-		for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-			if (p->state != RUNNABLE)
-				continue;
-
+		if ((p = sched_pick(cpumask, last)) != 0) {
 			// Switch to chosen process.  It is the process's job
 			// to release ptable.lock and then reacquire it
 			// before jumping back to us.
@@ -405,6 +651,7 @@ void scheduler(void) {
 			// Process is done running for now.
 			// It should have changed its p->state before coming back.
 			c->proc = 0;
+			last = p;
 		}
 		release(&ptable.lock);
 	}
@@ -505,6 +752,75 @@ void wakeup(void* chan) {
 	release(&ptable.lock);
 }
 
+// Wake up at most n processes sleeping on chan.
+// Returns the number of processes woken.
+int wakeup_count(void* chan, int n) {
+	struct proc* p;
+	int woken = 0;
+
+	acquire(&ptable.lock);
+	for (p = ptable.proc; p < &ptable.proc[NPROC] && woken < n; p++) {
+		if (p->state == SLEEPING && p->chan == chan) {
+			p->state = RUNNABLE;
+			woken++;
+		}
+	}
+	release(&ptable.lock);
+	return woken;
+}
+
+// Set the nice value of every thread of process pid, or of the current process
+// if pid is 0.
+int proc_set_priority(int pid, int nice) {
+	if (nice < PROC_NICE_MIN || nice > PROC_NICE_MAX)
+		return ERROR_INVAILD;
+	struct proc* p = pid ? proc_search_pid(pid) : myproc();
+	if (!p)
+		return ERROR_NOT_EXIST;
+	acquire(&ptable.lock);
+	if (p->kthread) { // kernel threads keep the priority they were created with
+		release(&ptable.lock);
+		return ERROR_NO_PERM;
+	}
+	struct proc* leader = p->leader;
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+		if (p->state != UNUSED && p->leader == leader)
+			p->nice = nice;
+	}
+	release(&ptable.lock);
+	return 0;
+}
+
+// Restrict every thread of process pid, or of the current process if pid is 0,
+// to the CPUs in mask.
+int proc_set_affinity(int pid, unsigned int mask) {
+	if (!(mask & ((1 << ncpu) - 1)))
+		return ERROR_INVAILD;
+	struct proc* p = pid ? proc_search_pid(pid) : myproc();
+	if (!p)
+		return ERROR_NOT_EXIST;
+	acquire(&ptable.lock);
+	if (p->kthread) { // per-CPU workers must stay where they are
+		release(&ptable.lock);
+		return ERROR_NO_PERM;
+	}
+	struct proc* leader = p->leader;
+	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+		if (p->state != UNUSED && p->leader == leader)
+			p->affinity = mask;
+	}
+	release(&ptable.lock);
+	// move off this CPU if it is no longer allowed
+	if (myproc()->leader == leader) {
+		pushcli();
+		int allowed = mask & (1 << cpuid());
+		popcli();
+		if (!allowed)
+			yield();
+	}
+	return 0;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -513,9 +829,21 @@ int kill(int pid) {
 
 	acquire(&ptable.lock);
 	for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-		if (p->pid == pid) {
-			p->killed = 1;
-			p->state = ZOMBIE;
+		if (p->pid == pid && p->state != UNUSED) {
+			if (p->kthread) { // kernel threads can't be killed
+				release(&ptable.lock);
+				return -1;
+			}
+			// kill every thread of the process, running ones exit on
+			// their way back to user space
+			struct proc* leader = p->leader;
+			for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+				if (p->state != UNUSED && p->leader == leader) {
+					p->killed = 1;
+					if (p->state != RUNNING)
+						p->state = ZOMBIE;
+				}
+			}
 			release(&ptable.lock);
 			return 0;
 		}
@@ -35,6 +35,8 @@ struct cpu {
 	int ncli; // Depth of pushcli nesting.
 	int intena; // Were interrupts enabled before pushcli?
 	struct proc* proc; // The process running on this cpu or null
+	struct taskstate dfts; // Double fault task, runs on its own stack
+	volatile unsigned int tlb_flushes; // TLB shootdowns handled
 };
 
 extern struct cpu cpus[NCPU];
@@ -95,6 +97,25 @@ struct proc {
 	struct MessageQueue msgqueue; // message queue
 	int pty; // Pseudoterminal
 	int exit_status;
+	int kthread; // Kernel thread, no user space
+	struct proc* leader; // Thread group leader, owns memory, files and cwd
+	unsigned int tls_base; // Base of the user TLS segment
+	struct spinlock vmlock; // Serializes growproc between threads
+	int nice; // Static priority, PROC_NICE_MIN (highest) to PROC_NICE_MAX
+	unsigned int affinity; // Bitmask of CPUs allowed to run this process
+	unsigned int sched_wait; // Times passed over by the scheduler, for aging
+};
+
+#define PROC_NICE_MIN -20
+#define PROC_NICE_MAX 19
+#define PROC_AFFINITY_ALL 0xffffffff
+
+// Deferred work, run by a per-CPU worker thread
+struct WorkItem {
+	struct WorkItem* next;
+	void (*func)(void* arg);
+	void* arg;
+	int pending; // queued and not yet started
 };
 
 #endif
@@ -42,10 +42,33 @@ void tvinit(void) {
 	for (i = 0; i < 256; i++)
 		SETGATE(idt[i], 0, SEG_KCODE << 3, vectors[i], 0);
 	SETGATE(idt[T_SYSCALL], 1, SEG_KCODE << 3, vectors[T_SYSCALL], DPL_USER);
+	// double faults switch to the task set up in seginit
+	SETGATE(idt[T_DBLFLT], 0, SEG_DFTSS << 3, 0, 0);
+	idt[T_DBLFLT].type = STS_TG;
 
 	initlock(&tickslock, "time");
 }
 
+static void kstack_overflow(int slot, unsigned int eip, unsigned int esp) {
+	struct proc* p = &ptable.proc[slot];
+	cprintf("kernel stack overflow pid %d %s on cpu %d eip %x esp %x\n", p->pid, p->name,
+			cpuid(), eip, esp);
+	panic("kernel stack overflow");
+}
+
+// Entered through the double fault task gate on a fresh stack, the
+// faulting context was saved in this CPU's TSS.
+void doublefault(void) {
+	struct cpu* c = mycpu();
+	unsigned int eip = (unsigned int)c->ts.eip, esp = (unsigned int)c->ts.esp;
+	int slot;
+
+	if ((slot = kstack_guard_slot(rcr2())) >= 0 || (slot = kstack_guard_slot(esp)) >= 0)
+		kstack_overflow(slot, eip, esp);
+	cprintf("double fault on cpu %d eip %x esp %x cr2 %x\n", cpuid(), eip, esp, rcr2());
+	panic("double fault");
+}
+
 void idtinit(void) {
 	lidt(idt, sizeof(idt));
 }
@@ -115,10 +138,17 @@ void trap(struct trapframe* tf) {
 		pci_msi_intr(tf->trapno);
 		lapiceoi();
 		break;
+	case T_TLB_FLUSH:
+		vm_tlb_flush_intr();
+		lapiceoi();
+		break;
 	// PAGEBREAK: 13
 	default:
 		if (myproc() == 0 || (tf->cs & 3) == 0) {
 			// In kernel, it must be our mistake.
+			int slot;
+			if (tf->trapno == T_PGFLT && (slot = kstack_guard_slot(rcr2())) >= 0)
+				kstack_overflow(slot, tf->eip, (unsigned int)&tf->esp);
 			cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n", tf->trapno, cpuid(),
 					tf->eip, rcr2());
 			panic("trap");
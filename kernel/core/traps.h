@@ -62,4 +62,6 @@
 #define T_MSI 65
 #define T_MSI_END 0xfe
 
+#define T_TLB_FLUSH 0xff // TLB shootdown IPI
+
 #endif
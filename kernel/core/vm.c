@@ -17,10 +17,12 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <common/spinlock.h>
 #include <common/x86.h>
 #include <core/mmu.h>
 #include <core/proc.h>
+#include <core/traps.h>
 #include <defs.h>
 #include <filesystem/vfs/vfs.h>
 #include <memlayout.h>
@@ -29,6 +31,14 @@
 extern char data[]; // defined by kernel.ld
 pde_t* kpgdir; // for use in scheduler()
 
+// Page tables of KSHARED_BASE..KSHARED_TOP, installed in every page directory
+static pde_t kshared_pde[(KSHARED_TOP - KSHARED_BASE) >> PDXSHIFT];
+
+// Stack of each CPU's double fault task
+static char doublefault_stack[NCPU][2048];
+
+#define KSTACK_SLOT (KSTACKSIZE + PGSIZE) // stack and its guard page
+
 // Set up CPU's kernel segment descriptors.
 // Run once on entry on each CPU.
 void seginit(void) {
@@ -43,6 +53,20 @@ void seginit(void) {
 	c->gdt[SEG_KDATA] = SEG(STA_W, 0, 0xffffffff, 0);
 	c->gdt[SEG_UCODE] = SEG(STA_X | STA_R, 0, 0xffffffff, DPL_USER);
 	c->gdt[SEG_UDATA] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+	c->gdt[SEG_UTLS] = SEG(STA_W, 0, 0xffffffff, DPL_USER);
+
+	// A double fault switches to this task, so that a kernel stack
+	// overflow can be reported instead of resetting the machine.
+	memset(&c->dfts, 0, sizeof(c->dfts));
+	c->dfts.eip = (unsigned int*)doublefault;
+	c->dfts.esp = (unsigned int*)(doublefault_stack[c - cpus] + sizeof(doublefault_stack[0]));
+	c->dfts.cs = SEG_KCODE << 3;
+	c->dfts.ss = c->dfts.ds = c->dfts.es = SEG_KDATA << 3;
+	c->dfts.cr3 = (void*)V2P(kpgdir);
+	c->dfts.eflags = 0x2;
+	c->dfts.iomb = (unsigned short)0xFFFF;
+	c->gdt[SEG_DFTSS] = SEG16(STS_T32A, &c->dfts, sizeof(c->dfts) - 1, 0);
+	c->gdt[SEG_DFTSS].s = 0;
 	lgdt(c->gdt, sizeof(c->gdt));
 }
 
@@ -162,6 +186,9 @@ pde_t* setupkvm(void) {
 			freevm(pgdir);
 			return 0;
 		}
+	// shared kernel area
+	for (int i = 0; i < NELEM(kshared_pde); i++)
+		pgdir[PDX(KSHARED_BASE) + i] = kshared_pde[i];
 	// copy kernel module map
 	module_set_pgdir(pgdir);
 	return pgdir;
@@ -170,10 +197,227 @@ pde_t* setupkvm(void) {
 // Allocate one page table for the machine for the kernel address
 // space for scheduler processes.
 void kvmalloc(void) {
+	for (int i = 0; i < NELEM(kshared_pde); i++) {
+		pte_t* pgtab = kalloc();
+		memset(pgtab, 0, PGSIZE);
+		kshared_pde[i] = V2P(pgtab) | PTE_P | PTE_W;
+	}
 	kpgdir = setupkvm();
 	switchkvm();
 }
 
+// Kernel stack of process table slot, mapped at a fixed address in the
+// kernel stack area with an unmapped guard page below. Stack pages stay
+// mapped after the process is freed and are reused by the next one.
+// Return 0 if out of memory.
+char* kstack_alloc(int slot) {
+	char* stack = (char*)KSTACK_BASE + slot * KSTACK_SLOT + PGSIZE;
+	for (char* va = stack; va < stack + KSTACKSIZE; va += PGSIZE) {
+		pte_t* pte = walkpgdir(kpgdir, va, 0, 0);
+		if (!(*pte & PTE_P)) {
+			char* page = kalloc();
+			if (!page)
+				return 0; // pages already mapped are kept for the slot
+			*pte = V2P(page) | PTE_W | PTE_P;
+		}
+	}
+	return stack;
+}
+
+// Return the process table slot whose stack guard page holds va, or -1.
+int kstack_guard_slot(unsigned int va) {
+	if (va < KSTACK_BASE || va >= KSTACK_BASE + NPROC * KSTACK_SLOT)
+		return -1;
+	if ((va - KSTACK_BASE) % KSTACK_SLOT >= PGSIZE)
+		return -1;
+	return (va - KSTACK_BASE) / KSTACK_SLOT;
+}
+
+// Physical address of a mapped kernel virtual address, or 0.
+phyaddr_t kva2pa(const void* va) {
+	if ((unsigned int)va >= KERNBASE && (unsigned int)va < KERNBASE + PHYSTOP)
+		return V2P(va);
+	pte_t* pte = walkpgdir(kpgdir, va, 0, 0);
+	if (!pte || !(*pte & PTE_P))
+		return 0;
+	return PTE_ADDR(*pte) | ((unsigned int)va & (PGSIZE - 1));
+}
+
+// Describe a kernel buffer as up to max physically contiguous pieces,
+// return the number of entries used or ERROR_INVAILD.
+int kva_sglist(const void* va, size_t size, struct SGEntry* sg, int max) {
+	int n = 0;
+	while (size) {
+		unsigned int len = PGSIZE - ((unsigned int)va & (PGSIZE - 1));
+		if (len > size)
+			len = size;
+		phyaddr_t pa = kva2pa(va);
+		if (!pa)
+			return ERROR_INVAILD;
+		if (n && sg[n - 1].addr + sg[n - 1].length == pa) {
+			sg[n - 1].length += len;
+		} else {
+			if (n == max)
+				return ERROR_INVAILD;
+			sg[n].addr = pa;
+			sg[n].length = len;
+			n++;
+		}
+		va += len;
+		size -= len;
+	}
+	return n;
+}
+
+// vmalloc area, each allocation is followed by an unmapped guard page
+#define VMALLOC_MAX 64
+
+static struct {
+	struct spinlock lock;
+	struct VmArea {
+		unsigned int base, pages; // pages excludes the guard page, base 0 if unused
+		// freed, the pages stay in the page table not present until every CPU in
+		// cpumask has handled a TLB shootdown after flushes was taken
+		int stale;
+		unsigned int cpumask;
+		unsigned int flushes[NCPU];
+	} area[VMALLOC_MAX];
+} vmalloc_area;
+
+void vmalloc_init(void) {
+	initlock(&vmalloc_area.lock, "vmalloc");
+	memset(vmalloc_area.area, 0, sizeof(vmalloc_area.area));
+}
+
+// Flush this CPU's TLB, on request of vfree() on another CPU
+void vm_tlb_flush_intr(void) {
+	lcr3(rcr3());
+	mycpu()->tlb_flushes++;
+}
+
+// Free the pages of freed areas no CPU can still reach through its TLB and
+// make the ranges reusable. Caller holds the lock.
+static void vmalloc_reclaim(void) {
+	for (int i = 0; i < VMALLOC_MAX; i++) {
+		struct VmArea* a = &vmalloc_area.area[i];
+		if (!a->stale)
+			continue;
+		for (unsigned int c = 0; c < ncpu; c++) {
+			if ((a->cpumask & (1 << c)) && cpus[c].tlb_flushes != a->flushes[c])
+				a->cpumask &= ~(1 << c);
+		}
+		if (a->cpumask)
+			continue;
+		for (unsigned int p = 0; p < a->pages; p++) {
+			pte_t* pte = walkpgdir(kpgdir, (void*)a->base + p * PGSIZE, 0, 0);
+			kfree(P2V(PTE_ADDR(*pte)));
+			*pte = 0;
+		}
+		a->stale = 0;
+		a->base = 0;
+	}
+}
+
+// First fit address for pages plus a guard page, or 0. Caller holds the lock.
+static unsigned int vmalloc_find(unsigned int pages) {
+	unsigned int base = VMALLOC_BASE, size = (pages + 1) * PGSIZE;
+	for (int i = 0; i < VMALLOC_MAX; i++) {
+		struct VmArea* a = &vmalloc_area.area[i];
+		if (a->base && base < a->base + (a->pages + 1) * PGSIZE && a->base < base + size) {
+			base = a->base + (a->pages + 1) * PGSIZE;
+			i = -1;
+		}
+	}
+	if (base + size > VMALLOC_TOP || base + size < base)
+		return 0;
+	return base;
+}
+
+// Allocate virtually contiguous kernel memory backed by scattered pages,
+// or return 0 if out of memory.
+// The pages are not physically contiguous, use kva_sglist() for DMA.
+void* vmalloc(size_t size) {
+	unsigned int pages = PGROUNDUP(size) / PGSIZE;
+	if (!pages)
+		return 0;
+	acquire(&vmalloc_area.lock);
+	vmalloc_reclaim();
+	struct VmArea* area = 0;
+	for (int i = 0; i < VMALLOC_MAX; i++) {
+		if (!vmalloc_area.area[i].base) {
+			area = &vmalloc_area.area[i];
+			break;
+		}
+	}
+	unsigned int base = area ? vmalloc_find(pages) : 0;
+	if (!base) {
+		release(&vmalloc_area.lock);
+		return 0;
+	}
+	area->base = base;
+	area->pages = pages;
+	release(&vmalloc_area.lock);
+
+	for (unsigned int i = 0; i < pages; i++) {
+		pte_t* pte = walkpgdir(kpgdir, (void*)base + i * PGSIZE, 0, 0);
+		char* page = kalloc();
+		if (!page) {
+			// never handed out, no other CPU has used these mappings
+			while (i--) {
+				pte = walkpgdir(kpgdir, (void*)base + i * PGSIZE, 0, 0);
+				kfree(P2V(PTE_ADDR(*pte)));
+				*pte = 0;
+				invlpg((void*)base + i * PGSIZE);
+			}
+			acquire(&vmalloc_area.lock);
+			area->base = 0;
+			release(&vmalloc_area.lock);
+			return 0;
+		}
+		*pte = V2P(page) | PTE_W | PTE_P;
+	}
+	return (void*)base;
+}
+
+void vfree(void* va) {
+	acquire(&vmalloc_area.lock);
+	struct VmArea* area = 0;
+	for (int i = 0; i < VMALLOC_MAX; i++) {
+		if (vmalloc_area.area[i].base == (unsigned int)va && !vmalloc_area.area[i].stale) {
+			area = &vmalloc_area.area[i];
+			break;
+		}
+	}
+	if (!area)
+		panic("vfree");
+	unsigned int base = area->base, pages = area->pages;
+	release(&vmalloc_area.lock);
+
+	// keep the page in the entry until it is reclaimed
+	for (unsigned int i = 0; i < pages; i++) {
+		pte_t* pte = walkpgdir(kpgdir, (void*)base + i * PGSIZE, 0, 0);
+		*pte &= ~PTE_P;
+		invlpg((void*)base + i * PGSIZE);
+	}
+
+	// other CPUs may still hold the mappings, shoot them down and keep the
+	// pages and the range until all of them have flushed
+	acquire(&vmalloc_area.lock);
+	area->stale = 1;
+	area->cpumask = 0;
+	unsigned int self = cpuid(); // acquire disabled interrupts
+	for (unsigned int c = 0; c < ncpu; c++) {
+		if (c != self && cpus[c].started) {
+			area->cpumask |= 1 << c;
+			area->flushes[c] = cpus[c].tlb_flushes;
+		}
+	}
+	if (area->cpumask)
+		lapic_ipi_others(T_TLB_FLUSH);
+	vmalloc_reclaim();
+	release(&vmalloc_area.lock);
+}
+
 // Switch h/w page table register to the kernel-only page table,
 // for when no process is running.
 void switchkvm(void) {
@@ -198,6 +442,8 @@ void switchuvm(struct proc* p) {
 	// forbids I/O instructions (e.g., inb and outb) from user space
 	mycpu()->ts.iomb = (unsigned short)0xFFFF;
 	ltr(SEG_TSS << 3);
+	// %gs of this thread is reloaded from the GDT on return to user space
+	mycpu()->gdt[SEG_UTLS] = SEG(STA_W, p->tls_base, 0xffffffff, DPL_USER);
 	lcr3(V2P(p->pgdir)); // switch to process's address space
 	popcli();
 }
@@ -307,6 +553,8 @@ void freevm(pde_t* pgdir) {
 		panic("freevm: no pgdir");
 	deallocuvm(pgdir, KERNBASE, 0);
 	for (i = 0; i < NPDENTRIES; i++) {
+		if (i >= PDX(KSHARED_BASE) && i < PDX(KSHARED_TOP))
+			continue; // shared page tables
 		if (pgdir[i] & PTE_P) {
 			char* v = P2V(PTE_ADDR(pgdir[i]));
 			kfree(v);
@@ -357,7 +605,7 @@ char* uva2ka(pde_t* pgdir, char* uva) {
 	pte_t* pte;
 
 	pte = walkpgdir(pgdir, uva, 0, PTE_W | PTE_U);
-	if ((*pte & PTE_P) == 0)
+	if (pte == 0 || (*pte & PTE_P) == 0)
 		return 0;
 	if ((*pte & PTE_U) == 0)
 		return 0;
@@ -0,0 +1,109 @@
+/*
+ * Per-CPU deferred work queue
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <common/x86.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <param.h>
+
+static struct WorkQueue {
+	struct spinlock lock;
+	struct WorkItem *head, *tail;
+	struct proc* worker;
+} workqueue[NCPU];
+
+static void workqueue_worker(void* arg) {
+	struct WorkQueue* wq = arg;
+
+	for (;;) {
+		acquire(&wq->lock);
+		while (!wq->head) {
+			sleep(wq, &wq->lock);
+		}
+		struct WorkItem* work = wq->head;
+		wq->head = work->next;
+		if (!wq->head) {
+			wq->tail = 0;
+		}
+		work->next = 0;
+		// unlinked, it may be queued again on any CPU from here on
+		__sync_lock_release(&work->pending);
+		release(&wq->lock);
+
+		work->func(work->arg);
+	}
+}
+
+void workqueue_init(void) {
+	char name[16] = "kworker/";
+	for (unsigned int i = 0; i < ncpu; i++) {
+		initlock(&workqueue[i].lock, "workqueue");
+		workqueue[i].head = workqueue[i].tail = 0;
+		name[8] = '0' + i / 10;
+		name[9] = '0' + i % 10;
+		name[10] = '\0';
+		// keep completions on the CPU which queued them
+		workqueue[i].worker = kthread_create(name, workqueue_worker, &workqueue[i], 1 << i);
+		if (!workqueue[i].worker) {
+			panic("workqueue_init");
+		}
+	}
+	cprintf("[workqueue] %d workers started\n", ncpu);
+}
+
+void work_init(struct WorkItem* work, void (*func)(void*), void* arg) {
+	work->next = 0;
+	work->func = func;
+	work->arg = arg;
+	work->pending = 0;
+}
+
+// Queue work on a given CPU's worker, safe to call from interrupt handlers.
+// A work item already queued is not queued twice, on any CPU.
+int work_schedule_on(int cpu, struct WorkItem* work) {
+	if (cpu < 0 || (unsigned int)cpu >= ncpu) {
+		return ERROR_INVAILD;
+	}
+	// pending is claimed outside the queue locks as another CPU's queue may own it
+	if (!__sync_bool_compare_and_swap(&work->pending, 0, 1)) {
+		return 0;
+	}
+	struct WorkQueue* wq = &workqueue[cpu];
+	acquire(&wq->lock);
+	work->next = 0;
+	if (wq->tail) {
+		wq->tail->next = work;
+	} else {
+		wq->head = work;
+	}
+	wq->tail = work;
+	wakeup(wq);
+	release(&wq->lock);
+	return 0;
+}
+
+// Queue work on the current CPU
+int work_schedule(struct WorkItem* work) {
+	pushcli();
+	int cpu = cpuid();
+	popcli();
+	return work_schedule_on(cpu, work);
+}
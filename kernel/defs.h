@@ -59,6 +59,7 @@ extern volatile uint32_t* lapic;
 void lapiceoi(void);
 void lapicinit(void);
 void lapicstartap(unsigned char, unsigned int);
+void lapic_ipi_others(int vector);
 void microdelay(int);
 
 // mp.c
@@ -87,8 +88,16 @@ void sleep(void*, struct spinlock*);
 void userinit(void);
 int wait(void);
 void wakeup(void*);
+int wakeup_count(void* chan, int n);
+int proc_set_priority(int pid, int nice);
+int proc_set_affinity(int pid, unsigned int mask);
 void yield(void);
 struct proc* proc_search_pid(int pid);
+struct proc* kthread_create(const char* name, void (*fn)(void*), void* arg,
+							unsigned int affinity);
+int proc_group_busy(struct proc* p);
+int thread_create(unsigned int entry, unsigned int arg, unsigned int stack, unsigned int tls);
+int thread_join(int tid, int* status);
 
 // swtch.S
 void swtch(struct context**, struct context*);
@@ -114,11 +123,18 @@ void syscall(void);
 void timerinit(void);
 
 // trap.c
+void doublefault(void);
 void idtinit(void);
 extern unsigned int ticks;
 void tvinit(void);
 extern struct spinlock tickslock;
 
+// workqueue.c
+void workqueue_init(void);
+void work_init(struct WorkItem* work, void (*func)(void*), void* arg);
+int work_schedule(struct WorkItem* work);
+int work_schedule_on(int cpu, struct WorkItem* work);
+
 // vm.c
 void seginit(void);
 void kvmalloc(void);
@@ -140,6 +156,14 @@ pde_t* copypgdir(pde_t* newpgdir, pde_t* oldpgdir, unsigned int begin,
 void* map_mmio_region(phyaddr_t phyaddr, size_t size);
 void* map_ram_region(phyaddr_t phyaddr, size_t size);
 void* map_rom_region(phyaddr_t phyaddr, size_t size);
+char* kstack_alloc(int slot);
+int kstack_guard_slot(unsigned int va);
+phyaddr_t kva2pa(const void* va);
+int kva_sglist(const void* va, size_t size, struct SGEntry* sg, int max);
+void vmalloc_init(void);
+void* vmalloc(size_t size);
+void vfree(void* va);
+void vm_tlb_flush_intr(void);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x) / sizeof((x)[0]))
@@ -0,0 +1,131 @@
+#ifndef _DRIVER_AHCI_REGS_H
+#define _DRIVER_AHCI_REGS_H
+
+#include <common/types.h>
+
+struct AHCIPortRegs {
+	uint32_t clb, clbu; // command list base
+	uint32_t fb, fbu; // received FIS base
+	uint32_t is; // interrupt status
+	uint32_t ie; // interrupt enable
+	uint32_t cmd;
+	uint32_t reserved0;
+	uint32_t tfd; // task file data
+	uint32_t sig;
+	uint32_t ssts; // SATA status
+	uint32_t sctl;
+	uint32_t serr;
+	uint32_t sact; // NCQ tags outstanding
+	uint32_t ci; // command issue
+	uint32_t sntf;
+	uint32_t fbs;
+	uint32_t devslp;
+	uint32_t reserved1[10];
+	uint32_t vendor[4];
+};
+
+struct AHCIHBARegs {
+	uint32_t cap;
+	uint32_t ghc;
+	uint32_t is;
+	uint32_t pi; // ports implemented
+	uint32_t vs;
+	uint32_t ccc_ctl, ccc_ports;
+	uint32_t em_loc, em_ctl;
+	uint32_t cap2;
+	uint32_t bohc;
+	uint8_t reserved[0xa0 - 0x2c];
+	uint8_t vendor[0x100 - 0xa0];
+	struct AHCIPortRegs port[32];
+};
+
+enum AHCICap {
+	AHCI_CAP_SNCQ = (1 << 30), // native command queuing
+	AHCI_CAP_S64A = (1u << 31),
+};
+
+enum AHCIGhc {
+	AHCI_GHC_HR = (1 << 0), // HBA reset
+	AHCI_GHC_IE = (1 << 1),
+	AHCI_GHC_AE = (1u << 31), // AHCI enable
+};
+
+enum AHCIPortCmd {
+	AHCI_PORT_CMD_ST = (1 << 0),
+	AHCI_PORT_CMD_SUD = (1 << 1),
+	AHCI_PORT_CMD_POD = (1 << 2),
+	AHCI_PORT_CMD_FRE = (1 << 4),
+	AHCI_PORT_CMD_FR = (1 << 14),
+	AHCI_PORT_CMD_CR = (1 << 15),
+};
+
+enum AHCIPortIs {
+	AHCI_PORT_IS_DHRS = (1 << 0), // D2H register FIS
+	AHCI_PORT_IS_PSS = (1 << 1), // PIO setup FIS
+	AHCI_PORT_IS_DSS = (1 << 2), // DMA setup FIS
+	AHCI_PORT_IS_SDBS = (1 << 3), // set device bits FIS, NCQ completions
+	AHCI_PORT_IS_IFS = (1 << 27),
+	AHCI_PORT_IS_HBDS = (1 << 28),
+	AHCI_PORT_IS_HBFS = (1 << 29),
+	AHCI_PORT_IS_TFES = (1 << 30), // task file error
+};
+
+#define AHCI_PORT_IS_ERROR \
+	(AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES)
+
+#define AHCI_PORT_TFD_ERR 0x01
+#define AHCI_PORT_TFD_DRQ 0x08
+#define AHCI_PORT_TFD_BSY 0x80
+
+#define AHCI_PORT_SIG_ATA 0x00000101
+
+struct AHCICommandHeader {
+	uint16_t flags; // CFL in dwords, bit 6 write
+	uint16_t prdtl; // PRD table entries
+	volatile uint32_t prdbc; // bytes transferred
+	uint32_t ctba, ctbau; // command table base
+	uint32_t reserved[4];
+};
+
+#define AHCI_CMD_WRITE (1 << 6)
+
+struct AHCIPRD {
+	uint32_t dba, dbau;
+	uint32_t reserved;
+	uint32_t dbc; // byte count - 1, bit 31 interrupt on completion
+};
+
+struct AHCICommandTable {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct AHCIPRD prdt[];
+};
+
+// host to device register FIS
+struct FISRegH2D {
+	uint8_t type;
+	uint8_t flags; // bit 7 command
+	uint8_t command;
+	uint8_t feature_lo;
+	uint8_t lba0, lba1, lba2;
+	uint8_t device;
+	uint8_t lba3, lba4, lba5;
+	uint8_t feature_hi;
+	uint8_t count_lo, count_hi;
+	uint8_t icc;
+	uint8_t control;
+	uint8_t reserved[4];
+} PACKED;
+
+#define FIS_TYPE_REG_H2D 0x27
+
+enum AHCIAtaCommands {
+	AHCI_ATA_READ_DMA_EXT = 0x25,
+	AHCI_ATA_WRITE_DMA_EXT = 0x35,
+	AHCI_ATA_READ_FPDMA_QUEUED = 0x60,
+	AHCI_ATA_WRITE_FPDMA_QUEUED = 0x61,
+	AHCI_ATA_IDENTIFY = 0xec,
+};
+
+#endif
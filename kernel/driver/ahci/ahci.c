@@ -0,0 +1,446 @@
+/*
+ * AHCI SATA controller driver
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <core/mmu.h>
+#include <defs.h>
+#include <hal/hal.h>
+#include <memlayout.h>
+#include <param.h>
+
+#include "ahci-regs.h"
+#include "ahci.h"
+
+static void ahci_port_stop(volatile struct AHCIPortRegs* regs) {
+	regs->cmd &= ~AHCI_PORT_CMD_ST;
+	while (regs->cmd & AHCI_PORT_CMD_CR) {
+	}
+	regs->cmd &= ~AHCI_PORT_CMD_FRE;
+	while (regs->cmd & AHCI_PORT_CMD_FR) {
+	}
+}
+
+static void ahci_port_start(volatile struct AHCIPortRegs* regs) {
+	regs->cmd |= AHCI_PORT_CMD_FRE | AHCI_PORT_CMD_SUD | AHCI_PORT_CMD_POD;
+	while (regs->tfd & (AHCI_PORT_TFD_BSY | AHCI_PORT_TFD_DRQ)) {
+	}
+	regs->cmd |= AHCI_PORT_CMD_ST;
+}
+
+static int ahci_prd_add(volatile struct AHCICommandTable* table, int n, phyaddr_t addr,
+						unsigned int len) {
+	if (n && table->prdt[n - 1].dba + table->prdt[n - 1].dbc + 1 == addr) {
+		table->prdt[n - 1].dbc += len;
+		return n;
+	}
+	if (n == AHCI_SEG_MAX) {
+		return ERROR_INVAILD;
+	}
+	table->prdt[n].dba = addr;
+	table->prdt[n].dbau = 0;
+	table->prdt[n].reserved = 0;
+	table->prdt[n].dbc = len - 1;
+	return n + 1;
+}
+
+// Add a kernel buffer to the PRD table after entry n, return the entries used
+static int ahci_prd_kva(volatile struct AHCICommandTable* table, int n, const void* va,
+						unsigned int size) {
+	while (size && n >= 0) {
+		unsigned int len = PGSIZE - ((unsigned int)va & (PGSIZE - 1));
+		if (len > size) {
+			len = size;
+		}
+		phyaddr_t pa = kva2pa(va);
+		if (!pa) {
+			return ERROR_INVAILD;
+		}
+		n = ahci_prd_add(table, n, pa, len);
+		va += len;
+		size -= len;
+	}
+	return n;
+}
+
+// Describe the data of a request chain, or bytes of buf if there is no
+// request, in the PRD table. Return the number of entries.
+static int ahci_fill_prdt(volatile struct AHCICommandTable* table, struct BlockRequest* req,
+						  const void* buf, unsigned int bytes) {
+	if (!req) {
+		return ahci_prd_kva(table, 0, buf, bytes);
+	}
+	int n = 0;
+	for (; req && n >= 0; req = req->next) {
+		if (req->sg) {
+			for (unsigned int i = 0; i < req->nsg && n >= 0; i++) {
+				n = ahci_prd_add(table, n, req->sg[i].addr, req->sg[i].length);
+			}
+		} else {
+			n = ahci_prd_kva(table, n, req->buf, req->count * 512);
+		}
+	}
+	return n;
+}
+
+// Build and issue a command in a free slot, waiting for one if needed, return
+// the slot or ERROR_INVAILD if the data does not fit in a command.
+// Data commands are queued with NCQ when the drive supports it.
+// Called with port->lock held.
+static int ahci_start(struct AHCIPort* port, uint8_t cmd, unsigned int lba, unsigned int count,
+					  struct BlockRequest* req, const void* buf, unsigned int bytes) {
+	int write = cmd == AHCI_ATA_WRITE_DMA_EXT;
+	int queued = port->ncq && (cmd == AHCI_ATA_READ_DMA_EXT || write);
+	int tag;
+	for (;;) {
+		uint32_t free = ~port->used & (port->nslots == 32 ? ~0u : (1u << port->nslots) - 1);
+		if (free) {
+			tag = __builtin_ctz(free);
+			break;
+		}
+		if (!myproc()) {
+			panic("ahci out of slots");
+		}
+		sleep(port, &port->lock);
+	}
+	volatile struct AHCICommandTable* table = port->table[tag];
+	int nprd = ahci_fill_prdt(table, req, buf, bytes);
+	if (nprd < 0) {
+		return ERROR_INVAILD;
+	}
+	port->used |= 1 << tag;
+
+	volatile struct FISRegH2D* fis = (volatile struct FISRegH2D*)table->cfis;
+	fis->type = FIS_TYPE_REG_H2D;
+	fis->flags = 0x80;
+	fis->command = queued ? (write ? AHCI_ATA_WRITE_FPDMA_QUEUED : AHCI_ATA_READ_FPDMA_QUEUED)
+						  : cmd;
+	fis->lba0 = lba & 0xff;
+	fis->lba1 = (lba >> 8) & 0xff;
+	fis->lba2 = (lba >> 16) & 0xff;
+	fis->device = cmd == AHCI_ATA_IDENTIFY ? 0 : 0x40;
+	fis->lba3 = (lba >> 24) & 0xff;
+	fis->lba4 = 0;
+	fis->lba5 = 0;
+	// FPDMA QUEUED takes the count in the feature register and the tag in the count
+	fis->feature_lo = queued ? count & 0xff : 0;
+	fis->feature_hi = queued ? (count >> 8) & 0xff : 0;
+	fis->count_lo = queued ? tag << 3 : count & 0xff;
+	fis->count_hi = queued ? 0 : (count >> 8) & 0xff;
+	fis->icc = 0;
+	fis->control = 0;
+
+	volatile struct AHCICommandHeader* header = &port->cmdlist[tag];
+	header->flags = sizeof(struct FISRegH2D) / 4 | (write ? AHCI_CMD_WRITE : 0);
+	header->prdtl = nprd;
+	header->prdbc = 0;
+
+	struct AHCISlot* slot = &port->slot[tag];
+	slot->req = req;
+	slot->write = write;
+	slot->done = 0;
+	slot->status = 0;
+	port->active |= 1 << tag;
+	__sync_synchronize();
+	if (queued) {
+		port->regs->sact = 1 << tag;
+	}
+	port->regs->ci = 1 << tag;
+	return tag;
+}
+
+// Fail the commands outstanding after an error and restart the port
+static void ahci_port_recover(struct AHCIPort* port) {
+	volatile struct AHCIPortRegs* regs = port->regs;
+	cprintf("[ahci] port %d error is 0x%x tfd 0x%x serr 0x%x\n", port->port, regs->is,
+			regs->tfd, regs->serr);
+	ahci_port_stop(regs);
+	regs->serr = 0xffffffff;
+	regs->is = AHCI_PORT_IS_ERROR;
+	for (int i = 0; i < port->nslots; i++) {
+		if (port->active & (1 << i)) {
+			port->slot[i].status = port->slot[i].write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL;
+		}
+	}
+	ahci_port_start(regs);
+	port->error = 0;
+}
+
+// Process finished slots, return the number of commands completed
+static int ahci_port_reap(struct AHCIPort* port) {
+	int n = 0;
+	acquire(&port->lock);
+	// after an error every outstanding command is reported as failed
+	uint32_t busy = 0;
+	if (port->error || (port->regs->is & AHCI_PORT_IS_ERROR)) {
+		ahci_port_recover(port);
+	} else {
+		busy = port->regs->sact | port->regs->ci;
+	}
+	uint32_t finished = port->active & ~busy;
+	port->active &= ~finished;
+	while (finished) {
+		int tag = __builtin_ctz(finished);
+		finished &= ~(1 << tag);
+		n++;
+		struct AHCISlot* slot = &port->slot[tag];
+		struct BlockRequest* req = slot->req;
+		if (!req) {
+			slot->done = 1;
+			wakeup(slot);
+			continue;
+		}
+		slot->req = 0;
+		int status = slot->status;
+		port->used &= ~(1 << tag);
+		wakeup(port);
+		release(&port->lock);
+		hal_block_complete(req, status);
+		acquire(&port->lock);
+	}
+	release(&port->lock);
+	return n;
+}
+
+static void ahci_port_complete(void* private) {
+	ahci_port_reap(private);
+}
+
+// Synchronous command, polls at boot time instead of sleeping
+static int ahci_exec(struct AHCIPort* port, uint8_t cmd, unsigned int lba, unsigned int count,
+					 const void* buf, unsigned int bytes) {
+	int write = cmd == AHCI_ATA_WRITE_DMA_EXT;
+	acquire(&port->lock);
+	int tag = ahci_start(port, cmd, lba, count, 0, buf, bytes);
+	if (tag < 0) {
+		release(&port->lock);
+		return write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL;
+	}
+	struct AHCISlot* slot = &port->slot[tag];
+	while (!slot->done) {
+		if (myproc()) {
+			sleep(slot, &port->lock);
+		} else {
+			release(&port->lock);
+			ahci_port_reap(port);
+			acquire(&port->lock);
+		}
+	}
+	// the waiter owns the slot until here
+	int status = slot->status;
+	port->used &= ~(1 << tag);
+	wakeup(port);
+	release(&port->lock);
+	return status;
+}
+
+int ahci_read(void* private, unsigned int begin, int count, void* buf) {
+	if (count <= 0 || count > AHCI_MAX_SECTORS)
+		panic("ahci count");
+	return ahci_exec(private, AHCI_ATA_READ_DMA_EXT, begin, count, buf, count * 512);
+}
+
+int ahci_write(void* private, unsigned int begin, int count, const void* buf) {
+	if (count <= 0 || count > AHCI_MAX_SECTORS)
+		panic("ahci count");
+	return ahci_exec(private, AHCI_ATA_WRITE_DMA_EXT, begin, count, buf, count * 512);
+}
+
+// Asynchronous request, completed from ahci_port_reap
+static int ahci_submit(void* private, struct BlockRequest* req, unsigned int count) {
+	struct AHCIPort* port = private;
+	if (count == 0 || count > AHCI_MAX_SECTORS)
+		panic("ahci count");
+	acquire(&port->lock);
+	int tag = ahci_start(port, req->write ? AHCI_ATA_WRITE_DMA_EXT : AHCI_ATA_READ_DMA_EXT,
+						 req->lba, count, req, 0, 0);
+	release(&port->lock);
+	if (tag < 0) {
+		return req->write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL;
+	}
+	return 0;
+}
+
+static int ahci_poll(void* private, int cpu) {
+	return ahci_port_reap(private);
+}
+
+const struct BlockDeviceDriver ahci_block_driver = {
+	.block_read = ahci_read,
+	.block_write = ahci_write,
+	.submit = ahci_submit,
+	.max_sectors = AHCI_MAX_SECTORS,
+	.max_segments = AHCI_SEG_MAX,
+	.poll = ahci_poll,
+};
+
+static void ahci_intr(struct AHCIController* hba) {
+	uint32_t is = hba->regs->is;
+	for (int i = 0; i < 32; i++) {
+		struct AHCIPort* port = hba->port[i];
+		if (!(is & (1 << i)) || !port) {
+			continue;
+		}
+		uint32_t port_is = port->regs->is;
+		port->regs->is = port_is;
+		if (port_is & AHCI_PORT_IS_ERROR) {
+			port->error = 1;
+		}
+		work_schedule(&port->complete_work);
+	}
+	hba->regs->is = is;
+}
+
+static void ahci_msi_intr(void* private) {
+	ahci_intr(private);
+}
+
+static void ahci_intx_intr(struct PCIDevice* pcidev) {
+	ahci_intr(pcidev->private);
+}
+
+// Identify the drive, return 0 if it can be used
+static int ahci_port_identify(struct AHCIPort* port, char* model) {
+	uint16_t* identify = kalloc();
+	if (ahci_exec(port, AHCI_ATA_IDENTIFY, 0, 0, identify, 512) < 0) {
+		kfree(identify);
+		return -1;
+	}
+	for (int i = 0; i < 20; i++) {
+		model[i * 2] = identify[27 + i] >> 8;
+		model[i * 2 + 1] = identify[27 + i];
+	}
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; i--) {
+		model[i] = '\0';
+	}
+	if (!(identify[83] & (1 << 10))) {
+		kfree(identify);
+		return -1; // commands used need LBA48
+	}
+	// sectors beyond 32 bits are not reachable
+	port->sectors =
+		identify[102] || identify[103] ? 0xffffffff : identify[100] + (identify[101] << 16);
+	if ((port->hba->regs->cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8))) {
+		int depth = (identify[75] & 0x1f) + 1;
+		port->ncq = 1;
+		port->nslots = depth < port->nslots ? depth : port->nslots;
+	}
+	kfree(identify);
+	return 0;
+}
+
+static struct AHCIPort* ahci_port_init(struct AHCIController* hba, int n) {
+	volatile struct AHCIPortRegs* regs = &hba->regs->port[n];
+	// device present with the link up
+	if ((regs->ssts & 0xf) != 3 || ((regs->ssts >> 8) & 0xf) != 1) {
+		return 0;
+	}
+	if (regs->sig != AHCI_PORT_SIG_ATA) {
+		cprintf("[ahci] port %d signature 0x%x not supported\n", n, regs->sig);
+		return 0;
+	}
+	struct AHCIPort* port = kalloc();
+	memset(port, 0, sizeof(struct AHCIPort));
+	port->hba = hba;
+	port->regs = regs;
+	port->port = n;
+	port->nslots = hba->nslots;
+	initlock(&port->lock, "ahci");
+	work_init(&port->complete_work, ahci_port_complete, port);
+
+	ahci_port_stop(regs);
+	void* page = kalloc();
+	memset(page, 0, PGSIZE);
+	port->cmdlist = page;
+	regs->clb = V2P(page);
+	regs->clbu = 0;
+	regs->fb = V2P(page) + 1024;
+	regs->fbu = 0;
+	for (int i = 0; i < port->nslots; i++) {
+		port->table[i] = kalloc();
+		memset((void*)port->table[i], 0, PGSIZE);
+		port->cmdlist[i].ctba = V2P(port->table[i]);
+		port->cmdlist[i].ctbau = 0;
+	}
+	regs->serr = 0xffffffff;
+	regs->is = 0xffffffff;
+	regs->ie = AHCI_PORT_IS_DHRS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERROR;
+	ahci_port_start(regs);
+	hba->port[n] = port;
+
+	char model[41];
+	if (ahci_port_identify(port, model) < 0) {
+		cprintf("[ahci] port %d identify failed\n", n);
+		hba->port[n] = 0;
+		ahci_port_stop(regs);
+		return 0;
+	}
+	cprintf("[ahci] port %d disk %s %d sectors%s depth %d\n", n, model, port->sectors,
+			port->ncq ? " NCQ" : "", port->nslots);
+	return port;
+}
+
+static void ahci_dev_init(struct PCIDevice* pcidev) {
+	const struct PciAddress* addr = &pcidev->addr;
+	struct AHCIController* hba = kalloc();
+	memset(hba, 0, sizeof(struct AHCIController));
+	hba->pcidev = pcidev;
+	pcidev->private = hba;
+	hba->regs = map_mmio_region(pci_read_bar(addr, 5), pci_read_bar_size(addr, 5));
+	pci_enable_bus_mastering(addr);
+	hba->regs->ghc |= AHCI_GHC_AE;
+	hba->nslots = ((hba->regs->cap >> 8) & 0x1f) + 1;
+
+	// one MSI vector for all ports, INTx otherwise
+	int vector = pci_msi_alloc_vector(ahci_msi_intr, hba);
+	if (vector && pci_msi_enable(addr, vector, cpus[0].apicid)) {
+		hba->msi = 1;
+	} else {
+		if (vector) {
+			pci_msi_free_vector(vector);
+		}
+		pci_register_intr_handler(pcidev, ahci_intx_intr);
+		pci_enable_intx_intr(addr);
+	}
+	cprintf("[ahci] Controller %d:%d.%d version %x ports %x slots %d%s %s\n", addr->bus,
+			addr->device, addr->function, hba->regs->vs, hba->regs->pi, hba->nslots,
+			hba->regs->cap & AHCI_CAP_SNCQ ? " NCQ" : "", hba->msi ? "MSI" : "INTx");
+	hba->regs->is = 0xffffffff;
+	hba->regs->ghc |= AHCI_GHC_IE;
+
+	uint32_t pi = hba->regs->pi;
+	for (int i = 0; i < 32; i++) {
+		if (pi & (1 << i)) {
+			struct AHCIPort* port = ahci_port_init(hba, i);
+			if (port) {
+				hal_block_register_device("ahci", port, &ahci_block_driver);
+			}
+		}
+	}
+}
+
+struct PCIDriver ahci_pci_driver = {
+	.name = "ahci",
+	.class_type = 0x010601, // SATA Controller AHCI
+	.init = ahci_dev_init,
+};
+
+void ahci_init(void) {
+	pci_register_driver(&ahci_pci_driver);
+}
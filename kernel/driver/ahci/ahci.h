@@ -0,0 +1,52 @@
+#ifndef _DRIVER_AHCI_AHCI_H
+#define _DRIVER_AHCI_AHCI_H
+
+#include <common/spinlock.h>
+#include <core/proc.h>
+#include <driver/pci/pci.h>
+
+#include "ahci-regs.h"
+
+#define AHCI_SLOT_MAX 32
+#define AHCI_MAX_SECTORS 1024 // per command
+#define AHCI_SEG_MAX 128 // PRD entries per command, a command table fits in a page
+
+// command in a slot, tag and slot are the same with NCQ
+struct AHCISlot {
+	struct BlockRequest* req; // asynchronous request, 0 if a thread is waiting
+	uint8_t write;
+	uint8_t done;
+	int status;
+};
+
+struct AHCIPort {
+	struct AHCIController* hba;
+	volatile struct AHCIPortRegs* regs;
+	int port;
+	struct spinlock lock;
+	struct WorkItem complete_work; // completion processing outside IRQ
+	volatile struct AHCICommandHeader* cmdlist; // received FIS follows in the page
+	volatile struct AHCICommandTable* table[AHCI_SLOT_MAX];
+	struct AHCISlot slot[AHCI_SLOT_MAX];
+	uint32_t used; // slots allocated
+	uint32_t active; // slots issued and not reaped yet
+	volatile int error; // error interrupt seen
+	int nslots; // slots used, the queue depth with NCQ
+	int ncq;
+	unsigned int sectors;
+};
+
+struct AHCIController {
+	struct PCIDevice* pcidev;
+	volatile struct AHCIHBARegs* regs;
+	int nslots;
+	int msi;
+	struct AHCIPort* port[32];
+};
+
+// ahci.c
+void ahci_init(void);
+int ahci_read(void* private, unsigned int begin, int count, void* buf);
+int ahci_write(void* private, unsigned int begin, int count, const void* buf);
+
+#endif
@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <common/x86.h>
 #include <defs.h>
 #include <driver/ioapic.h>
@@ -31,10 +32,13 @@ const static char* pci_native_str[] = {"ISA Compatibility", "PCI Native"};
 
 struct ATABMDMAPRD {
 	uint32_t base;
-	uint16_t size;
+	uint16_t size; // 0 is 64 KiB
 	uint16_t eot;
 } PACKED;
 
+// adapter in ISA compatibility mode, interrupts on IRQ 14 and 15
+static struct ATAAdapter* ata_legacy_adapter;
+
 static struct ATAAdapter* ata_adapter_alloc(void) {
 	struct ATAAdapter* dev = kalloc();
 	memset(dev, 0, sizeof(struct ATAAdapter));
@@ -89,6 +93,8 @@ void ata_adapter_dev_init(struct PCIDevice* pcidev) {
 	// enable PCI interrupt
 	if (adapter->pci_native) {
 		pci_register_intr_handler(pcidev, ata_pci_intr);
+	} else if (!ata_legacy_adapter) {
+		ata_legacy_adapter = adapter;
 	}
 	release(&adapter->lock[0]);
 	ata_register_adapter(adapter);
@@ -101,17 +107,47 @@ void ata_adapter_bmdma_init(struct ATAAdapter* dev, int channel, int drive) {
 	outb(bmdma_base + 2, bmdma_status);
 }
 
-void ata_adapter_bmdma_prepare(struct ATAAdapter* dev, int channel, phyaddr_t addr,
-							   unsigned int size) {
+// Build the PRD table for a kernel buffer, an entry per physically contiguous
+// piece which does not cross a 64 KiB boundary
+int ata_adapter_bmdma_prepare(struct ATAAdapter* dev, int channel, const void* buf,
+							  unsigned int size) {
 	volatile struct ATABMDMAPRD* prd = dev->prd[channel];
-	prd[0].base = addr;
-	prd[0].size = size;
-	prd[0].eot = 0x8000;
+	int n = 0;
+	unsigned int len = 0; // of entry n - 1, the size field wraps at 64 KiB
+	while (size) {
+		unsigned int piece = PGSIZE - ((unsigned int)buf & (PGSIZE - 1));
+		if (piece > size) {
+			piece = size;
+		}
+		phyaddr_t pa = kva2pa(buf);
+		if (!pa || (pa & 1)) {
+			return ERROR_INVAILD;
+		}
+		if (n && prd[n - 1].base + len == pa && (pa & 0xffff) && len + piece <= 0x10000) {
+			len += piece;
+		} else {
+			if (n == ATA_PRD_MAX) {
+				return ERROR_INVAILD;
+			}
+			prd[n].base = pa;
+			prd[n].eot = 0;
+			len = piece;
+			n++;
+		}
+		prd[n - 1].size = len;
+		buf += piece;
+		size -= piece;
+	}
+	if (!n) {
+		return ERROR_INVAILD;
+	}
+	prd[n - 1].eot = 0x8000;
 	ioport_t bmdma_base = dev->bus_master_base + channel * 8;
 	outdw(bmdma_base + 4, V2P(prd));
 	uint8_t bmdma_status = inb(bmdma_base + 2);
 	bmdma_status |= 6;
 	outb(bmdma_base + 2, bmdma_status);
+	return 0;
 }
 
 void ata_adapter_bmdma_start_write(struct ATAAdapter* dev, int channel) {
@@ -134,15 +170,16 @@ int ata_adapter_bmdma_busy(struct ATAAdapter* dev, int channel) {
 	return inb(bmdma_base + 2) & 1;
 }
 
-void ata_adapter_bmdma_stop(struct ATAAdapter* dev, int channel) {
+// Stop the engine, return nonzero on a DMA error
+int ata_adapter_bmdma_stop(struct ATAAdapter* dev, int channel) {
 	ioport_t bmdma_base = dev->bus_master_base + channel * 8;
 	outb(bmdma_base + 0, 0);
 	uint8_t bmdma_status = inb(bmdma_base + 2);
 	if (bmdma_status & 2) {
 		cprintf("[ata] BMDMA error\n");
 	}
-	bmdma_status |= 6;
-	outb(bmdma_base + 2, bmdma_status);
+	outb(bmdma_base + 2, bmdma_status | 6);
+	return bmdma_status & 2;
 }
 
 struct PCIDriver ata_adapter_pci_driver = {
@@ -159,6 +196,30 @@ void ata_adapter_init(void) {
 	pci_register_driver(&ata_adapter_pci_driver);
 }
 
-void ata_legacy_intr(int irq) {}
+// Acknowledge the drive and wake the DMA waiter of the channel
+static void ata_adapter_channel_intr(struct ATAAdapter* adapter, int channel) {
+	if (adapter->bus_master &&
+		!(inb(adapter->bus_master_base + channel * 8 + 2) & 4)) {
+		return; // not this channel, the PCI interrupt may be shared
+	}
+	acquire(&adapter->lock[channel]);
+	inb(adapter->cmdblock_base[channel] + 7); // status read clears INTRQ
+	if (adapter->dma_active[channel]) {
+		adapter->dma_active[channel] = 0;
+		adapter->dma_done[channel] = 1;
+		wakeup(&adapter->dma_done[channel]);
+	}
+	release(&adapter->lock[channel]);
+}
 
-void ata_pci_intr(struct PCIDevice* dev) {}
+void ata_legacy_intr(int irq) {
+	if (ata_legacy_adapter) {
+		ata_adapter_channel_intr(ata_legacy_adapter, irq - 14);
+	}
+}
+
+void ata_pci_intr(struct PCIDevice* dev) {
+	struct ATAAdapter* adapter = dev->private;
+	ata_adapter_channel_intr(adapter, 0);
+	ata_adapter_channel_intr(adapter, 1);
+}
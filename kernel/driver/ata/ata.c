@@ -54,7 +54,11 @@ enum AtaStatus {
 
 enum AtaCommands {
 	ATA_COMMAND_READ_SECTOR = 0x20,
+	ATA_COMMAND_READ_SECTOR_EXT = 0x24,
+	ATA_COMMAND_READ_DMA_EXT = 0x25,
 	ATA_COMMAND_WRITE_SECTOR = 0x30,
+	ATA_COMMAND_WRITE_SECTOR_EXT = 0x34,
+	ATA_COMMAND_WRITE_DMA_EXT = 0x35,
 	ATA_COMMAND_READ_DMA = 0xc8,
 	ATA_COMMAND_WRITE_DMA = 0xca,
 	ATA_COMMAND_IDENTIFY = 0xec,
@@ -106,6 +110,12 @@ int ata_identify(struct ATAAdapter* adapter, int channel, int drive, struct ATAD
 	dev->channel = channel;
 	dev->drive = drive;
 	dev->sectors = identify[60] + (identify[61] << 16);
+	if (identify[83] & (1 << 10)) {
+		dev->lba48 = 1;
+		// sectors beyond 32 bits are not reachable
+		dev->sectors = identify[102] || identify[103] ? 0xffffffff
+													  : identify[100] + (identify[101] << 16);
+	}
 
 	if (identify[49] & (1 << 8)) {
 		dev->dma = 1;
@@ -140,161 +150,201 @@ void ata_bus_reset(const struct ATAAdapter* adapter, int channel) {
 	outb(adapter->control_base[channel], 0);
 }
 
-int ata_exec_pio_in(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
-					unsigned int lba, unsigned int count, void* buf, int blocks) {
-	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	outb(iobase + ATA_IO_DRIVE,
-		 ATA_DRIVE_DEFAULT | (drive << ATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf));
-	outb(iobase + ATA_IO_COUNT, count);
+static int ata_command_lba48(uint8_t cmd) {
+	return cmd == ATA_COMMAND_READ_SECTOR_EXT || cmd == ATA_COMMAND_READ_DMA_EXT ||
+		   cmd == ATA_COMMAND_WRITE_SECTOR_EXT || cmd == ATA_COMMAND_WRITE_DMA_EXT;
+}
+
+// Load the task file and issue cmd, EXT commands take a 48-bit LBA and a
+// 16-bit count written high byte first
+static void ata_issue(ioport_t iobase, int drive, uint8_t cmd, unsigned int lba,
+					  unsigned int count) {
+	if (ata_command_lba48(cmd)) {
+		outb(iobase + ATA_IO_DRIVE, 0x40 | (drive << ATA_DRIVE_DRV_BIT));
+		outb(iobase + ATA_IO_COUNT, (count >> 8) & 0xff);
+		outb(iobase + ATA_IO_LBALO, (lba >> 24) & 0xff);
+		outb(iobase + ATA_IO_LBAMID, 0);
+		outb(iobase + ATA_IO_LBAHI, 0);
+	} else {
+		outb(iobase + ATA_IO_DRIVE,
+			 ATA_DRIVE_DEFAULT | (drive << ATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf));
+	}
+	outb(iobase + ATA_IO_COUNT, count & 0xff);
 	outb(iobase + ATA_IO_LBALO, lba & 0xff);
 	outb(iobase + ATA_IO_LBAMID, (lba >> 8) & 0xff);
 	outb(iobase + ATA_IO_LBAHI, (lba >> 16) & 0xff);
 	outb(iobase + ATA_IO_COMMAND, cmd);
-	// check status
-	for (int i = 0; i < blocks; i++) {
-		while (inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) {
-		}
-		uint8_t status = inb(iobase + ATA_IO_STATUS);
-		if (status == 0 || status & ATA_STATUS_ERR) {
-			release(&adapter->lock[channel]);
-			return -1;
-		}
-		insw(iobase + ATA_IO_DATA, buf + 512 * i, 512 / 2);
-	}
-	release(&adapter->lock[channel]);
-	return 0;
 }
 
-int ata_exec_dma_in(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
-					unsigned int lba, unsigned int count, void* buf, int blocks) {
-	ioport_t iobase = adapter->cmdblock_base[channel];
+// Own the channel, returns with its lock held
+static void ata_channel_begin(struct ATAAdapter* adapter, int channel) {
 	acquire(&adapter->lock[channel]);
-	ata_adapter_bmdma_prepare(adapter, channel, V2P(buf), blocks * 512);
-	outb(iobase + ATA_IO_DRIVE,
-		 ATA_DRIVE_DEFAULT | (drive << ATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf));
-	outb(iobase + ATA_IO_COUNT, count);
-	outb(iobase + ATA_IO_LBALO, lba & 0xff);
-	outb(iobase + ATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + ATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + ATA_IO_COMMAND, cmd);
-	ata_adapter_bmdma_start_write(adapter, channel);
-	// check status
-	while ((inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) ||
-		   ata_adapter_bmdma_busy(adapter, channel)) {
-	}
-	ata_adapter_bmdma_stop(adapter, channel);
-	uint8_t status = inb(iobase + ATA_IO_STATUS);
-	if (status == 0 || status & ATA_STATUS_ERR) {
-		release(&adapter->lock[channel]);
-		return -1;
+	while (adapter->busy[channel]) {
+		sleep(&adapter->busy[channel], &adapter->lock[channel]);
 	}
+	adapter->busy[channel] = 1;
+}
+
+static void ata_channel_end(struct ATAAdapter* adapter, int channel) {
+	adapter->busy[channel] = 0;
+	wakeup(&adapter->busy[channel]);
 	release(&adapter->lock[channel]);
-	return 0;
 }
 
-int ata_read(void* private, unsigned int begin, int count, void* buf) {
-	struct ATADevice* dev = private;
-	if (dev->use_dma) {
-		if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
-			(phyaddr_t)buf % PGSIZE)
-			panic("ata dma");
-		if (count == 0 || count > 8)
-			panic("ata count");
-		if (ata_exec_dma_in(dev->adapter, dev->channel, dev->drive, ATA_COMMAND_READ_DMA, begin,
-							count, buf, count)) {
-			return ERROR_READ_FAIL;
+int ata_exec_pio_in(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
+					unsigned int lba, unsigned int count, void* buf, int blocks) {
+	ioport_t iobase = adapter->cmdblock_base[channel];
+	ata_channel_begin(adapter, channel);
+	ata_issue(iobase, drive, cmd, lba, count);
+	// check status
+	for (int i = 0; i < blocks; i++) {
+		while (inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) {
 		}
-	} else {
-		if (ata_exec_pio_in(dev->adapter, dev->channel, dev->drive, ATA_COMMAND_READ_SECTOR, begin,
-							count, buf, count)) {
-			return ERROR_READ_FAIL;
+		uint8_t status = inb(iobase + ATA_IO_STATUS);
+		if (status == 0 || status & ATA_STATUS_ERR) {
+			ata_channel_end(adapter, channel);
+			return -1;
 		}
+		insw(iobase + ATA_IO_DATA, buf + 512 * i, 512 / 2);
 	}
+	ata_channel_end(adapter, channel);
 	return 0;
 }
 
 int ata_exec_pio_out(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
 					 unsigned int lba, unsigned int count, const void* buf, int blocks) {
 	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	outb(iobase + ATA_IO_DRIVE,
-		 ATA_DRIVE_DEFAULT | (drive << ATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf));
-	outb(iobase + ATA_IO_COUNT, count);
-	outb(iobase + ATA_IO_LBALO, lba & 0xff);
-	outb(iobase + ATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + ATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + ATA_IO_COMMAND, cmd);
+	ata_channel_begin(adapter, channel);
+	ata_issue(iobase, drive, cmd, lba, count);
 	// check status
 	for (int i = 0; i < blocks; i++) {
 		while (inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) {
 		}
 		uint8_t status = inb(iobase + ATA_IO_STATUS);
 		if (status == 0 || status & ATA_STATUS_ERR) {
-			release(&adapter->lock[channel]);
+			ata_channel_end(adapter, channel);
 			return -1;
 		}
 		outsw(iobase + ATA_IO_DATA, buf + 512 * i, 512 / 2);
 	}
 	while (inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) {
 	}
-	release(&adapter->lock[channel]);
+	ata_channel_end(adapter, channel);
 	return 0;
 }
 
-int ata_exec_dma_out(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
-					 unsigned int lba, unsigned int count, const void* buf, int blocks) {
+// Bus-master DMA of count sectors, sleeping until the completion interrupt.
+// Polls at boot time when there is no process to sleep.
+static int ata_exec_dma(struct ATAAdapter* adapter, int channel, int drive, uint8_t cmd,
+						unsigned int lba, unsigned int count, const void* buf, int write) {
 	ioport_t iobase = adapter->cmdblock_base[channel];
-	acquire(&adapter->lock[channel]);
-	ata_adapter_bmdma_prepare(adapter, channel, V2P(buf), blocks * 512);
-	outb(iobase + ATA_IO_DRIVE,
-		 ATA_DRIVE_DEFAULT | (drive << ATA_DRIVE_DRV_BIT) | ((lba >> 24) & 0xf));
-	outb(iobase + ATA_IO_COUNT, count);
-	outb(iobase + ATA_IO_LBALO, lba & 0xff);
-	outb(iobase + ATA_IO_LBAMID, (lba >> 8) & 0xff);
-	outb(iobase + ATA_IO_LBAHI, (lba >> 16) & 0xff);
-	outb(iobase + ATA_IO_COMMAND, cmd);
-	ata_adapter_bmdma_start_read(adapter, channel);
-	// check status
-	while ((inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) ||
-		   ata_adapter_bmdma_busy(adapter, channel)) {
+	ata_channel_begin(adapter, channel);
+	if (ata_adapter_bmdma_prepare(adapter, channel, buf, count * 512) < 0) {
+		ata_channel_end(adapter, channel);
+		return -1;
+	}
+	adapter->dma_done[channel] = 0;
+	adapter->dma_active[channel] = myproc() != 0;
+	ata_issue(iobase, drive, cmd, lba, count);
+	if (write) {
+		ata_adapter_bmdma_start_read(adapter, channel);
+	} else {
+		ata_adapter_bmdma_start_write(adapter, channel);
 	}
-	ata_adapter_bmdma_stop(adapter, channel);
+	if (myproc()) {
+		while (!adapter->dma_done[channel]) {
+			sleep(&adapter->dma_done[channel], &adapter->lock[channel]);
+		}
+	} else {
+		while ((inb(iobase + ATA_IO_STATUS) & ATA_STATUS_BSY) ||
+			   ata_adapter_bmdma_busy(adapter, channel)) {
+		}
+	}
+	int dma_error = ata_adapter_bmdma_stop(adapter, channel);
 	uint8_t status = inb(iobase + ATA_IO_STATUS);
-	if (status == 0 || status & ATA_STATUS_ERR) {
-		release(&adapter->lock[channel]);
+	ata_channel_end(adapter, channel);
+	if (dma_error || status == 0 || status & ATA_STATUS_ERR) {
 		return -1;
 	}
-	release(&adapter->lock[channel]);
 	return 0;
 }
 
-int ata_write(void* private, unsigned int begin, int count, const void* buf) {
+// EXT command needed for the LBA or count, 0 if not, -1 if the drive lacks LBA48
+static int ata_need_lba48(struct ATADevice* dev, unsigned int begin, int count) {
+	if (begin + count <= (1 << 28) && count <= 256) {
+		return 0;
+	}
+	return dev->lba48 ? 1 : -1;
+}
+
+int ata_read(void* private, unsigned int begin, int count, void* buf) {
 	struct ATADevice* dev = private;
+	int ext = ata_need_lba48(dev, begin, count);
+	if (count <= 0 || ext < 0) {
+		return ERROR_INVAILD;
+	}
 	if (dev->use_dma) {
-		if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP ||
-			(phyaddr_t)buf % PGSIZE)
-			panic("ata dma");
-		if (count == 0 || count > 8)
+		if (count > ATA_DMA_MAX_SECTORS)
 			panic("ata count");
-		if (ata_exec_dma_out(dev->adapter, dev->channel, dev->drive, ATA_COMMAND_WRITE_DMA, begin,
-							 count, buf, count)) {
+		if (ata_exec_dma(dev->adapter, dev->channel, dev->drive,
+						 ext ? ATA_COMMAND_READ_DMA_EXT : ATA_COMMAND_READ_DMA, begin, count,
+						 buf, 0)) {
 			return ERROR_READ_FAIL;
 		}
 	} else {
-		if (ata_exec_pio_out(dev->adapter, dev->channel, dev->drive, ATA_COMMAND_WRITE_SECTOR,
-							 begin, count, buf, count)) {
+		if (ata_exec_pio_in(dev->adapter, dev->channel, dev->drive,
+							ext ? ATA_COMMAND_READ_SECTOR_EXT : ATA_COMMAND_READ_SECTOR, begin,
+							count, buf, count)) {
 			return ERROR_READ_FAIL;
 		}
 	}
 	return 0;
 }
 
+int ata_write(void* private, unsigned int begin, int count, const void* buf) {
+	struct ATADevice* dev = private;
+	int ext = ata_need_lba48(dev, begin, count);
+	if (count <= 0 || ext < 0) {
+		return ERROR_INVAILD;
+	}
+	if (dev->use_dma) {
+		if (count > ATA_DMA_MAX_SECTORS)
+			panic("ata count");
+		if (ata_exec_dma(dev->adapter, dev->channel, dev->drive,
+						 ext ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_WRITE_DMA, begin, count,
+						 buf, 1)) {
+			return ERROR_WRITE_FAIL;
+		}
+	} else {
+		if (ata_exec_pio_out(dev->adapter, dev->channel, dev->drive,
+							 ext ? ATA_COMMAND_WRITE_SECTOR_EXT : ATA_COMMAND_WRITE_SECTOR,
+							 begin, count, buf, count)) {
+			return ERROR_WRITE_FAIL;
+		}
+	}
+	return 0;
+}
+
 const struct BlockDeviceDriver ata_block_driver = {
 	.block_read = ata_read,
 	.block_write = ata_write,
 };
 
+// DMA takes any kernel buffer through the PRD table
+const struct BlockDeviceDriver ata_dma_block_driver = {
+	.block_read = ata_read,
+	.block_write = ata_write,
+	.max_sectors = 256,
+	.max_segments = ATA_DMA_SEG_MAX,
+};
+
+const struct BlockDeviceDriver ata_dma48_block_driver = {
+	.block_read = ata_read,
+	.block_write = ata_write,
+	.max_sectors = ATA_DMA_MAX_SECTORS,
+	.max_segments = ATA_DMA_SEG_MAX,
+};
+
 void ata_register_adapter(struct ATAAdapter* adapter) {
 	for (int channel = 0; channel < 2; channel++) {
 		ata_bus_reset(adapter, channel);
@@ -322,7 +372,11 @@ void ata_register_adapter(struct ATAAdapter* adapter) {
 						ata_dev->use_dma = 0;
 						cprintf("[ata] Use PIO for channel %d drive %d\n", channel, drive);
 					}
-					hal_block_register_device("ata", ata_dev, &ata_block_driver);
+					const struct BlockDeviceDriver* driver = &ata_block_driver;
+					if (ata_dev->use_dma) {
+						driver = ata_dev->lba48 ? &ata_dma48_block_driver : &ata_dma_block_driver;
+					}
+					hal_block_register_device("ata", ata_dev, driver);
 				}
 			} else if (devtype[drive] == ATA_SIGNATURE_PACKET) {
 				cprintf("[ata] ATAPI device found\n");
@@ -6,6 +6,10 @@
 
 struct ATABMDMAPRD;
 
+#define ATA_PRD_MAX 512 // entries in a page of PRD table
+#define ATA_DMA_MAX_SECTORS 2048 // per LBA48 command, 256 without
+#define ATA_DMA_SEG_MAX 256 // pages per DMA command
+
 struct ATAAdapter {
 	ioport_t cmdblock_base[2];
 	ioport_t control_base[2];
@@ -16,6 +20,9 @@ struct ATAAdapter {
 	};
 	struct ATABMDMAPRD* prd[2];
 	struct spinlock lock[2];
+	uint8_t busy[2]; // a command is running, the lock is dropped while DMA sleeps
+	uint8_t dma_active[2]; // waiting for the DMA completion interrupt
+	uint8_t dma_done[2];
 };
 
 struct ATADevice {
@@ -24,6 +31,7 @@ struct ATADevice {
 		unsigned char channel : 1; // primary/secondary
 		unsigned char drive : 1; // master/slave
 		unsigned char use_dma : 1; // use DMA
+		unsigned char lba48 : 1; // 48-bit LBA commands supported
 	};
 	unsigned int sectors; // number of sectors
 	char dma, pio, mdma, udma, ata_rev;
@@ -49,11 +57,11 @@ void ata_adapter_init(void);
 void ata_legacy_intr(int irq);
 void ata_pci_intr(struct PCIDevice* dev);
 void ata_adapter_bmdma_init(struct ATAAdapter* dev, int channel, int drive);
-void ata_adapter_bmdma_prepare(struct ATAAdapter* dev, int channel, phyaddr_t addr,
-							   unsigned int size);
+int ata_adapter_bmdma_prepare(struct ATAAdapter* dev, int channel, const void* buf,
+							  unsigned int size);
 void ata_adapter_bmdma_start_write(struct ATAAdapter* dev, int channel);
 void ata_adapter_bmdma_start_read(struct ATAAdapter* dev, int channel);
 int ata_adapter_bmdma_busy(struct ATAAdapter* dev, int channel);
-void ata_adapter_bmdma_stop(struct ATAAdapter* dev, int channel);
+int ata_adapter_bmdma_stop(struct ATAAdapter* dev, int channel);
 
 #endif
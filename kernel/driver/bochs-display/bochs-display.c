@@ -30,6 +30,7 @@
 #include <defs.h>
 #include <driver/pci/pci.h>
 #include <hal/hal.h>
+#include <memlayout.h>
 
 #include "bochs-display.h"
 
@@ -78,13 +79,16 @@ static void vbe_write(struct BochsDisplayDevice* dev, int reg, uint16_t val) {
 	}
 }
 
-static phyaddr_t bochs_display_enable(void* private, int xres, int yres) {
+static void* bochs_display_enable(void* private, int xres, int yres) {
 	struct BochsDisplayDevice* dev = private;
+	if (dev->vram < DEVSPACE) { // only device space is mapped in the kernel
+		return 0;
+	}
 	vbe_write(dev, VBE_DISPI_INDEX_XRES, xres);
 	vbe_write(dev, VBE_DISPI_INDEX_YRES, yres);
 	vbe_write(dev, VBE_DISPI_INDEX_BPP, 32);
 	vbe_write(dev, VBE_DISPI_INDEX_ENABLE, VBE_DISPI_ENABLED | VBE_DISPI_VBE_ENABLED);
-	return dev->vram;
+	return map_ram_region(dev->vram, 16 * 1024 * 1024);
 }
 
 static void bochs_display_disable(void* private) {
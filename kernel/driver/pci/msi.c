@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <common/errorcode.h>
 #include <defs.h>
 
 #include "pci.h"
@@ -94,3 +95,64 @@ void pci_msi_disable(const struct PciAddress* addr) {
 	msictl &= ~1;
 	pci_write_config_reg16(addr, capoff + 2, msictl);
 }
+
+// MSI-X table in the BAR given by the capability, size is set to its entries
+static volatile uint32_t* pci_msix_table(const struct PciAddress* addr, int capoff, int* size) {
+	uint16_t msixctl = pci_read_config_reg16(addr, capoff + 2);
+	uint32_t table = pci_read_config_reg32(addr, capoff + 4);
+	*size = (msixctl & 0x7ff) + 1;
+	return map_mmio_region(pci_read_bar(addr, table & 7) + (table & ~7), *size * 16);
+}
+
+// Enable MSI-X with every entry masked, return the number of entries or 0
+// if the device has no MSI-X
+int pci_msix_enable(const struct PciAddress* addr) {
+	int capoff = pci_find_capability(addr, 0x11);
+	if (!capoff) {
+		return 0;
+	}
+	int size;
+	volatile uint32_t* table = pci_msix_table(addr, capoff, &size);
+	for (int i = 0; i < size; i++) {
+		table[i * 4 + 3] |= 1;
+	}
+	uint16_t msixctl = pci_read_config_reg16(addr, capoff + 2);
+	msixctl |= 1 << 15; // enable
+	msixctl &= ~(1 << 14); // function mask
+	pci_write_config_reg16(addr, capoff + 2, msixctl);
+	pci_enable_bus_mastering(addr);
+	cprintf("[pci] MSI-X %d:%d.%d off %x entries %d\n", addr->bus, addr->device, addr->function,
+			capoff, size);
+	return size;
+}
+
+// Point an MSI-X entry at a vector on the CPU with the given local APIC ID
+// and unmask it
+int pci_msix_set_vector(const struct PciAddress* addr, int entry, int vector, int lapicid) {
+	int capoff = pci_find_capability(addr, 0x11);
+	if (!capoff) {
+		return ERROR_INVAILD;
+	}
+	int size;
+	volatile uint32_t* table = pci_msix_table(addr, capoff, &size);
+	if (entry < 0 || entry >= size) {
+		return ERROR_INVAILD;
+	}
+	volatile uint32_t* ent = table + entry * 4;
+	ent[3] |= 1;
+	ent[0] = 0xfee00000 | lapicid << 12;
+	ent[1] = 0;
+	ent[2] = vector;
+	ent[3] &= ~1;
+	return 0;
+}
+
+void pci_msix_disable(const struct PciAddress* addr) {
+	int capoff = pci_find_capability(addr, 0x11);
+	if (!capoff) {
+		return;
+	}
+	uint16_t msixctl = pci_read_config_reg16(addr, capoff + 2);
+	msixctl &= ~(1 << 15);
+	pci_write_config_reg16(addr, capoff + 2, msixctl);
+}
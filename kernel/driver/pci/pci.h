@@ -101,6 +101,9 @@ int pci_msi_alloc_vector(void (*handler)(void*), void* private);
 void pci_msi_free_vector(int vector);
 int pci_msi_enable(const struct PciAddress* addr, int vector, int lapicid);
 void pci_msi_disable(const struct PciAddress* addr);
+int pci_msix_enable(const struct PciAddress* addr);
+int pci_msix_set_vector(const struct PciAddress* addr, int entry, int vector, int lapicid);
+void pci_msix_disable(const struct PciAddress* addr);
 
 // driver.c
 void pci_add_device(const struct PciAddress* addr, uint16_t vendor_id,
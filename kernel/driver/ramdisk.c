@@ -0,0 +1,217 @@
+/*
+ * RAM disk driver
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/mmu.h>
+#include <defs.h>
+#include <filesystem/vfs/vfs.h>
+#include <hal/hal.h>
+#include <memlayout.h>
+#include <proc/kcall.h>
+
+#include "ramdisk.h"
+
+#define RAMDISK_MAX 4
+#define RAMDISK_SECTORS_PER_PAGE (PGSIZE / 512)
+
+struct RamDisk {
+	unsigned int sectors; // 0 if the slot is free
+	char** page; // kalloc'd pages backing the disk, in order
+};
+
+static struct {
+	struct spinlock lock;
+	struct RamDisk disk[RAMDISK_MAX];
+} ramdisk;
+
+static unsigned int ramdisk_boot_size; // MiB, from ramdisk= on the command line
+
+// Copy count sectors from begin between the disk and buf, a page at a time
+static int ramdisk_copy(struct RamDisk* rd, unsigned int begin, int count, void* buf, int write) {
+	if (count < 0 || begin >= rd->sectors || count > rd->sectors - begin) {
+		return ERROR_INVAILD;
+	}
+	while (count) {
+		unsigned int off = begin % RAMDISK_SECTORS_PER_PAGE;
+		unsigned int n = RAMDISK_SECTORS_PER_PAGE - off;
+		if (n > count) {
+			n = count;
+		}
+		char* data = rd->page[begin / RAMDISK_SECTORS_PER_PAGE] + off * 512;
+		if (write) {
+			memmove(data, buf, n * 512);
+		} else {
+			memmove(buf, data, n * 512);
+		}
+		begin += n;
+		count -= n;
+		buf += n * 512;
+	}
+	return 0;
+}
+
+static int ramdisk_read(void* private, unsigned int begin, int count, void* buf) {
+	return ramdisk_copy(private, begin, count, buf, 0);
+}
+
+static int ramdisk_write(void* private, unsigned int begin, int count, const void* buf) {
+	return ramdisk_copy(private, begin, count, (void*)buf, 1);
+}
+
+// discarded sectors read back as zeroes like written zeroes
+static int ramdisk_zero(void* private, const struct BlockRange* range, int count) {
+	struct RamDisk* rd = private;
+	for (int i = 0; i < count; i++) {
+		unsigned int lba = range[i].lba, n = range[i].count;
+		if (lba >= rd->sectors || n > rd->sectors - lba) {
+			return ERROR_INVAILD;
+		}
+		while (n) {
+			unsigned int off = lba % RAMDISK_SECTORS_PER_PAGE;
+			unsigned int len = RAMDISK_SECTORS_PER_PAGE - off;
+			if (len > n) {
+				len = n;
+			}
+			memset(rd->page[lba / RAMDISK_SECTORS_PER_PAGE] + off * 512, 0, len * 512);
+			lba += len;
+			n -= len;
+		}
+	}
+	return 0;
+}
+
+static const struct BlockDeviceDriver ramdisk_block_driver = {
+	.block_read = ramdisk_read,
+	.block_write = ramdisk_write,
+	// any kernel buffer is copied, no bounce page needed
+	.max_sectors = 1024,
+	.max_segments = 128,
+	.discard = ramdisk_zero,
+	.write_zeroes = ramdisk_zero,
+};
+
+static void ramdisk_free(struct RamDisk* rd, unsigned int pages) {
+	for (unsigned int i = 0; i < pages; i++) {
+		kfree(rd->page[i]);
+	}
+	vfree(rd->page);
+}
+
+// Create a zeroed RAM disk of sectors, starting with image if given so its
+// partitions are found when it is registered. Return the block device id.
+int ramdisk_create(unsigned int sectors, const void* image, unsigned int image_size) {
+	// the page array is vmalloc'd, which bounds the size
+	if (!sectors || sectors > (VMALLOC_TOP - VMALLOC_BASE - PGSIZE) / sizeof(char*) *
+								   RAMDISK_SECTORS_PER_PAGE ||
+		image_size / 512 + (image_size % 512 != 0) > sectors) {
+		return ERROR_INVAILD;
+	}
+	unsigned int pages = (sectors + RAMDISK_SECTORS_PER_PAGE - 1) / RAMDISK_SECTORS_PER_PAGE;
+
+	acquire(&ramdisk.lock);
+	struct RamDisk* rd = 0;
+	for (int i = 0; i < RAMDISK_MAX; i++) {
+		if (!ramdisk.disk[i].sectors) {
+			rd = &ramdisk.disk[i];
+			rd->sectors = sectors; // reserve the slot
+			break;
+		}
+	}
+	release(&ramdisk.lock);
+	if (!rd) {
+		return ERROR_OUT_OF_SPACE;
+	}
+
+	rd->page = vmalloc(pages * sizeof(char*));
+	if (!rd->page) {
+		rd->sectors = 0;
+		return ERROR_OUT_OF_SPACE;
+	}
+	for (unsigned int i = 0; i < pages; i++) {
+		rd->page[i] = kalloc();
+		if (!rd->page[i]) {
+			ramdisk_free(rd, i);
+			rd->sectors = 0;
+			return ERROR_OUT_OF_SPACE;
+		}
+		memset(rd->page[i], 0, PGSIZE);
+	}
+	if (image_size) {
+		unsigned int end = image_size / 512;
+		ramdisk_copy(rd, 0, end, (void*)image, 1);
+		if (image_size % 512) { // the rest of a partial last sector stays zero
+			memmove(rd->page[end / RAMDISK_SECTORS_PER_PAGE] +
+						(end % RAMDISK_SECTORS_PER_PAGE) * 512,
+					image + end * 512, image_size % 512);
+		}
+	}
+	int id = hal_block_register_device("ramdisk", rd, &ramdisk_block_driver);
+	if (id < 0) {
+		ramdisk_free(rd, pages);
+		rd->sectors = 0;
+		return id;
+	}
+	cprintf("[ramdisk] %d KiB\n", sectors / 2);
+	return id;
+}
+
+static int ramdisk_kcall_handler(unsigned int rk_struct) {
+	struct RamdiskKcall {
+		unsigned int sectors;
+		const void* image; // copied to the start of the disk if set
+		unsigned int image_size; // bytes
+	}* rk = (void*)rk_struct;
+	int id = ramdisk_create(rk->sectors, rk->image_size ? rk->image : 0, rk->image_size);
+	if (id < 0) {
+		return id;
+	}
+	// mount the volumes of the image, the disk stays if one cannot be mounted
+	for (int i = 0; i < hal_partition_max; i++) {
+		struct HalPartitionMap* part = hal_partition(i);
+		if (part && part->dev == id && part->fs_type == HAL_PARTITION_FAT32) {
+			vfs_mount_fat32(i);
+		}
+	}
+	return id;
+}
+
+// Take the boot RAM disk size from ramdisk=<MiB> on the kernel command line
+void ramdisk_cmdline(const char* cmdline) {
+	for (const char* p = cmdline; *p; p++) {
+		if ((p == cmdline || p[-1] == ' ') && strncmp(p, "ramdisk=", 8) == 0) {
+			ramdisk_boot_size = 0;
+			for (p += 8; *p >= '0' && *p <= '9'; p++) {
+				ramdisk_boot_size = ramdisk_boot_size * 10 + *p - '0';
+			}
+			if (!*p) {
+				break;
+			}
+		}
+	}
+}
+
+void ramdisk_init(void) {
+	initlock(&ramdisk.lock, "ramdisk");
+	memset(ramdisk.disk, 0, sizeof(ramdisk.disk));
+	kcall_set("ramdisk", ramdisk_kcall_handler);
+	if (ramdisk_boot_size && ramdisk_create(ramdisk_boot_size * 2048, 0, 0) < 0) {
+		cprintf("[ramdisk] cannot allocate %d MiB\n", ramdisk_boot_size);
+	}
+}
@@ -0,0 +1,3 @@
+void ramdisk_cmdline(const char* cmdline);
+void ramdisk_init(void);
+int ramdisk_create(unsigned int sectors, const void* image, unsigned int image_size);
@@ -24,7 +24,8 @@ struct VirtioBlockConfig {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t writeback;
-	uint8_t unused0[3];
+	uint8_t unused0;
+	uint16_t num_queues;
 	uint32_t max_discard_sectors;
 	uint32_t max_discard_seg;
 	uint32_t discard_sector_alignment;
@@ -44,6 +45,7 @@ enum VirtioBlockFeatureBits {
 	VIRTIO_BLK_F_FLUSH = (1 << 9),
 	VIRTIO_BLK_F_TOPOLOGY = (1 << 10),
 	VIRTIO_BLK_F_CONFIG_WCE = (1 << 11),
+	VIRTIO_BLK_F_MQ = (1 << 12),
 	VIRTIO_BLK_F_DISCARD = (1 << 13),
 	VIRTIO_BLK_F_WRITE_ZEROES = (1 << 14),
 };
@@ -56,6 +58,19 @@ enum VirtioBlockRequestType {
 	VIRTIO_BLK_T_WRITE_ZEROES = 13,
 };
 
+struct VirtioBlockRequestHeader {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+} __attribute__((packed));
+
+// data segment of discard and write zeroes requests
+struct VirtioBlockDiscardWriteZeroes {
+	uint64_t sector;
+	uint32_t num_sectors;
+	uint32_t flags; // bit 0 unmap, write zeroes only
+} __attribute__((packed));
+
 enum VirtioBlockRequestStatus {
 	VIRTIO_BLK_S_OK = 0,
 	VIRTIO_BLK_S_IOERR = 1,
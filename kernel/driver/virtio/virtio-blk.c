@@ -28,86 +28,245 @@
 #include "virtio-regs.h"
 #include "virtio.h"
 
-static void virtio_blk_req(struct VirtioBlockDevice* dev, int type, unsigned int sect,
-						   unsigned int count, phyaddr_t dest, uint8_t* status) {
-	volatile struct {
-		uint32_t type;
-		uint32_t reserved;
-		uint64_t sector;
-	} __attribute__((packed)) buf0;
+// Describe the data of a request chain, or bytes of buf if there is no
+// request, in q->sg. Return the number of segments.
+static int virtio_blk_sglist(struct VirtioBlockQueue* q, struct BlockRequest* req,
+							 const void* buf, unsigned int bytes) {
+	unsigned int seg_max = q->dev->seg_max;
+	if (!req) {
+		return bytes ? kva_sglist(buf, bytes, q->sg, seg_max) : 0;
+	}
+	int n = 0;
+	for (; req; req = req->next) {
+		int ret;
+		if (req->sg) {
+			ret = req->nsg <= seg_max - n ? req->nsg : ERROR_INVAILD;
+			if (ret > 0) {
+				memmove(q->sg + n, req->sg, req->nsg * sizeof(struct SGEntry));
+			}
+		} else {
+			ret = kva_sglist(req->buf, req->count * 512, q->sg + n, seg_max - n);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		n += ret;
+	}
+	return n;
+}
 
-	buf0.type = type;
-	buf0.reserved = 0;
-	buf0.sector = sect;
+static void virtio_blk_fill_desc(volatile struct VirtqDesc* desc, phyaddr_t addr, unsigned int len,
+								 unsigned int flags, unsigned int next) {
+	desc->addr = addr;
+	desc->len = len;
+	desc->flags = flags;
+	desc->next = next;
+}
 
-	int desc[3];
-	if (!virtio_alloc_desc(&dev->virtio_queue, desc, 3)) {
-		panic("virtio-blk out of desc");
+// Put a request of a VIRTIO_BLK_T_* type on the ring, waiting for free
+// descriptors if needed, return the head descriptor or ERROR_INVAILD if the
+// data does not fit in a request. Only reads have device-writable data.
+// Called with q->lock held, the caller notifies the device.
+static int virtio_blk_start(struct VirtioBlockQueue* q, unsigned int type, unsigned int sect,
+							struct BlockRequest* req, const void* buf, unsigned int bytes) {
+	struct VirtioQueue* queue = &q->virtio_queue;
+	int write = type != VIRTIO_BLK_T_IN;
+	int nseg, head;
+	// q->sg is rebuilt after sleeping, another request may have used it
+	for (;;) {
+		nseg = virtio_blk_sglist(q, req, buf, bytes);
+		if (nseg < 0 || (nseg == 0 && (req || bytes))) {
+			return ERROR_INVAILD;
+		}
+		if (virtio_alloc_desc(queue, q->desc, q->indirect ? 1 : nseg + 2)) {
+			break;
+		}
+		if (!myproc()) {
+			panic("virtio-blk out of desc");
+		}
+		sleep(queue, &q->lock);
 	}
+	head = q->desc[0];
+	q->header[head].type = type;
+	q->header[head].reserved = 0;
+	q->header[head].sector = sect;
+	q->status[head] = 0xff;
+	q->inflight[head].req = req;
+	q->inflight[head].write = write;
+	q->inflight[head].done = 0;
 
-	dev->virtio_queue.desc[desc[0]].addr = V2P(&buf0);
-	dev->virtio_queue.desc[desc[0]].len = 16;
-	dev->virtio_queue.desc[desc[0]].flags = VIRTQ_DESC_F_NEXT;
-	dev->virtio_queue.desc[desc[0]].next = desc[1];
-
-	dev->virtio_queue.desc[desc[1]].addr = dest;
-	dev->virtio_queue.desc[desc[1]].len = 512 * count;
-	dev->virtio_queue.desc[desc[1]].flags = VIRTQ_DESC_F_NEXT;
-	if (type == VIRTIO_BLK_T_IN) {
-		dev->virtio_queue.desc[desc[1]].flags |= VIRTQ_DESC_F_WRITE;
+	// header, data segments and status, in an indirect table if possible
+	volatile struct VirtqDesc* desc = queue->desc;
+	int* next = q->desc;
+	if (q->indirect) {
+		if (!q->inflight[head].table) {
+			q->inflight[head].table = kalloc();
+		}
+		desc = q->inflight[head].table;
+		for (int i = 0; i < nseg + 2; i++) {
+			next[i] = i;
+		}
+		virtio_blk_fill_desc(&queue->desc[head], V2P(desc),
+							 (nseg + 2) * sizeof(struct VirtqDesc), VIRTQ_DESC_F_INDIRECT, 0);
+	}
+	virtio_blk_fill_desc(&desc[next[0]], V2P(&q->header[head]),
+						 sizeof(struct VirtioBlockRequestHeader), VIRTQ_DESC_F_NEXT, next[1]);
+	for (int i = 0; i < nseg; i++) {
+		virtio_blk_fill_desc(&desc[next[i + 1]], q->sg[i].addr, q->sg[i].length,
+							 VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE), next[i + 2]);
 	}
-	dev->virtio_queue.desc[desc[1]].next = desc[2];
+	virtio_blk_fill_desc(&desc[next[nseg + 1]], V2P(&q->status[head]), 1, VIRTQ_DESC_F_WRITE,
+						 0);
 
-	dev->virtio_queue.desc[desc[2]].addr = V2P(status);
-	dev->virtio_queue.desc[desc[2]].len = 1;
-	dev->virtio_queue.desc[desc[2]].flags = VIRTQ_DESC_F_WRITE;
-	dev->virtio_queue.desc[desc[2]].next = 0;
+	virtio_queue_avail_insert(queue, head);
+	return head;
+}
+
+static void virtio_blk_complete(void* private);
+static int virtio_blk_poll(void* private, int cpu);
+
+static int virtio_blk_status(struct VirtioBlockQueue* q, int head) {
+	if (q->status[head] == VIRTIO_BLK_S_OK) {
+		return 0;
+	}
+	if (q->status[head] == VIRTIO_BLK_S_UNSUPP) {
+		return ERROR_INVAILD;
+	}
+	return q->inflight[head].write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL;
+}
 
-	virtio_queue_avail_insert(&dev->virtio_queue, desc[0]);
+// Queue of the CPU submitting, completions come back on it
+static struct VirtioBlockQueue* virtio_blk_queue(struct VirtioBlockDevice* dev, int cpu) {
+	if (cpu < 0) {
+		pushcli();
+		cpu = cpuid();
+		popcli();
+	}
+	return dev->queue[cpu % dev->nqueues];
+}
 
-	// do not sleep at boot time
+// Synchronous request, polls at boot time instead of sleeping
+static int virtio_blk_req(struct VirtioBlockDevice* dev, unsigned int type, unsigned int sect,
+						  const void* buf, unsigned int bytes) {
+	struct VirtioBlockQueue* q = virtio_blk_queue(dev, -1);
+	acquire(&q->lock);
+	int head = virtio_blk_start(q, type, sect, 0, buf, bytes);
+	if (head < 0) {
+		release(&q->lock);
+		return type == VIRTIO_BLK_T_IN ? ERROR_READ_FAIL : ERROR_WRITE_FAIL;
+	}
 	if (myproc()) {
-		virtio_queue_notify(dev->virtio_dev, &dev->virtio_queue);
-		sleep(P2V(dest), &dev->lock);
+		virtio_queue_notify(dev->virtio_dev, &q->virtio_queue);
+		while (!q->inflight[head].done) {
+			sleep(&q->inflight[head], &q->lock);
+		}
 	} else {
-		virtio_queue_notify_wait(dev->virtio_dev, &dev->virtio_queue);
+		virtio_queue_notify_wait(dev->virtio_dev, &q->virtio_queue);
+		while (!q->inflight[head].done) {
+			release(&q->lock);
+			virtio_blk_complete(q);
+			acquire(&q->lock);
+		}
 	}
+	// the waiter owns the chain until here, so its head is not reused early
+	int status = virtio_blk_status(q, head);
+	virtio_free_desc(&q->virtio_queue, head);
+	wakeup(&q->virtio_queue);
+	release(&q->lock);
+	return status;
 }
 
 int virtio_blk_read(void* private, unsigned int begin, int count, void* buf) {
-	// check buf for DMA
-	if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP || (phyaddr_t)buf % PGSIZE)
-		panic("virtio dma");
-	if (count == 0 || count > 8)
+	if (count <= 0 || count > VIRTIO_BLK_MAX_SECTORS)
 		panic("virtio count");
-	phyaddr_t dest = V2P(buf);
-	struct VirtioBlockDevice* dev = private;
-	uint8_t status;
-	// start request
-	acquire(&dev->lock);
-	virtio_blk_req(dev, VIRTIO_BLK_T_IN, begin, count, dest, &status);
-	release(&dev->lock);
-	if (status) {
-		return ERROR_READ_FAIL;
-	}
-	return 0;
+	return virtio_blk_req(private, VIRTIO_BLK_T_IN, begin, buf, count * 512);
 }
 
 int virtio_blk_write(void* private, unsigned int begin, int count, const void* buf) {
-	// check buf for DMA
-	if ((phyaddr_t)buf < KERNBASE || (phyaddr_t)buf > KERNBASE + PHYSTOP || (phyaddr_t)buf % PGSIZE)
-		panic("virtio dma");
-	if (count == 0 || count > 8)
+	if (count <= 0 || count > VIRTIO_BLK_MAX_SECTORS)
 		panic("virtio count");
-	phyaddr_t dest = V2P(buf);
+	return virtio_blk_req(private, VIRTIO_BLK_T_OUT, begin, buf, count * 512);
+}
+
+static int virtio_blk_flush(void* private) {
+	struct VirtioBlockDevice* dev = private;
+	if (!(dev->virtio_dev->features & VIRTIO_BLK_F_FLUSH)) {
+		return ERROR_INVAILD;
+	}
+	return virtio_blk_req(dev, VIRTIO_BLK_T_FLUSH, 0, 0, 0);
+}
+
+// Send ranges as discard or write zeroes segments, splitting them to the
+// device's limits of sectors per segment and segments per request
+static int virtio_blk_ranges(struct VirtioBlockDevice* dev, unsigned int type,
+							 const struct BlockRange* range, int count, unsigned int max_sectors,
+							 unsigned int max_seg) {
+	struct VirtioBlockDiscardWriteZeroes* seg = kalloc();
+	if (!seg) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	if (!max_sectors) {
+		max_sectors = 0xffffffff;
+	}
+	if (!max_seg || max_seg > PGSIZE / sizeof(struct VirtioBlockDiscardWriteZeroes)) {
+		max_seg = PGSIZE / sizeof(struct VirtioBlockDiscardWriteZeroes);
+	}
+	unsigned int n = 0;
+	int ret = 0;
+	for (int i = 0; i < count && ret >= 0; i++) {
+		unsigned int lba = range[i].lba, left = range[i].count;
+		while (left && ret >= 0) {
+			seg[n].sector = lba;
+			seg[n].num_sectors = left < max_sectors ? left : max_sectors;
+			seg[n].flags = 0;
+			lba += seg[n].num_sectors;
+			left -= seg[n].num_sectors;
+			if (++n == max_seg) {
+				ret = virtio_blk_req(dev, type, 0, seg, n * sizeof(*seg));
+				n = 0;
+			}
+		}
+	}
+	if (n && ret >= 0) {
+		ret = virtio_blk_req(dev, type, 0, seg, n * sizeof(*seg));
+	}
+	kfree(seg);
+	return ret;
+}
+
+static int virtio_blk_discard(void* private, const struct BlockRange* range, int count) {
 	struct VirtioBlockDevice* dev = private;
-	uint8_t status;
-	// start request
-	acquire(&dev->lock);
-	virtio_blk_req(dev, VIRTIO_BLK_T_OUT, begin, count, dest, &status);
-	release(&dev->lock);
-	if (status) {
-		return ERROR_READ_FAIL;
+	if (!(dev->virtio_dev->features & VIRTIO_BLK_F_DISCARD)) {
+		return ERROR_INVAILD;
+	}
+	return virtio_blk_ranges(dev, VIRTIO_BLK_T_DISCARD, range, count, dev->max_discard_sectors,
+							 dev->max_discard_seg);
+}
+
+static int virtio_blk_write_zeroes(void* private, const struct BlockRange* range, int count) {
+	struct VirtioBlockDevice* dev = private;
+	if (!(dev->virtio_dev->features & VIRTIO_BLK_F_WRITE_ZEROES)) {
+		return ERROR_INVAILD;
+	}
+	return virtio_blk_ranges(dev, VIRTIO_BLK_T_WRITE_ZEROES, range, count,
+							 dev->max_write_zeroes_sectors, dev->max_write_zeroes_seg);
+}
+
+// Asynchronous request, completed from virtio_blk_complete
+static int virtio_blk_submit(void* private, struct BlockRequest* req, unsigned int count) {
+	struct VirtioBlockDevice* dev = private;
+	if (count == 0 || count > VIRTIO_BLK_MAX_SECTORS)
+		panic("virtio count");
+	struct VirtioBlockQueue* q = virtio_blk_queue(dev, req->cpu);
+	acquire(&q->lock);
+	int head = virtio_blk_start(q, req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN, req->lba, req, 0,
+								count * 512);
+	if (head >= 0) {
+		virtio_queue_notify(dev->virtio_dev, &q->virtio_queue);
+	}
+	release(&q->lock);
+	if (head < 0) {
+		return req->write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL;
 	}
 	return 0;
 }
@@ -115,6 +274,13 @@ int virtio_blk_write(void* private, unsigned int begin, int count, const void* b
 const struct BlockDeviceDriver virtio_blk_block_driver = {
 	.block_read = virtio_blk_read,
 	.block_write = virtio_blk_write,
+	.submit = virtio_blk_submit,
+	.max_sectors = VIRTIO_BLK_MAX_SECTORS,
+	.max_segments = VIRTIO_BLK_SEG_MAX,
+	.poll = virtio_blk_poll,
+	.flush = virtio_blk_flush,
+	.discard = virtio_blk_discard,
+	.write_zeroes = virtio_blk_write_zeroes,
 };
 
 static struct VirtioBlockDevice* virtio_blk_alloc_dev(void) {
@@ -123,46 +289,123 @@ static struct VirtioBlockDevice* virtio_blk_alloc_dev(void) {
 	return dev;
 }
 
+// Set up request queue n, its interrupts go to CPU n
+static struct VirtioBlockQueue* virtio_blk_init_queue(struct VirtioBlockDevice* dev, int n,
+													  unsigned int features) {
+	struct VirtioBlockQueue* q = kalloc();
+	memset(q, 0, sizeof(struct VirtioBlockQueue));
+	q->dev = dev;
+	initlock(&q->lock, "virtio-blk");
+	work_init(&q->complete_work, virtio_blk_complete, q);
+	virtio_init_queue(dev->virtio_dev, &q->virtio_queue, n);
+	q->header = kalloc();
+	q->status = kalloc();
+	q->inflight = kalloc();
+	memset(q->inflight, 0, PGSIZE);
+	q->indirect = (features & VIRTIO_RING_F_INDIRECT_DESC) != 0;
+	// without indirect descriptors a request takes one per segment
+	if (!q->indirect) {
+		if (q->virtio_queue.size < 3)
+			panic("virtio-blk queue too small");
+		if (dev->seg_max > q->virtio_queue.size - 2)
+			dev->seg_max = q->virtio_queue.size - 2;
+	}
+	return q;
+}
+
 static void virtio_blk_dev_init(struct VirtioDevice* virtio_dev, unsigned int features) {
 	struct VirtioBlockDevice* dev = virtio_blk_alloc_dev();
 	virtio_dev->private = dev;
 	dev->virtio_dev = virtio_dev;
 	volatile struct VirtioBlockConfig* blkcfg = dev->virtio_dev->devcfg;
-	// initialize lock
-	initlock(&dev->lock, "virtio-blk");
-	acquire(&dev->lock);
-	virtio_init_queue(dev->virtio_dev, &dev->virtio_queue, 0);
+	dev->seg_max = VIRTIO_BLK_SEG_MAX;
+	if ((features & VIRTIO_BLK_F_SEG_MAX) && blkcfg->seg_max && blkcfg->seg_max < dev->seg_max)
+		dev->seg_max = blkcfg->seg_max;
+	// a queue per CPU with multiqueue
+	dev->nqueues = 1;
+	if ((features & VIRTIO_BLK_F_MQ) && blkcfg->num_queues) {
+		dev->nqueues = blkcfg->num_queues < ncpu ? blkcfg->num_queues : ncpu;
+	}
+	for (int i = 0; i < dev->nqueues; i++) {
+		dev->queue[i] = virtio_blk_init_queue(dev, i, features);
+	}
+	if (features & VIRTIO_BLK_F_DISCARD) {
+		dev->max_discard_sectors = blkcfg->max_discard_sectors;
+		dev->max_discard_seg = blkcfg->max_discard_seg;
+	}
+	if (features & VIRTIO_BLK_F_WRITE_ZEROES) {
+		dev->max_write_zeroes_sectors = blkcfg->max_write_zeroes_sectors;
+		dev->max_write_zeroes_seg = blkcfg->max_write_zeroes_seg;
+	}
 	// print a message
 	cprintf("[virtio-blk] Virtio Block device capacity %lld "
-			"blk_size %d\n",
+			"blk_size %d queues %d%s%s%s\n",
+			blkcfg->capacity, blkcfg->blk_size, dev->nqueues,
+			features & VIRTIO_BLK_F_FLUSH ? " flush" : "",
+			features & VIRTIO_BLK_F_DISCARD ? " discard" : "",
+			features & VIRTIO_BLK_F_WRITE_ZEROES ? " write-zeroes" : "");
+	// a page aligned request takes a segment per page
+	dev->driver = virtio_blk_block_driver;
+	dev->driver.max_segments = dev->seg_max;
+	if (dev->driver.max_sectors > dev->seg_max * (PGSIZE / 512))
+		dev->driver.max_sectors = dev->seg_max * (PGSIZE / 512);
+	hal_block_register_device("virtio-blk", dev, &dev->driver);
+}
 
-			blkcfg->capacity, blkcfg->blk_size);
-	release(&dev->lock);
-	hal_block_register_device("virtio-blk", dev, &virtio_blk_block_driver);
+// Process used chains by head descriptor, return the number of requests completed
+static int virtio_blk_reap(struct VirtioBlockQueue* q) {
+	int n = 0;
+	acquire(&q->lock);
+	int head;
+	while ((head = virtio_queue_get_used(&q->virtio_queue)) >= 0) {
+		n++;
+		struct VirtioBlockInflight* inflight = &q->inflight[head];
+		struct BlockRequest* req = inflight->req;
+		if (!req) {
+			inflight->done = 1;
+			wakeup(inflight);
+			continue;
+		}
+		inflight->req = 0;
+		int status = virtio_blk_status(q, head);
+		virtio_free_desc(&q->virtio_queue, head);
+		wakeup(&q->virtio_queue);
+		release(&q->lock);
+		hal_block_complete(req, status);
+		acquire(&q->lock);
+	}
+	release(&q->lock);
+	return n;
+}
+
+static void virtio_blk_complete(void* private) {
+	virtio_blk_reap(private);
+}
+
+static int virtio_blk_poll(void* private, int cpu) {
+	return virtio_blk_reap(virtio_blk_queue(private, cpu));
 }
 
+// Complete on the CPU interrupted, which is the queue's own with MSI-X
 static void virtio_blk_queue_intr(struct VirtioDevice* virtio_dev, unsigned int queue_n) {
 	struct VirtioBlockDevice* dev = virtio_dev->private;
-
-	acquire(&dev->lock);
-	static unsigned short last = 0;
-	for (; last != dev->virtio_queue.used->idx; last++) {
-		unsigned int id = dev->virtio_queue.used->ring[last % dev->virtio_queue.size].id;
-		volatile struct VirtqDesc* desc = &dev->virtio_queue.desc[id];
-		if (desc->flags & VIRTQ_DESC_F_NEXT) {
-			desc = &dev->virtio_queue.desc[desc->next];
-			wakeup(P2V((phyaddr_t)desc->addr));
-		}
-		virtio_free_desc(&dev->virtio_queue, id);
+	if (virtio_dev->msix) {
+		work_schedule(&dev->queue[queue_n]->complete_work);
+		return;
+	}
+	// INTx does not tell the queue
+	for (int i = 0; i < dev->nqueues; i++) {
+		work_schedule(&dev->queue[i]->complete_work);
 	}
-	release(&dev->lock);
 }
 
 const struct VirtioDriver virtio_blk_virtio_driver = {
 	.name = "virtio-blk",
 	.legacy_device_id = 0x1001,
 	.device_id = 2,
-	.features = VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE,
+	.features = VIRTIO_BLK_F_RO | VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_SEG_MAX |
+				VIRTIO_BLK_F_MQ | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD |
+				VIRTIO_BLK_F_WRITE_ZEROES | VIRTIO_RING_F_INDIRECT_DESC | VIRTIO_RING_F_EVENT_IDX,
 	.init = virtio_blk_dev_init,
 	.queue_intr_handler = virtio_blk_queue_intr,
 };
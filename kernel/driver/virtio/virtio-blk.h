@@ -2,13 +2,48 @@
 #define _DRIVER_VIRTIO_BLK_H
 
 #include <common/spinlock.h>
+#include <core/proc.h>
+#include <hal/hal.h>
+#include <param.h>
 
+#include "virtio-blk-regs.h"
+#include "virtio-regs.h"
 #include "virtio.h"
 
-struct VirtioBlockDevice {
-	struct VirtioDevice* virtio_dev;
+#define VIRTIO_BLK_MAX_SECTORS 512 // per request
+#define VIRTIO_BLK_SEG_MAX 64 // data segments per request, fewer if the device says so
+
+// request in flight, indexed by the head descriptor of its chain
+struct VirtioBlockInflight {
+	struct BlockRequest* req; // asynchronous request, 0 if a thread is waiting
+	volatile struct VirtqDesc* table; // indirect descriptors, allocated on first use
+	uint8_t write;
+	uint8_t done;
+};
+
+// request queue, one per CPU with VIRTIO_BLK_F_MQ
+struct VirtioBlockQueue {
+	struct VirtioBlockDevice* dev;
 	struct VirtioQueue virtio_queue;
 	struct spinlock lock;
+	struct WorkItem complete_work; // completion processing outside IRQ
+	volatile struct VirtioBlockRequestHeader* header; // page of headers per head descriptor
+	volatile uint8_t* status; // status byte per head descriptor
+	struct VirtioBlockInflight* inflight; // page of requests per head descriptor
+	int indirect; // VIRTIO_RING_F_INDIRECT_DESC negotiated
+	struct SGEntry sg[VIRTIO_BLK_SEG_MAX]; // data of the request being queued
+	int desc[VIRTIO_BLK_SEG_MAX + 2];
+};
+
+struct VirtioBlockDevice {
+	struct VirtioDevice* virtio_dev;
+	int nqueues;
+	struct VirtioBlockQueue* queue[NCPU];
+	unsigned int seg_max; // data segments per request
+	struct BlockDeviceDriver driver; // limits follow seg_max
+	// limits of discard and write zeroes requests, 0 if not given
+	unsigned int max_discard_sectors, max_discard_seg;
+	unsigned int max_write_zeroes_sectors, max_write_zeroes_seg;
 };
 
 // virtio-blk.c
@@ -5,6 +5,12 @@
 
 #define VIRTIO_QUEUE_SIZE_MAX 256
 
+// device independent feature bits
+#define VIRTIO_RING_F_INDIRECT_DESC (1 << 28)
+#define VIRTIO_RING_F_EVENT_IDX (1 << 29)
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
+
 struct VirtqDesc {
 	/* Address (guest-physical). */
 	uint64_t addr;
@@ -17,6 +17,7 @@
  * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <core/proc.h>
 #include <defs.h>
 #include <driver/pci/pci.h>
 #include <memlayout.h>
@@ -69,6 +70,28 @@ static unsigned int virtio_set_feature(struct VirtioDevice* dev, unsigned int fe
 	return ack_feature;
 }
 
+static void virtio_queue_msix_intr(void* private) {
+	struct VirtioQueue* queue = private;
+	queue->dev->driver->queue_intr_handler(queue->dev, queue->queue_n);
+}
+
+// Give a queue MSI-X table entry queue_n and a vector of its own delivered to cpu
+static void virtio_queue_msix(struct VirtioDevice* dev, struct VirtioQueue* queue, int cpu) {
+	int vector = pci_msi_alloc_vector(virtio_queue_msix_intr, queue);
+	if (!vector) {
+		panic("virtio msix vector");
+	}
+	if (pci_msix_set_vector(&dev->pcidev->addr, queue->queue_n, vector, cpus[cpu].apicid) < 0) {
+		panic("virtio msix entry");
+	}
+	dev->cmcfg->queue_msix_vector = queue->queue_n;
+	if (dev->cmcfg->queue_msix_vector != queue->queue_n) {
+		panic("virtio msix queue");
+	}
+	queue->vector = vector;
+}
+
+// Queue n interrupts CPU n modulo the number of CPUs with MSI-X
 void virtio_init_queue(struct VirtioDevice* dev, struct VirtioQueue* queue, int queue_n) {
 	queue->desc = kalloc();
 	queue->avail = kalloc();
@@ -81,6 +104,20 @@ void virtio_init_queue(struct VirtioDevice* dev, struct VirtioQueue* queue, int
 		dev->cmcfg->queue_size = VIRTIO_QUEUE_SIZE_MAX;
 	}
 	queue->size = dev->cmcfg->queue_size;
+	for (int i = 0; i < queue->size; i++) {
+		queue->desc[i].next = i + 1;
+	}
+	queue->free_head = 0;
+	queue->num_free = queue->size;
+	queue->kicked = 0;
+	queue->used_last = 0;
+	queue->event_idx = (dev->features & VIRTIO_RING_F_EVENT_IDX) != 0;
+	queue->dev = dev;
+	queue->queue_n = queue_n;
+	queue->vector = 0;
+	if (dev->msix) {
+		virtio_queue_msix(dev, queue, queue_n % ncpu);
+	}
 	dev->cmcfg->queue_desc = V2P(queue->desc);
 	dev->cmcfg->queue_driver = V2P(queue->avail);
 	dev->cmcfg->queue_device = V2P(queue->used);
@@ -88,12 +125,34 @@ void virtio_init_queue(struct VirtioDevice* dev, struct VirtioQueue* queue, int
 	queue->notify = dev->notify_begin + dev->cmcfg->queue_notify_off * dev->notify_off_multiplier;
 }
 
+// event index fields follow the rings
+static volatile uint16_t* virtio_used_event(struct VirtioQueue* queue) {
+	return (volatile uint16_t*)queue->avail->ring + queue->size;
+}
+
+static volatile uint16_t* virtio_avail_event(struct VirtioQueue* queue) {
+	return (volatile uint16_t*)(queue->used->ring + queue->size);
+}
+
+// Kick the device about buffers added since the last notification, unless
+// it does not want to hear about them yet
 void virtio_queue_notify(struct VirtioDevice* dev, struct VirtioQueue* queue) {
+	__sync_synchronize(); // publish the avail index before reading the event
+	uint16_t old = queue->kicked, idx = queue->avail->idx;
+	queue->kicked = idx;
+	if (queue->event_idx) {
+		if ((uint16_t)(idx - *virtio_avail_event(queue) - 1) >= (uint16_t)(idx - old)) {
+			return;
+		}
+	} else if (queue->used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+		return;
+	}
 	*queue->notify = 0;
 }
 
 void virtio_queue_notify_wait(struct VirtioDevice* dev, struct VirtioQueue* queue) {
 	int prev = queue->used->idx;
+	queue->kicked = queue->avail->idx;
 	*queue->notify = 0;
 	while (prev == queue->used->idx) {
 	}
@@ -101,35 +160,50 @@ void virtio_queue_notify_wait(struct VirtioDevice* dev, struct VirtioQueue* queu
 
 void virtio_queue_avail_insert(struct VirtioQueue* queue, int desc) {
 	queue->avail->ring[queue->avail->idx % queue->size] = desc;
+	__sync_synchronize(); // the entry before the index
 	queue->avail->idx++;
 }
 
 int* virtio_alloc_desc(struct VirtioQueue* queue, int* desc, int num) {
+	if (queue->num_free < (unsigned int)num) {
+		return 0;
+	}
 	for (int i = 0; i < num; i++) {
-		desc[i] = -1;
-		for (int j = 0; j < queue->size; j++) {
-			if (queue->desc[j].addr == 0) {
-				queue->desc[j].addr = 0xffffffff;
-				desc[i] = j;
-				break;
-			}
-		}
-		if (desc[i] == -1) {
-			return 0;
-		}
+		desc[i] = queue->free_head;
+		queue->free_head = queue->desc[desc[i]].next;
 	}
+	queue->num_free -= num;
 	return desc;
 }
 
 void virtio_free_desc(struct VirtioQueue* queue, int desc) {
-	do {
-		queue->desc[desc].addr = 0;
-		if (queue->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
-			desc = queue->desc[desc].next;
-		} else {
-			desc = -1;
+	while (desc != -1) {
+		int next = queue->desc[desc].flags & VIRTQ_DESC_F_NEXT ? queue->desc[desc].next : -1;
+		queue->desc[desc].next = queue->free_head;
+		queue->free_head = desc;
+		queue->num_free++;
+		desc = next;
+	}
+}
+
+// Take the next used chain, return its head descriptor or -1 if there is none.
+// With event index the device interrupts again only after the ring was drained.
+int virtio_queue_get_used(struct VirtioQueue* queue) {
+	if (queue->used_last == queue->used->idx) {
+		if (!queue->event_idx) {
+			return -1;
 		}
-	} while (desc != -1);
+		// an entry may arrive before the device sees the new event
+		*virtio_used_event(queue) = queue->used_last;
+		__sync_synchronize();
+		if (queue->used_last == queue->used->idx) {
+			return -1;
+		}
+	}
+	__sync_synchronize(); // the index before the entry
+	int id = queue->used->ring[queue->used_last % queue->size].id;
+	queue->used_last++;
+	return id;
 }
 
 static int virtio_intr_ack(struct VirtioDevice* dev) {
@@ -145,15 +219,26 @@ static void virtio_pci_intr_handler(struct PCIDevice* pcidev) {
 
 static unsigned int virtio_generic_init(struct VirtioDevice* dev, unsigned int features) {
 	pci_enable_bus_mastering(&dev->pcidev->addr);
-	pci_register_intr_handler(dev->pcidev, virtio_pci_intr_handler);
 	// initialize lock
 	initlock(&dev->lock, "virtio-blk");
 	acquire(&dev->lock);
 	virtio_read_cap(&dev->pcidev->addr, dev);
+	// MSI-X needs no ISR read and no shared IRQ, INTx if it lacks an entry per queue
+	int msix_entries = pci_msix_enable(&dev->pcidev->addr);
+	if (msix_entries && msix_entries >= dev->cmcfg->num_queues) {
+		dev->msix = 1;
+		dev->cmcfg->msix_config = VIRTIO_MSI_NO_VECTOR;
+	} else {
+		if (msix_entries) {
+			pci_msix_disable(&dev->pcidev->addr);
+		}
+		pci_register_intr_handler(dev->pcidev, virtio_pci_intr_handler);
+	}
 	// reset device
 	dev->cmcfg->device_status = 0;
 	dev->cmcfg->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
 	unsigned int ack_feature = virtio_set_feature(dev, features);
+	dev->features = ack_feature;
 
 	release(&dev->lock);
 	return ack_feature;
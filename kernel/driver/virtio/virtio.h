@@ -40,6 +40,8 @@ struct VirtioDevice {
 	volatile void* devcfg;
 	volatile unsigned int* notify_begin;
 	unsigned int notify_off_multiplier;
+	unsigned int features; // negotiated
+	int msix; // queues interrupt through their own MSI-X vectors
 };
 
 struct VirtioDriver {
@@ -57,6 +59,13 @@ struct VirtioQueue {
 	volatile struct VirtqAvail* avail;
 	volatile struct VirtqUsed* used;
 	volatile unsigned int* notify;
+	unsigned int free_head, num_free; // free descriptors linked through next
+	unsigned short kicked; // avail index at the last notification
+	unsigned short used_last; // used entries taken
+	int event_idx; // VIRTIO_RING_F_EVENT_IDX negotiated
+	struct VirtioDevice* dev;
+	int queue_n;
+	int vector; // MSI-X vector, 0 with INTx
 };
 
 #define VIRTIO_DEVICE_TABLE_SIZE 16
@@ -70,6 +79,7 @@ void virtio_queue_notify_wait(struct VirtioDevice* dev, struct VirtioQueue* queu
 void virtio_queue_avail_insert(struct VirtioQueue* queue, int desc);
 int* virtio_alloc_desc(struct VirtioQueue* queue, int* desc, int num);
 void virtio_free_desc(struct VirtioQueue* queue, int desc);
+int virtio_queue_get_used(struct VirtioQueue* queue);
 void virtio_register_driver(const struct VirtioDriver* driver);
 void virtio_init(void);
 void virtio_print_devices(void);
@@ -24,15 +24,18 @@
 #include "fat32-struct.h"
 #include "fat32.h"
 
-int fat32_cluster_to_sector(unsigned int cluster) {
-	return (cluster - 2) * (fat32_superblock->sector_per_cluster) +
-		   (fat32_superblock->reserved_sector) +
-		   (fat32_superblock->fat_number) * (fat32_superblock->fat_size);
+int fat32_cluster_to_sector(int partition_id, unsigned int cluster) {
+	struct FAT32BootSector* boot = fat32_volume(partition_id)->boot;
+	return (cluster - 2) * (boot->sector_per_cluster) + (boot->reserved_sector) +
+		   (boot->fat_number) * (boot->fat_size);
+}
+
+unsigned int fat32_cluster_size(int partition_id) {
+	return fat32_volume(partition_id)->boot->sector_per_cluster * SECTORSIZE;
 }
 
 int fat32_read_cluster(int partition_id, void* dest, unsigned int cluster, unsigned int begin,
 					   unsigned int size) {
-	void* sect = kalloc();
 	unsigned int off = 0;
 	while (off < size) {
 		int copysize;
@@ -41,21 +44,49 @@ int fat32_read_cluster(int partition_id, void* dest, unsigned int cluster, unsig
 		} else {
 			copysize = size - off;
 		}
-		unsigned int sector = fat32_cluster_to_sector(cluster) + (begin + off) / SECTORSIZE;
-		if (hal_partition_read(partition_id, sector, 1, sect) < 0) {
-			kfree(sect);
+		unsigned int sector =
+			fat32_cluster_to_sector(partition_id, cluster) + (begin + off) / SECTORSIZE;
+		struct BlockBuffer* b = hal_partition_get(partition_id, sector);
+		if (!b) {
 			return ERROR_READ_FAIL;
 		}
-		memmove(dest + off, sect + (begin + off) % SECTORSIZE, copysize);
+		memmove(dest + off,
+				hal_partition_data(partition_id, b, sector) + (begin + off) % SECTORSIZE,
+				copysize);
+		hal_block_put(b);
 		off += copysize;
 	}
-	kfree(sect);
 	return 0;
 }
 
+// Queue the clusters of offset..end for read-ahead, merging contiguous ones
+static void fat32_readahead(int partition_id, unsigned int cluster, unsigned int offset,
+							unsigned int end, struct FileChain* chain) {
+	unsigned int clussize = fat32_cluster_size(partition_id);
+	unsigned int clus = fat32_offset_cluster(partition_id, cluster, offset, chain);
+	unsigned int first = clus, count = 0;
+	for (unsigned int off = offset / clussize * clussize; off < end; off += clussize) {
+		if (clus < 2 || clus >= 0x0ffffff8) {
+			break;
+		}
+		if (count && clus != first + count) {
+			hal_partition_readahead(partition_id, fat32_cluster_to_sector(partition_id, first),
+									count * clussize / SECTORSIZE);
+			first = clus;
+			count = 0;
+		}
+		count++;
+		clus = fat32_fat_read(partition_id, clus);
+	}
+	if (count) {
+		hal_partition_readahead(partition_id, fat32_cluster_to_sector(partition_id, first),
+								count * clussize / SECTORSIZE);
+	}
+}
+
 int fat32_read(int partition_id, unsigned int cluster, void* buf, unsigned int offset,
-			   unsigned int size) {
-	int clussize = fat32_superblock->sector_per_cluster * SECTORSIZE;
+			   unsigned int size, struct FileReadahead* ra, struct FileChain* chain) {
+	int clussize = fat32_cluster_size(partition_id);
 	unsigned int off = 0;
 	while (off < size) {
 		int copysize;
@@ -64,13 +95,38 @@ int fat32_read(int partition_id, unsigned int cluster, void* buf, unsigned int o
 		} else {
 			copysize = size - off;
 		}
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, offset + off);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, offset + off, chain);
+		if (clus == 0) { // the chain was freed under the file
+			return ERROR_READ_FAIL;
+		}
 		if (fat32_read_cluster(partition_id, buf + off, clus, (offset + off) % clussize, copysize) <
 			0) {
 			return ERROR_READ_FAIL;
 		}
 		off += copysize;
 	}
+
+	// a read starting where the last one ended grows the read-ahead window,
+	// anything else resets it
+	if (ra) {
+		if (offset && offset == ra->next) {
+			if (!ra->window) {
+				ra->window = FAT32_READAHEAD_MIN;
+			} else if (ra->window < FAT32_READAHEAD_MAX) {
+				ra->window *= 2;
+			}
+		} else {
+			ra->window = 0;
+			ra->end = 0;
+		}
+		ra->next = offset + size;
+		// refill once half of the data read ahead is used
+		if (ra->window && ra->end < ra->next + ra->window / 2) {
+			unsigned int begin = ra->end > ra->next ? ra->end : ra->next;
+			ra->end = ra->next + ra->window;
+			fat32_readahead(partition_id, cluster, begin, ra->end, chain);
+		}
+	}
 	return size;
 }
 
@@ -85,7 +141,8 @@ int fat32_write_cluster(int partition_id, const void* src, unsigned int cluster,
 		} else {
 			copysize = size - off;
 		}
-		unsigned int sector = fat32_cluster_to_sector(cluster) + (begin + off) / SECTORSIZE;
+		unsigned int sector =
+			fat32_cluster_to_sector(partition_id, cluster) + (begin + off) / SECTORSIZE;
 		if (hal_partition_read(partition_id, sector, 1, sect) < 0) {
 			kfree(sect);
 			return ERROR_READ_FAIL;
@@ -101,37 +158,9 @@ int fat32_write_cluster(int partition_id, const void* src, unsigned int cluster,
 	return 0;
 }
 
-unsigned int fat32_allocate_cluster(int partition_id) {
-	unsigned int* buf = kalloc();
-	for (unsigned int fat = 0; fat < fat32_superblock->fat_size; fat++) {
-		int sect = fat32_superblock->reserved_sector + fat;
-		if (hal_partition_read(partition_id, sect, 1, buf) < 0) {
-			return ERROR_READ_FAIL;
-		}
-		for (int i = 0; i < 128; i++) {
-			if (buf[i] == 0) {
-				buf[i] = 0x0fffffff;
-				// first FAT
-				if (hal_partition_write(partition_id, sect, 1, buf) < 0) {
-					return ERROR_WRITE_FAIL;
-				}
-				// second FAT
-				if (hal_partition_write(partition_id, sect + fat32_superblock->fat_size, 1, buf) <
-					0) {
-					return ERROR_WRITE_FAIL;
-				}
-				kfree(buf);
-				return fat * 128 + i;
-			}
-		}
-	}
-	kfree(buf);
-	return 0;
-}
-
 int fat32_write(int partition_id, unsigned int cluster, const void* buf, unsigned int offset,
-				unsigned int size) {
-	int clussize = fat32_superblock->sector_per_cluster * SECTORSIZE;
+				unsigned int size, struct FileChain* chain) {
+	int clussize = fat32_cluster_size(partition_id);
 	unsigned int off = 0;
 	while (off < size) {
 		int copysize;
@@ -140,12 +169,22 @@ int fat32_write(int partition_id, unsigned int cluster, const void* buf, unsigne
 		} else {
 			copysize = size - off;
 		}
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, offset + off);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, offset + off, chain);
 		if (clus == 0) { // end of cluster chain
-			if ((clus = fat32_allocate_cluster(partition_id)) < 0) {
+			// link to the previous cluster if it is the last one, else to the end
+			unsigned int prev =
+				(offset + off) / clussize
+					? fat32_offset_cluster(partition_id, cluster, offset + off - clussize, chain)
+					: 0;
+			// clusters for the rest of the write in one run, right after prev if free
+			unsigned int want = (offset + size - 1) / clussize - (offset + off) / clussize + 1;
+			unsigned int count;
+			if ((clus = fat32_allocate_clusters(partition_id, prev ? prev + 1 : 0, want, &count)) ==
+				0) {
 				return ERROR_OUT_OF_SPACE;
 			}
-			if (fat32_append_cluster(partition_id, cluster, clus) < 0) {
+			if ((prev ? fat32_write_fat(partition_id, prev, clus)
+					  : fat32_append_cluster(partition_id, cluster, clus)) < 0) {
 				return ERROR_WRITE_FAIL;
 			}
 		}
@@ -155,5 +194,6 @@ int fat32_write(int partition_id, unsigned int cluster, const void* buf, unsigne
 		}
 		off += copysize;
 	}
+	fat32_fat_sync(partition_id);
 	return size;
 }
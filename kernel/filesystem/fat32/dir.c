@@ -62,15 +62,16 @@ static char* fat32_get_full_name(const struct FAT32DirEntry* dir, char* name) {
 
 static int fat32_dir_search(int partition_id, unsigned int cluster, const char* name,
 							struct FAT32DirEntry* dir_dest) {
+	struct FileChain chain;
+	memset(&chain, 0, sizeof(chain));
 	for (int i = 0;; i += 32) {
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i, &chain);
 		if (clus == 0) {
 			break;
 		}
 		struct FAT32DirEntry dir;
 		int errc = fat32_read_cluster(partition_id, &dir, clus,
-									  i % (fat32_superblock->sector_per_cluster * SECTORSIZE),
-									  sizeof(dir));
+									  i % fat32_cluster_size(partition_id), sizeof(dir));
 		if (errc < 0) {
 			return errc;
 		}
@@ -95,7 +96,7 @@ static int fat32_dir_search(int partition_id, unsigned int cluster, const char*
 
 static int fat32_path_search(int partition_id, struct VfsPath path,
 							 struct FAT32DirEntry* dir_dest) {
-	unsigned int cluster = fat32_superblock->root_cluster;
+	unsigned int cluster = fat32_volume(partition_id)->boot->root_cluster;
 	for (int i = 0; i < path.parts; i++) {
 		int errc;
 		if ((errc = fat32_dir_search(partition_id, cluster, path.pathbuf + i * 128, dir_dest)) <
@@ -109,7 +110,7 @@ static int fat32_path_search(int partition_id, struct VfsPath path,
 
 int fat32_open(int partition_id, struct VfsPath path) {
 	if (path.parts == 0) {
-		return fat32_superblock->root_cluster;
+		return fat32_volume(partition_id)->boot->root_cluster;
 	}
 	struct FAT32DirEntry dir;
 	int errc;
@@ -121,15 +122,16 @@ int fat32_open(int partition_id, struct VfsPath path) {
 }
 
 int fat32_dir_first_file(int partition_id, unsigned int cluster) {
+	struct FileChain chain;
+	memset(&chain, 0, sizeof(chain));
 	for (int i = 0;; i += 32) {
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i, &chain);
 		if (clus == 0) {
 			break;
 		}
 		struct FAT32DirEntry dir;
 		int errc = fat32_read_cluster(partition_id, &dir, clus,
-									  i % (fat32_superblock->sector_per_cluster * SECTORSIZE),
-									  sizeof(dir));
+									  i % fat32_cluster_size(partition_id), sizeof(dir));
 		if (errc < 0) {
 			return errc;
 		}
@@ -147,16 +149,16 @@ int fat32_dir_first_file(int partition_id, unsigned int cluster) {
 	return -1;
 }
 
-int fat32_dir_read(int partition_id, char* buf, unsigned int cluster, unsigned int entry) {
+int fat32_dir_read(int partition_id, char* buf, unsigned int cluster, unsigned int entry,
+				   struct FileChain* chain) {
 	for (int i = entry * 32;; i += 32) {
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i, chain);
 		if (clus == 0) {
 			break;
 		}
 		struct FAT32DirEntry dir;
 		int errc = fat32_read_cluster(partition_id, &dir, clus,
-									  i % (fat32_superblock->sector_per_cluster * SECTORSIZE),
-									  sizeof(dir));
+									  i % fat32_cluster_size(partition_id), sizeof(dir));
 		if (errc < 0) {
 			return errc;
 		}
@@ -222,20 +224,20 @@ static char* fat32_file_get_short_name(char* shortname, const char* longname) {
 
 static int fat32_dir_insert_entry(int partition_id, unsigned int cluster,
 								  struct FAT32DirEntry* dirent) {
+	struct FileChain chain;
+	memset(&chain, 0, sizeof(chain));
 	for (int i = 0;; i += 32) {
 		struct FAT32DirEntry dir;
-		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i);
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, i, &chain);
 		if (clus == 0) {
 			break;
 		}
-		if (fat32_read_cluster(partition_id, &dir, clus,
-							   i % (fat32_superblock->sector_per_cluster * SECTORSIZE),
+		if (fat32_read_cluster(partition_id, &dir, clus, i % fat32_cluster_size(partition_id),
 							   sizeof(dir)) < 0) {
 			return ERROR_READ_FAIL;
 		}
 		if (dir.name[0] == 0xe5 || dir.name[0] == 0x00) {
-			if (fat32_write_cluster(partition_id, dirent, clus,
-									i % (fat32_superblock->sector_per_cluster * SECTORSIZE),
+			if (fat32_write_cluster(partition_id, dirent, clus, i % fat32_cluster_size(partition_id),
 									sizeof(dir)) < 0) {
 				return ERROR_WRITE_FAIL;
 			}
@@ -265,7 +267,7 @@ int fat32_mkdir(int partition_id, struct VfsPath path) {
 		cluster = (dir.cluster_hi << 16) | dir.cluster_lo;
 		filename = path.pathbuf + prevpath.parts * 128;
 	} else {
-		cluster = fat32_superblock->root_cluster;
+		cluster = fat32_volume(partition_id)->boot->root_cluster;
 		filename = path.pathbuf;
 	}
 	// check exist
@@ -302,13 +304,15 @@ int fat32_mkdir(int partition_id, struct VfsPath path) {
 	// dotdot entry
 	memset(&dir, 0, sizeof(dir));
 	memmove(dir.name, "..         ", 11);
-	if (cluster != fat32_superblock->root_cluster) {
+	if (cluster != fat32_volume(partition_id)->boot->root_cluster) {
 		// not root cluster
 		dir.cluster_lo = cluster & 0xffff;
 		dir.cluster_hi = (cluster >> 16) & 0xffff;
 	}
 	dir.attr = ATTR_DIRECTORY;
-	return fat32_dir_insert_entry(partition_id, alloc, &dir);
+	ret = fat32_dir_insert_entry(partition_id, alloc, &dir);
+	fat32_fat_sync(partition_id);
+	return ret;
 }
 
 int fat32_file_remove(int partition_id, struct VfsPath path) {
@@ -324,7 +328,7 @@ int fat32_file_remove(int partition_id, struct VfsPath path) {
 		cluster = (dir.cluster_hi << 16) | dir.cluster_lo;
 		filename = path.pathbuf + prevpath.parts * 128;
 	} else {
-		cluster = fat32_superblock->root_cluster;
+		cluster = fat32_volume(partition_id)->boot->root_cluster;
 		filename = path.pathbuf;
 	}
 	// check exist
@@ -336,22 +340,29 @@ int fat32_file_remove(int partition_id, struct VfsPath path) {
 	if (search_dir.attr & ATTR_DIRECTORY) {
 		return ERROR_NOT_FILE;
 	}
-	if (fat32_free_chain(partition_id, (search_dir.cluster_hi << 16) | search_dir.cluster_lo) < 0) {
-		return ERROR_WRITE_FAIL;
+	struct FAT32FreedRuns* runs;
+	int ret = fat32_free_chain(partition_id, (search_dir.cluster_hi << 16) | search_dir.cluster_lo,
+							   &runs);
+	if (ret == 0) {
+		search_dir.name[0] = 0xe5;
+		unsigned int clus = fat32_offset_cluster(partition_id, cluster, ent_idx * 32, 0);
+		if (fat32_write_cluster(partition_id, &search_dir, clus,
+								ent_idx * 32 % fat32_cluster_size(partition_id),
+								sizeof(search_dir)) < 0) {
+			ret = ERROR_WRITE_FAIL;
+		}
 	}
-	search_dir.name[0] = 0xe5;
-	unsigned int clus = fat32_offset_cluster(partition_id, cluster, ent_idx * 32);
-	if (fat32_write_cluster(partition_id, &search_dir, clus,
-							ent_idx * 32 % (fat32_superblock->sector_per_cluster * SECTORSIZE),
-							sizeof(search_dir)) < 0) {
-		return ERROR_WRITE_FAIL;
+	if (ret == 0 && fat32_fat_sync(partition_id) < 0) {
+		ret = ERROR_WRITE_FAIL;
 	}
-	return 0;
+	// no FAT on disk may chain the clusters when they are discarded
+	fat32_release_runs(partition_id, runs, ret == 0 && hal_partition_sync(partition_id) == 0);
+	return ret;
 }
 
 static int fat32_write_inode(int partition_id, struct VfsPath path,
 							 const struct FAT32DirEntry* dir_dest) {
-	unsigned int cluster = fat32_superblock->root_cluster;
+	unsigned int cluster = fat32_volume(partition_id)->boot->root_cluster;
 	int ino;
 	struct FAT32DirEntry dir;
 	for (int i = 0; i < path.parts - 1; i++) {
@@ -365,8 +376,8 @@ static int fat32_write_inode(int partition_id, struct VfsPath path,
 		return ERROR_NOT_EXIST;
 	}
 	return fat32_write_cluster(partition_id, dir_dest,
-							   fat32_offset_cluster(partition_id, cluster, ino * 32),
-							   ino * 32 % (fat32_superblock->sector_per_cluster * SECTORSIZE),
+							   fat32_offset_cluster(partition_id, cluster, ino * 32, 0),
+							   ino * 32 % fat32_cluster_size(partition_id),
 							   sizeof(struct FAT32DirEntry));
 }
 
@@ -392,7 +403,7 @@ int fat32_file_create(int partition_id, struct VfsPath path) {
 		cluster = (dir.cluster_hi << 16) | dir.cluster_lo;
 		filename = path.pathbuf + prevpath.parts * 128;
 	} else {
-		cluster = fat32_superblock->root_cluster;
+		cluster = fat32_volume(partition_id)->boot->root_cluster;
 		filename = path.pathbuf;
 	}
 
@@ -407,5 +418,7 @@ int fat32_file_create(int partition_id, struct VfsPath path) {
 	}
 	dir.cluster_lo = alloc & 0xffff;
 	dir.cluster_hi = (alloc >> 16) & 0xffff;
-	return fat32_dir_insert_entry(partition_id, cluster, &dir);
+	int ret = fat32_dir_insert_entry(partition_id, cluster, &dir);
+	fat32_fat_sync(partition_id);
+	return ret;
 }
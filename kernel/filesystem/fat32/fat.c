@@ -18,53 +18,465 @@
  */
 
 #include <common/errorcode.h>
+#include <core/mmu.h>
 #include <defs.h>
 #include <hal/hal.h>
 
 #include "fat32-struct.h"
+#include "fat32.h"
+
+#define FAT32_ENTRY_MASK 0x0fffffff // the top 4 bits are reserved
+
+// Release what fat32_fat_load() allocated for a volume
+void fat32_fat_free(struct FAT32Volume* vol) {
+	if (vol->table) {
+		vfree(vol->table);
+	}
+	if (vol->dirty) {
+		vfree(vol->dirty);
+	}
+	if (vol->used) {
+		vfree(vol->used);
+	}
+	if (vol->fsinfo) {
+		kfree(vol->fsinfo);
+	}
+	vol->table = vol->dirty = vol->used = 0;
+	vol->fsinfo = 0;
+}
+
+// Mark the clusters free whose entries from first on are zero
+static void fat32_count_free(struct FAT32Volume* vol, const uint32_t* entry, unsigned int first,
+							 unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int clus = first + i;
+		if (clus >= 2 && clus < vol->entries && (entry[i] & FAT32_ENTRY_MASK) == 0) {
+			vol->used[clus / 32] &= ~(1u << (clus % 32));
+			vol->free++;
+		}
+	}
+}
+
+// Load the active FAT of a volume being mounted, whose boot sector and
+// partition are set. Nothing is left allocated on failure.
+int fat32_fat_load(struct FAT32Volume* vol) {
+	struct FAT32BootSector* boot = vol->boot;
+	struct HalPartitionMap* part = hal_partition(vol->partition_id);
+	unsigned int sectors = boot->fat_size;
+	vol->table = vol->dirty = vol->used = 0;
+	vol->fsinfo = 0;
+	if (!part || !sectors) {
+		return ERROR_INVAILD;
+	}
+	// ext_flags bit 7 set means only the FAT numbered by bits 0-3 is in use
+	if (boot->ext_falgs & (1 << 7)) {
+		vol->first = boot->ext_falgs & 0xf;
+		vol->copies = 1;
+	} else {
+		vol->first = 0;
+		vol->copies = boot->fat_number;
+	}
+	unsigned int data = boot->reserved_sector + boot->fat_number * boot->fat_size;
+	unsigned int clusters = (boot->total_sector - data) / boot->sector_per_cluster + 2;
+	vol->entries = clusters < sectors * 128 ? clusters : sectors * 128;
+	unsigned int begin = part->begin + boot->reserved_sector + vol->first * boot->fat_size;
+	// a FAT too large for the vmalloc area is used through the block cache
+	vol->table = vmalloc(sectors * SECTORSIZE);
+	if (vol->table && !(vol->dirty = vmalloc((sectors + 31) / 32 * sizeof(uint32_t)))) {
+		vfree(vol->table);
+		vol->table = 0;
+	}
+	if (vol->table) {
+		memset(vol->dirty, 0, (sectors + 31) / 32 * sizeof(uint32_t));
+		// the cache holds nothing of a volume not mounted yet, read past it
+		if (hal_disk_read(part->dev, begin, sectors, vol->table) < 0) {
+			fat32_fat_free(vol);
+			return ERROR_READ_FAIL;
+		}
+	} else {
+		cprintf("[fat32] FAT of %d KiB used through the block cache\n", sectors / 2);
+	}
+
+	unsigned int words = (vol->entries + 31) / 32;
+	vol->used = vmalloc(words * sizeof(uint32_t));
+	if (!vol->used) {
+		fat32_fat_free(vol);
+		return ERROR_OUT_OF_SPACE;
+	}
+	memset(vol->used, 0xff, words * sizeof(uint32_t));
+	vol->free = 0;
+	if (vol->table) {
+		fat32_count_free(vol, vol->table, 0, vol->entries);
+	} else {
+		uint32_t* page = kalloc();
+		for (unsigned int sect = 0; page && sect < sectors; sect += PGSIZE / SECTORSIZE) {
+			unsigned int n = sectors - sect < PGSIZE / SECTORSIZE ? sectors - sect
+																   : PGSIZE / SECTORSIZE;
+			if (hal_disk_read(part->dev, begin + sect, n, page) < 0) {
+				kfree(page);
+				fat32_fat_free(vol);
+				return ERROR_READ_FAIL;
+			}
+			fat32_count_free(vol, page, sect * 128, n * 128);
+		}
+		if (!page) {
+			fat32_fat_free(vol);
+			return ERROR_OUT_OF_SPACE;
+		}
+		kfree(page);
+	}
+
+	// FSInfo gives where the last allocation ended, its free count is
+	// only a hint so the one counted above is written back instead
+	vol->next_free = 2;
+	vol->fsinfo = 0;
+	vol->fsinfo_dirty = 0;
+	unsigned int fsinfo = boot->fsinfo;
+	if (fsinfo && fsinfo != 0xffff) {
+		struct FAT32FSInfo* fs = kalloc();
+		if (hal_partition_read(vol->partition_id, fsinfo, 1, fs) == 0 &&
+			fs->lead_sig == 0x41615252 && fs->struct_sig == 0x61417272 &&
+			fs->trail_sig == 0xaa550000) {
+			if (fs->next_free >= 2 && fs->next_free < vol->entries) {
+				vol->next_free = fs->next_free;
+			}
+			vol->fsinfo = fs;
+			vol->fsinfo_dirty = fs->free_count != vol->free;
+		} else {
+			kfree(fs);
+		}
+	}
+	cprintf("[fat32] %d of %d clusters free\n", vol->free, vol->entries - 2);
+	return 0;
+}
 
 unsigned int fat32_fat_read(int partition_id, unsigned int current) {
-	uint32_t* buf = kalloc();
-	unsigned int sect = fat32_superblock->reserved_sector + current / 128;
-	hal_partition_read(partition_id, sect, 1, buf);
-	unsigned int val = buf[current % 128];
-	kfree(buf);
-	return val;
-}
-
-unsigned int fat32_offset_cluster(int partition_id, unsigned int cluster, unsigned int offset) {
-	int n = offset / 512 / fat32_superblock->sector_per_cluster;
-	while (n--) {
-		cluster = fat32_fat_read(partition_id, cluster);
-		if (cluster >= 0x0ffffff8) {
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	if (current >= vol->entries) {
+		return FAT32_ENTRY_MASK;
+	}
+	if (vol->table) {
+		return vol->table[current] & FAT32_ENTRY_MASK;
+	}
+	// an entry which cannot be read ends the chain
+	unsigned int sect = vol->boot->reserved_sector + vol->first * vol->boot->fat_size +
+						current / 128;
+	struct BlockBuffer* b = hal_partition_get(partition_id, sect);
+	if (!b) {
+		return FAT32_ENTRY_MASK;
+	}
+	unsigned int entry = ((uint32_t*)hal_partition_data(partition_id, b, sect))[current % 128];
+	hal_block_put(b);
+	return entry & FAT32_ENTRY_MASK;
+}
+
+// Set a FAT entry, in memory for fat32_fat_sync() or in the cached sectors of
+// every FAT copy. The free cluster bitmap is left to the caller.
+static int fat32_entry_store(struct FAT32Volume* vol, unsigned int cluster, unsigned int data) {
+	data &= FAT32_ENTRY_MASK;
+	if (vol->table) {
+		acquire(&vol->lock);
+		vol->table[cluster] = (vol->table[cluster] & ~FAT32_ENTRY_MASK) | data;
+		vol->dirty[cluster / 128 / 32] |= 1u << (cluster / 128 % 32);
+		release(&vol->lock);
+		return 0;
+	}
+	uint32_t* sect = kalloc();
+	if (!sect) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	int ret = 0;
+	// read, modify and write of a sector by one store at a time
+	acquiresleep(&vol->fat_lock);
+	for (unsigned int i = 0; i < vol->copies && ret == 0; i++) {
+		unsigned int lba = vol->boot->reserved_sector + (vol->first + i) * vol->boot->fat_size +
+						   cluster / 128;
+		if (hal_partition_read(vol->partition_id, lba, 1, sect) < 0) {
+			ret = ERROR_READ_FAIL;
+			break;
+		}
+		sect[cluster % 128] = (sect[cluster % 128] & ~FAT32_ENTRY_MASK) | data;
+		if (hal_partition_write(vol->partition_id, lba, 1, sect) < 0) {
+			ret = ERROR_WRITE_FAIL;
+		}
+	}
+	releasesleep(&vol->fat_lock);
+	kfree(sect);
+	return ret;
+}
+
+#define FAT32_EXTENT_MAX (PGSIZE / sizeof(struct FileExtent))
+
+// Lookup for fat32_offset_cluster() through a chain, caller holds the chain lock
+static unsigned int fat32_chain_cluster(struct FAT32Volume* vol, unsigned int cluster,
+										unsigned int index, struct FileChain* chain) {
+	// clusters freed since may belong to another file now, walk the FAT again
+	if (chain->gen != vol->free_gen) {
+		chain->gen = vol->free_gen;
+		chain->cluster = 0;
+		if (chain->extent) {
+			kfree(chain->extent);
+			chain->extent = 0;
+		}
+	}
+	if (chain->decode && !chain->extent) {
+		chain->extent = kalloc(); // cursor only if this fails
+		if (chain->extent) {
+			chain->extent[0].index = 0;
+			chain->extent[0].cluster = cluster;
+			chain->extent[0].count = 1;
+			chain->nextent = 1;
+		}
+	}
+
+	unsigned int i = 0, clus = cluster;
+	if (chain->extent) {
+		// last extent starting at or before index
+		unsigned int lo = 0, hi = chain->nextent - 1;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi + 1) / 2;
+			if (chain->extent[mid].index <= index) {
+				lo = mid;
+			} else {
+				hi = mid - 1;
+			}
+		}
+		struct FileExtent* e = &chain->extent[lo];
+		if (index < e->index + e->count) {
+			return e->cluster + index - e->index;
+		}
+		i = e->index + e->count - 1;
+		clus = e->cluster + e->count - 1;
+	}
+	if (chain->cluster && chain->index <= index && chain->index > i) {
+		i = chain->index;
+		clus = chain->cluster;
+	}
+	while (i < index) {
+		unsigned int next = fat32_fat_read(vol->partition_id, clus);
+		if (next < 2 || next >= 0x0ffffff8) {
 			return 0;
 		}
+		i++;
+		// the end of the chain is never recorded, writes extend it
+		struct FileExtent* last = chain->extent ? &chain->extent[chain->nextent - 1] : 0;
+		if (last && i == last->index + last->count) {
+			if (next == last->cluster + last->count) {
+				last->count++;
+			} else if (chain->nextent < FAT32_EXTENT_MAX) {
+				chain->extent[chain->nextent].index = i;
+				chain->extent[chain->nextent].cluster = next;
+				chain->extent[chain->nextent].count = 1;
+				chain->nextent++;
+			}
+		}
+		clus = next;
+	}
+	chain->index = index;
+	chain->cluster = clus;
+	return clus;
+}
+
+// Cluster holding offset of the chain starting at cluster, 0 past its end.
+// With chain set, a lookup within the decoded extents is a binary search and
+// one past them or the cursor only follows the clusters in between. The
+// chain lock covers the chain, which the threads of a process share.
+unsigned int fat32_offset_cluster(int partition_id, unsigned int cluster, unsigned int offset,
+								  struct FileChain* chain) {
+	unsigned int index = offset / fat32_cluster_size(partition_id);
+	if (cluster < 2) {
+		return 0;
+	}
+	if (!chain) {
+		while (index--) {
+			cluster = fat32_fat_read(partition_id, cluster);
+			if (cluster >= 0x0ffffff8) {
+				return 0;
+			}
+		}
+		return cluster;
 	}
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	acquiresleep(&vol->chain_lock);
+	cluster = fat32_chain_cluster(vol, cluster, index, chain);
+	releasesleep(&vol->chain_lock);
 	return cluster;
 }
 
+static int fat32_cluster_used(struct FAT32Volume* vol, unsigned int clus) {
+	return vol->used[clus / 32] & (1u << (clus % 32));
+}
+
+// Mark a cluster free in the bitmap, caller holds the lock
+static void fat32_cluster_release(struct FAT32Volume* vol, unsigned int cluster) {
+	if (fat32_cluster_used(vol, cluster)) {
+		vol->used[cluster / 32] &= ~(1u << (cluster % 32));
+		vol->free++;
+		vol->fsinfo_dirty = 1;
+		vol->free_gen++;
+	}
+}
+
+// Mark a cluster used in the bitmap, caller holds the lock
+static void fat32_cluster_claim(struct FAT32Volume* vol, unsigned int cluster) {
+	if (!fat32_cluster_used(vol, cluster)) {
+		vol->used[cluster / 32] |= 1u << (cluster % 32);
+		vol->free--;
+		vol->fsinfo_dirty = 1;
+	}
+}
+
+// Set a FAT entry and keep the free cluster bitmap in step. A cluster is
+// claimed before its entry is set and released after it is cleared.
 int fat32_write_fat(int partition_id, unsigned int cluster, unsigned int data) {
-	uint32_t* buf = kalloc();
-	int sect = fat32_superblock->reserved_sector + cluster / 128;
-	if (hal_partition_read(partition_id, sect, 1, buf) < 0) {
-		kfree(buf);
-		return ERROR_READ_FAIL;
-	}
-	buf[cluster % 128] = data;
-	// first fat
-	if (hal_partition_write(partition_id, sect, 1, buf) < 0) {
-		kfree(buf);
-		return ERROR_WRITE_FAIL;
-	}
-	// second fat
-	if (hal_partition_write(partition_id, sect + fat32_superblock->fat_size, 1, buf) < 0) {
-		kfree(buf);
-		return ERROR_WRITE_FAIL;
-	}
-	kfree(buf);
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	if (cluster < 2 || cluster >= vol->entries) {
+		return ERROR_INVAILD;
+	}
+	data &= FAT32_ENTRY_MASK;
+	if (data) {
+		acquire(&vol->lock);
+		fat32_cluster_claim(vol, cluster);
+		release(&vol->lock);
+	}
+	int ret = fat32_entry_store(vol, cluster, data);
+	if (!data && ret == 0) {
+		acquire(&vol->lock);
+		fat32_cluster_release(vol, cluster);
+		release(&vol->lock);
+	}
+	return ret;
+}
+
+// First free cluster at or after from, wrapping around, 0 if there is none.
+// Caller holds the lock.
+static unsigned int fat32_find_free(struct FAT32Volume* vol, unsigned int from) {
+	if (!vol->free) {
+		return 0;
+	}
+	if (from < 2 || from >= vol->entries) {
+		from = 2;
+	}
+	unsigned int words = (vol->entries + 31) / 32;
+	unsigned int w = from / 32;
+	// the first word is seen again last for the clusters before from
+	for (unsigned int n = 0; n <= words; n++, w = (w + 1) % words) {
+		uint32_t used = vol->used[w];
+		if (n == 0) {
+			used |= (1u << (from % 32)) - 1;
+		}
+		if (used != ~0u) {
+			return w * 32 + __builtin_ctz(~used);
+		}
+	}
 	return 0;
 }
 
+// Allocate up to want contiguous clusters starting from goal if it is free,
+// chained in order and ending the chain. Return the first cluster and the
+// number allocated in *count, 0 if the volume is full.
+unsigned int fat32_allocate_clusters(int partition_id, unsigned int goal, unsigned int want,
+									 unsigned int* count) {
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	acquire(&vol->lock);
+	unsigned int first = fat32_find_free(vol, goal ? goal : vol->next_free);
+	if (!first) {
+		release(&vol->lock);
+		*count = 0;
+		return 0;
+	}
+	unsigned int n = 1;
+	while (n < want && first + n < vol->entries && !fat32_cluster_used(vol, first + n)) {
+		n++;
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		fat32_cluster_claim(vol, first + i);
+	}
+	vol->next_free = first + n < vol->entries ? first + n : 2;
+	release(&vol->lock);
+	// the claimed run is ours, its entries are set without the lock
+	for (unsigned int i = 0; i < n; i++) {
+		if (fat32_entry_store(vol, first + i, i + 1 < n ? first + i + 1 : FAT32_ENTRY_MASK) < 0) {
+			for (unsigned int j = 0; j < i; j++) {
+				fat32_entry_store(vol, first + j, 0);
+			}
+			acquire(&vol->lock);
+			for (unsigned int j = 0; j < n; j++) {
+				fat32_cluster_release(vol, first + j);
+			}
+			release(&vol->lock);
+			*count = 0;
+			return 0;
+		}
+	}
+	*count = n;
+	return first;
+}
+
+// Find a free cluster and end a chain there, 0 if the volume is full
+unsigned int fat32_allocate_cluster(int partition_id) {
+	unsigned int count;
+	return fat32_allocate_clusters(partition_id, 0, 1, &count);
+}
+
+// Write the FAT sectors changed since the last call to every FAT copy, a run
+// of adjacent sectors in one request for each copy
+int fat32_fat_sync(int partition_id) {
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	struct FAT32BootSector* boot = vol->boot;
+	int ret = 0;
+	// without a table in memory every entry is stored in the cache already
+	unsigned int words = vol->table ? (boot->fat_size + 31) / 32 : 0;
+	for (unsigned int w = 0; w < words; w++) {
+		if (!vol->dirty[w]) {
+			continue;
+		}
+		acquire(&vol->lock);
+		uint32_t dirty = vol->dirty[w];
+		vol->dirty[w] = 0;
+		release(&vol->lock);
+		// entries changed from now on dirty their sector again
+		for (unsigned int bit = 0; bit < 32; bit++) {
+			if (!(dirty & (1u << bit))) {
+				continue;
+			}
+			unsigned int n = 1;
+			while (bit + n < 32 && (dirty & (1u << (bit + n)))) {
+				n++;
+			}
+			unsigned int sect = w * 32 + bit;
+			for (unsigned int i = 0; i < vol->copies; i++) {
+				if (hal_partition_write(partition_id,
+										boot->reserved_sector + (vol->first + i) * boot->fat_size +
+											sect,
+										n, vol->table + sect * 128) < 0) {
+					acquire(&vol->lock);
+					vol->dirty[w] |= (n == 32 ? ~0u : (1u << n) - 1) << bit;
+					release(&vol->lock);
+					ret = ERROR_WRITE_FAIL;
+				}
+			}
+			bit += n;
+		}
+	}
+
+	acquire(&vol->lock);
+	int fsinfo_dirty = vol->fsinfo && vol->fsinfo_dirty;
+	if (fsinfo_dirty) {
+		vol->fsinfo->free_count = vol->free;
+		vol->fsinfo->next_free = vol->next_free;
+		vol->fsinfo_dirty = 0;
+	}
+	release(&vol->lock);
+	if (fsinfo_dirty && hal_partition_write(partition_id, boot->fsinfo, 1, vol->fsinfo) < 0) {
+		acquire(&vol->lock);
+		vol->fsinfo_dirty = 1;
+		release(&vol->lock);
+		ret = ERROR_WRITE_FAIL;
+	}
+	return ret;
+}
+
 int fat32_append_cluster(int partition_id, unsigned int begin_cluster, unsigned int end_cluster) {
 	unsigned int clus = begin_cluster;
 	while (fat32_fat_read(partition_id, clus) < 0x0ffffff8) {
@@ -73,15 +485,92 @@ int fat32_append_cluster(int partition_id, unsigned int begin_cluster, unsigned
 	return fat32_write_fat(partition_id, clus, end_cluster);
 }
 
-int fat32_free_chain(int partition_id, unsigned int cluster) {
+#define FAT32_RUNS_MAX ((PGSIZE - sizeof(void*) - sizeof(unsigned int)) / sizeof(struct BlockRange))
+
+struct FAT32FreedRuns {
+	struct FAT32FreedRuns* next;
+	unsigned int count;
+	struct BlockRange range[FAT32_RUNS_MAX]; // first cluster and clusters
+};
+
+// Unlink a chain from the FAT. Its runs of contiguous clusters stay allocated
+// in *runs, to be discarded and released by fat32_release_runs() once the FAT
+// is synced. Clusters a page of runs could not be allocated for are released
+// at once and never discarded.
+int fat32_free_chain(int partition_id, unsigned int cluster, struct FAT32FreedRuns** runs) {
+	*runs = 0;
+	if (cluster < 2) { // empty file
+		return 0;
+	}
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	struct FAT32FreedRuns* page = 0;
+	int ret = 0;
 	do {
 		// read it out and clear FAT entry
 		unsigned int clus = fat32_fat_read(partition_id, cluster);
-		if (fat32_write_fat(partition_id, cluster, 0) < 0) {
-			return ERROR_WRITE_FAIL;
+		if (cluster < 2 || cluster >= vol->entries) {
+			ret = ERROR_WRITE_FAIL;
+			break;
+		}
+		int kept = 1;
+		if (page && page->count &&
+			page->range[page->count - 1].lba + page->range[page->count - 1].count == cluster) {
+			page->range[page->count - 1].count++;
+		} else {
+			if (!page || page->count == FAT32_RUNS_MAX) {
+				struct FAT32FreedRuns* p = kalloc();
+				if (p) {
+					p->next = page;
+					p->count = 0;
+					page = p;
+				}
+			}
+			if (page && page->count < FAT32_RUNS_MAX) {
+				page->range[page->count].lba = cluster;
+				page->range[page->count++].count = 1;
+			} else {
+				kept = 0;
+			}
+		}
+		// a kept cluster stays used in the bitmap until fat32_release_runs()
+		if (fat32_entry_store(vol, cluster, 0) < 0) {
+			ret = ERROR_WRITE_FAIL;
+		} else if (!kept) {
+			acquire(&vol->lock);
+			fat32_cluster_release(vol, cluster);
+			release(&vol->lock);
 		}
 		// advance to next FAT entry
 		cluster = clus;
 	} while (cluster < 0x0ffffff8);
-	return 0;
+	*runs = page;
+	return ret;
+}
+
+// Discard the runs of an unlinked chain if asked, then let them be allocated
+// again. The discard comes first as it may zero the clusters.
+void fat32_release_runs(int partition_id, struct FAT32FreedRuns* runs, int discard) {
+	struct FAT32Volume* vol = fat32_volume(partition_id);
+	while (runs) {
+		struct FAT32FreedRuns* next = runs->next;
+		// failure only costs the hint
+		struct BlockRange* range = discard ? kalloc() : 0;
+		if (range) {
+			for (unsigned int i = 0; i < runs->count; i++) {
+				range[i].lba = fat32_cluster_to_sector(partition_id, runs->range[i].lba);
+				range[i].count = runs->range[i].count * vol->boot->sector_per_cluster;
+			}
+			hal_partition_discard(partition_id, range, runs->count);
+			kfree(range);
+		}
+		acquire(&vol->lock);
+		for (unsigned int i = 0; i < runs->count; i++) {
+			for (unsigned int n = 0; n < runs->range[i].count; n++) {
+				fat32_cluster_release(vol, runs->range[i].lba + n);
+			}
+		}
+		release(&vol->lock);
+		kfree(runs);
+		runs = next;
+	}
 }
@@ -34,6 +34,16 @@ struct FAT32BootSector {
 	char fstype[8];
 } PACKED;
 
+struct FAT32FSInfo {
+	uint32_t lead_sig; // 0x41615252
+	uint8_t reserved[480];
+	uint32_t struct_sig; // 0x61417272
+	uint32_t free_count; // 0xffffffff if unknown
+	uint32_t next_free; // where to look for a free cluster, 0xffffffff if unknown
+	uint8_t reserved1[12];
+	uint32_t trail_sig; // 0xaa550000
+} PACKED;
+
 struct FAT32DirEntry {
 	uint8_t name[11];
 	uint8_t attr;
@@ -79,6 +89,4 @@ enum FAT32DirAttr {
 	ATTR_LONG_NAME = 0x0f,
 };
 
-extern struct FAT32BootSector* fat32_superblock;
-
 #endif
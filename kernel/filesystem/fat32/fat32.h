@@ -1,27 +1,55 @@
 #ifndef _FAT32_FAT32_H
 #define _FAT32_FAT32_H
 
+#include <common/sleeplock.h>
+#include <common/spinlock.h>
+#include <common/types.h>
 #include <filesystem/vfs/vfs.h>
 
 #define SECTORSIZE 512
+#define FAT32_READAHEAD_MIN (16 * 1024)
+#define FAT32_READAHEAD_MAX (128 * 1024)
+
+// A mounted volume with its active FAT in memory if there is room. Chain walks
+// read the FAT without the lock and updates mark their sector for
+// fat32_fat_sync(). Otherwise the FAT is read and written in the block cache.
+struct FAT32Volume {
+	int partition_id;
+	struct FAT32BootSector* boot; // 0 if the slot is free
+	struct spinlock lock;
+	struct sleeplock chain_lock; // covers FileChain lookups
+	struct sleeplock fat_lock; // covers FAT sector updates in the block cache
+	uint32_t* table; // 0 if the FAT is used through the block cache
+	unsigned int entries; // clusters on the volume plus the two reserved entries
+	uint32_t* dirty; // bitmap of FAT sectors not written back
+	unsigned int first, copies; // FATs written back
+	uint32_t* used; // bitmap of clusters in use, set past the last cluster
+	unsigned int free; // clusters free
+	unsigned int next_free; // where the search for a free cluster starts
+	struct FAT32FSInfo* fsinfo; // copy of the FSInfo sector, 0 if the volume has none
+	int fsinfo_dirty;
+	unsigned int free_gen; // bumped when a cluster is freed, see struct FileChain
+};
+
+#define FAT32_VOLUME_MAX 4
 
 // cluster.c
-int fat32_cluster_to_sector(unsigned int cluster);
+int fat32_cluster_to_sector(int partition_id, unsigned int cluster);
+unsigned int fat32_cluster_size(int partition_id);
 int fat32_read_cluster(int partition_id, void* dest, unsigned int cluster,
 					   unsigned int begin, unsigned int size);
 int fat32_read(int partition_id, unsigned int cluster, void* buf, unsigned int offset,
-			   unsigned int size);
+			   unsigned int size, struct FileReadahead* ra, struct FileChain* chain);
 int fat32_write_cluster(int partition_id, const void* src, unsigned int cluster,
 						unsigned int begin, unsigned int size);
-unsigned int fat32_allocate_cluster(int partition_id);
 int fat32_write(int partition_id, unsigned int cluster, const void* buf,
-				unsigned int offset, unsigned int size);
+				unsigned int offset, unsigned int size, struct FileChain* chain);
 
 // dir.c
 int fat32_open(int partition_id, struct VfsPath path);
 int fat32_dir_first_file(int partition_id, unsigned int cluster);
 int fat32_dir_read(int partition_id, char* buf, unsigned int cluster,
-				   unsigned int entry);
+				   unsigned int entry, struct FileChain* chain);
 int fat32_file_size(int partition_id, struct VfsPath path);
 int fat32_file_mode(int partition_id, struct VfsPath path);
 int fat32_mkdir(int partition_id, struct VfsPath path);
@@ -30,15 +58,25 @@ int fat32_update_size(int partition_id, struct VfsPath path, unsigned int size);
 int fat32_file_create(int partition_id, struct VfsPath path);
 
 // fat.c
+int fat32_fat_load(struct FAT32Volume* vol);
+void fat32_fat_free(struct FAT32Volume* vol);
 unsigned int fat32_fat_read(int partition_id, unsigned int current);
 unsigned int fat32_offset_cluster(int partition_id, unsigned int cluster,
-								  unsigned int offset);
+								  unsigned int offset, struct FileChain* chain);
 int fat32_write_fat(int partition_id, unsigned int cluster, unsigned int data);
+unsigned int fat32_allocate_clusters(int partition_id, unsigned int goal, unsigned int want,
+									 unsigned int* count);
+unsigned int fat32_allocate_cluster(int partition_id);
+int fat32_fat_sync(int partition_id);
 int fat32_append_cluster(int partition_id, unsigned int begin_cluster,
 						 unsigned int end_cluster);
-int fat32_free_chain(int partition_id, unsigned int cluster);
+struct FAT32FreedRuns;
+int fat32_free_chain(int partition_id, unsigned int cluster, struct FAT32FreedRuns** runs);
+void fat32_release_runs(int partition_id, struct FAT32FreedRuns* runs, int discard);
 
 // mount.c
+void fat32_init(void);
+struct FAT32Volume* fat32_volume(int partition_id);
 int fat32_mount(int partition_id);
 
 #endif
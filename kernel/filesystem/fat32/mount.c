@@ -22,21 +22,94 @@
 #include <hal/hal.h>
 
 #include "fat32-struct.h"
+#include "fat32.h"
 
-struct FAT32BootSector* fat32_superblock;
+static struct {
+	struct spinlock lock;
+	struct FAT32Volume volume[FAT32_VOLUME_MAX];
+} fat32_volumes;
 
+void fat32_init(void) {
+	initlock(&fat32_volumes.lock, "fat32");
+	for (int i = 0; i < FAT32_VOLUME_MAX; i++) {
+		fat32_volumes.volume[i].boot = 0;
+		initlock(&fat32_volumes.volume[i].lock, "fat32-fat");
+		initsleeplock(&fat32_volumes.volume[i].chain_lock, "fat32-chain");
+		initsleeplock(&fat32_volumes.volume[i].fat_lock, "fat32-sector");
+	}
+}
+
+// The mounted volume on a partition, which the caller got from the mount table
+struct FAT32Volume* fat32_volume(int partition_id) {
+	for (int i = 0; i < FAT32_VOLUME_MAX; i++) {
+		struct FAT32Volume* vol = &fat32_volumes.volume[i];
+		if (vol->boot && vol->partition_id == partition_id) {
+			return vol;
+		}
+	}
+	panic("fat32 volume not mounted");
+}
+
+// Load a volume aside and only publish it once all of it is in memory
 int fat32_mount(int partition_id) {
-	struct FAT32BootSector* bootsect = (void*)kalloc();
-	if (hal_partition_read(partition_id, 0, 1, bootsect) < 0) {
+	struct FAT32Volume load;
+	load.partition_id = partition_id;
+	load.boot = (void*)kalloc();
+	if (hal_partition_read(partition_id, 0, 1, load.boot) < 0) {
+		kfree(load.boot);
 		return ERROR_READ_FAIL;
 	}
-	if (strncmp(bootsect->fstype, "FAT32", 5)) {
-		panic("Mounting a non-FAT32 filesystem");
+	if (strncmp(load.boot->fstype, "FAT32", 5)) {
+		cprintf("[fat32] Not a FAT32 filesystem\n");
+		kfree(load.boot);
+		return ERROR_INVAILD;
 	}
 	char label[12];
-	strncpy(label, bootsect->volume_label, 12);
+	strncpy(label, load.boot->volume_label, 12);
 	label[11] = '\0';
 	cprintf("[fat32] Mount %s\n", label);
-	fat32_superblock = bootsect;
+	int ret = fat32_fat_load(&load);
+	if (ret < 0) {
+		cprintf("[fat32] Cannot load FAT of %s\n", label);
+		kfree(load.boot);
+		return ret;
+	}
+
+	struct FAT32Volume* vol = 0;
+	ret = ERROR_OUT_OF_SPACE;
+	acquire(&fat32_volumes.lock);
+	for (int i = 0; i < FAT32_VOLUME_MAX; i++) {
+		struct FAT32Volume* v = &fat32_volumes.volume[i];
+		if (v->boot && v->partition_id == partition_id) {
+			vol = 0;
+			ret = ERROR_EXIST;
+			break;
+		}
+		if (!v->boot && !vol) {
+			vol = v;
+		}
+	}
+	if (vol) {
+		vol->partition_id = partition_id;
+		vol->table = load.table;
+		vol->entries = load.entries;
+		vol->dirty = load.dirty;
+		vol->first = load.first;
+		vol->copies = load.copies;
+		vol->used = load.used;
+		vol->free = load.free;
+		vol->next_free = load.next_free;
+		vol->fsinfo = load.fsinfo;
+		vol->fsinfo_dirty = load.fsinfo_dirty;
+		__sync_synchronize();
+		vol->boot = load.boot; // lookups find the volume from here on
+	}
+	release(&fat32_volumes.lock);
+	if (!vol) {
+		cprintf("[fat32] Cannot mount %s\n", label);
+		fat32_fat_free(&load);
+		kfree(load.boot);
+		return ret;
+	}
 	return 0;
 }
@@ -26,6 +26,7 @@
 
 int vfs_dir_open(struct FileDesc* fd, const char* dirname) {
 	memset(fd, 0, sizeof(struct FileDesc));
+	fd->chain.decode = 1;
 	struct VfsPath dirpath;
 	dirpath.pathbuf = kalloc();
 	dirpath.parts = vfs_path_split(dirname, dirpath.pathbuf);
@@ -76,8 +77,8 @@ int vfs_dir_read(struct FileDesc* fd, char* buffer) {
 	if (vfs_mount_table[fd->fs_id].fs_type == VFS_FS_INITRAMFS) {
 		off = initramfs_dir_read(fd->offset, buffer);
 	} else if (vfs_mount_table[fd->fs_id].fs_type == VFS_FS_FAT32) {
-		off =
-			fat32_dir_read(vfs_mount_table[fd->fs_id].partition_id, buffer, fd->block, fd->offset);
+		off = fat32_dir_read(vfs_mount_table[fd->fs_id].partition_id, buffer, fd->block,
+							 fd->offset, &fd->chain);
 	} else {
 		panic("vfs_dir_read");
 	}
@@ -97,6 +98,9 @@ int vfs_dir_close(struct FileDesc* fd) {
 	if (!fd->dir) {
 		return ERROR_INVAILD;
 	}
+	if (fd->chain.extent) {
+		kfree(fd->chain.extent);
+	}
 
 	fd->used = 0;
 	return 0;
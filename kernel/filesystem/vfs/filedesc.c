@@ -21,11 +21,13 @@
 #include <defs.h>
 #include <filesystem/fat32/fat32.h>
 #include <filesystem/initramfs/initramfs.h>
+#include <hal/hal.h>
 
 #include "vfs.h"
 
 int vfs_fd_open(struct FileDesc* fd, const char* filename, int mode) {
 	memset(fd, 0, sizeof(struct FileDesc));
+	fd->chain.decode = 1;
 	struct VfsPath filepath;
 	filepath.pathbuf = kalloc();
 	filepath.parts = vfs_path_split(filename, filepath.pathbuf);
@@ -116,8 +118,8 @@ int vfs_fd_read(struct FileDesc* fd, void* buf, unsigned int size) {
 		} else {
 			status = size;
 		}
-		int ret =
-			fat32_read(vfs_mount_table[fd->fs_id].partition_id, fd->block, buf, fd->offset, size);
+		int ret = fat32_read(vfs_mount_table[fd->fs_id].partition_id, fd->block, buf, fd->offset,
+							 status, &fd->ra, &fd->chain);
 		if (ret < 0) {
 			return ret;
 		}
@@ -143,7 +145,8 @@ int vfs_fd_write(struct FileDesc* fd, const char* buf, unsigned int size) {
 			fd->offset = fd->size;
 		}
 		int ret =
-			fat32_write(vfs_mount_table[fd->fs_id].partition_id, fd->block, buf, fd->offset, size);
+			fat32_write(vfs_mount_table[fd->fs_id].partition_id, fd->block, buf, fd->offset, size,
+						&fd->chain);
 		if (ret < 0) {
 			return ret;
 		}
@@ -171,11 +174,28 @@ int vfs_fd_close(struct FileDesc* fd) {
 		}
 		kfree(fd->path.pathbuf);
 	}
+	if (fd->chain.extent) {
+		kfree(fd->chain.extent);
+	}
 
 	fd->used = 0;
 	return 0;
 }
 
+// Write the file size and the cached blocks of its filesystem to disk
+int vfs_fd_sync(struct FileDesc* fd) {
+	if (!fd->used) {
+		return ERROR_INVAILD;
+	}
+	if (vfs_mount_table[fd->fs_id].fs_type != VFS_FS_FAT32) {
+		return 0;
+	}
+	if (fd->write) {
+		fat32_update_size(vfs_mount_table[fd->fs_id].partition_id, fd->path, fd->size);
+	}
+	return hal_partition_sync(vfs_mount_table[fd->fs_id].partition_id);
+}
+
 int vfs_fd_seek(struct FileDesc* fd, unsigned int off, enum FileSeekMode mode) {
 	if (!fd->used) {
 		return ERROR_INVAILD;
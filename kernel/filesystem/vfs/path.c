@@ -74,9 +74,10 @@ void vfs_path_tostring(struct VfsPath path, char* buf) {
 
 void vfs_get_absolute_path(struct VfsPath* path) {
 	char* newpath = kalloc();
-	memmove(newpath, myproc()->cwd.pathbuf, myproc()->cwd.parts * 128);
-	memmove(newpath + myproc()->cwd.parts * 128, path->pathbuf, path->parts * 128);
+	struct VfsPath* cwd = &myproc()->leader->cwd;
+	memmove(newpath, cwd->pathbuf, cwd->parts * 128);
+	memmove(newpath + cwd->parts * 128, path->pathbuf, path->parts * 128);
 	kfree(path->pathbuf);
 	path->pathbuf = newpath;
-	path->parts += myproc()->cwd.parts;
+	path->parts += cwd->parts;
 }
@@ -18,6 +18,7 @@
  */
 
 #include <common/errorcode.h>
+#include <common/spinlock.h>
 #include <defs.h>
 #include <filesystem/fat32/fat32.h>
 #include <filesystem/initramfs/initramfs.h>
@@ -27,46 +28,89 @@
 
 struct VfsMountTableEntry vfs_mount_table[VFS_MOUNT_TABLE_MAX];
 
+static struct spinlock vfs_mount_lock;
+static unsigned int vfs_mount_busy; // entries being mounted
+
 void vfs_init(void) {
 	memset(vfs_mount_table, 0, sizeof(vfs_mount_table));
-	int fs_id = 0;
+	initlock(&vfs_mount_lock, "vfs-mount");
+	vfs_mount_busy = 0;
 
+	fat32_init();
 	int status = initramfs_init();
 	if (status == 0) {
 		cprintf("[vfs] mount initramfs on /\n");
 		vfs_mount_table[0].fs_type = VFS_FS_INITRAMFS;
 		vfs_mount_table[0].partition_id = 0; // N/A
-		fs_id++;
 	}
 
-	for (int i = 0; i < HAL_PARTITION_MAX; i++) {
-		if (hal_partition_map[i].fs_type == HAL_PARTITION_FAT32) {
-			if (fs_id == 0) {
-				cprintf("[vfs] mount fat32 on /\n");
-			} else if (fs_id == 1) {
-				cprintf("[vfs] mount fat32 on /fat32\n");
-			}
-			fat32_mount(i);
-			vfs_mount_table[fs_id].fs_type = VFS_FS_FAT32;
-			vfs_mount_table[fs_id].partition_id = i;
-			fs_id++;
+	for (int i = 0; i < hal_partition_max; i++) {
+		struct HalPartitionMap* part = hal_partition(i);
+		if (part && part->fs_type == HAL_PARTITION_FAT32 && vfs_mount_fat32(i) >= 0) {
 			break;
 		}
 	}
-	if (fs_id == 0) {
+	if (vfs_mount_table[0].fs_type == VFS_FS_NONE) {
 		panic("root filesystem not found");
 	}
 }
 
+// Mount a FAT32 partition on the first free entry, which is / without a root
+// filesystem, then /fat32 and /mnt2 onwards. Return the entry.
+int vfs_mount_fat32(int partition_id) {
+	acquire(&vfs_mount_lock);
+	int fs_id = 0;
+	while (fs_id < VFS_MOUNT_TABLE_MAX && (vfs_mount_table[fs_id].fs_type != VFS_FS_NONE ||
+										   (vfs_mount_busy & (1u << fs_id)))) {
+		fs_id++;
+	}
+	if (fs_id == VFS_MOUNT_TABLE_MAX) {
+		release(&vfs_mount_lock);
+		return ERROR_OUT_OF_SPACE;
+	}
+	vfs_mount_busy |= 1u << fs_id;
+	release(&vfs_mount_lock);
+
+	// the entry stays reserved while the volume is read
+	int ret = fat32_mount(partition_id);
+	acquire(&vfs_mount_lock);
+	if (ret == 0) {
+		vfs_mount_table[fs_id].partition_id = partition_id;
+		__sync_synchronize(); // lockless lookups see the partition before the type
+		vfs_mount_table[fs_id].fs_type = VFS_FS_FAT32;
+	}
+	vfs_mount_busy &= ~(1u << fs_id);
+	release(&vfs_mount_lock);
+	if (ret < 0) {
+		return ret;
+	}
+	if (fs_id == 0) {
+		cprintf("[vfs] mount fat32 on /\n");
+	} else if (fs_id == 1) {
+		cprintf("[vfs] mount fat32 on /fat32\n");
+	} else {
+		cprintf("[vfs] mount fat32 on /mnt%d\n", fs_id);
+	}
+	return fs_id;
+}
+
 int vfs_path_to_fs(struct VfsPath orig_path, struct VfsPath* path) {
 	if (orig_path.parts == 0) {
 		path->parts = 0;
 		return 0;
 	} else {
-		if (strncmp(orig_path.pathbuf, "fat32", 64) == 0) {
+		const char* name = orig_path.pathbuf;
+		int fs_id = 0;
+		if (strncmp(name, "fat32", 64) == 0) {
+			fs_id = 1;
+		} else if (strncmp(name, "mnt", 3) == 0 && name[3] >= '2' &&
+				   name[3] < '0' + VFS_MOUNT_TABLE_MAX && name[4] == '\0') {
+			fs_id = name[3] - '0';
+		}
+		if (fs_id) {
 			path->parts = orig_path.parts - 1;
 			path->pathbuf = orig_path.pathbuf + 128;
-			return 1;
+			return fs_id;
 		} else {
 			path->parts = orig_path.parts;
 			path->pathbuf = orig_path.pathbuf;
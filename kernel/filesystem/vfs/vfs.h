@@ -6,6 +6,31 @@ struct VfsPath {
 	char* pathbuf;
 };
 
+// sequential read detection for read-ahead
+struct FileReadahead {
+	unsigned int next; // offset a sequential read starts at
+	unsigned int window; // bytes to read ahead, 0 if not sequential
+	unsigned int end; // end of the data already read ahead
+};
+
+// run of clusters contiguous on disk
+struct FileExtent {
+	unsigned int index; // of the first cluster in the file
+	unsigned int cluster;
+	unsigned int count;
+};
+
+// cluster chain lookups of a file, the extents are decoded as far as the
+// file was accessed, the cursor is the last cluster looked up. Both are
+// dropped once the volume frees any cluster, as the file may have been removed.
+struct FileChain {
+	unsigned int index, cluster; // cursor, cluster 0 if unset
+	int decode; // build the extent list, freed when the file is closed
+	struct FileExtent* extent; // kalloc'd page, 0 until the first lookup
+	unsigned int nextent;
+	unsigned int gen; // free generation of the volume the lookups were made in
+};
+
 struct FileDesc {
 	struct {
 		int used : 1;
@@ -21,6 +46,8 @@ struct FileDesc {
 	unsigned int size; // current file size
 					   // below are not used in read-only files
 	struct VfsPath path; // for update file size,not used for read-only file
+	struct FileReadahead ra;
+	struct FileChain chain;
 };
 
 enum OpenMode {
@@ -54,6 +81,7 @@ extern struct VfsMountTableEntry vfs_mount_table[VFS_MOUNT_TABLE_MAX];
 
 // vfs.c
 void vfs_init(void);
+int vfs_mount_fat32(int partition_id);
 int vfs_path_to_fs(struct VfsPath orig_path, struct VfsPath* path);
 int vfs_file_get_size(const char* filename);
 int vfs_file_get_mode(const char* filename);
@@ -66,6 +94,7 @@ int vfs_fd_read(struct FileDesc* fd, void* buf, unsigned int size);
 int vfs_fd_write(struct FileDesc* fd, const char* buf, unsigned int size);
 int vfs_fd_close(struct FileDesc* fd);
 int vfs_fd_seek(struct FileDesc* fd, unsigned int off, enum FileSeekMode mode);
+int vfs_fd_sync(struct FileDesc* fd);
 
 // dir.c
 int vfs_dir_open(struct FileDesc* fd, const char* dirname);
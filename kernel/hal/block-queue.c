@@ -0,0 +1,277 @@
+/*
+ * Block device request queue
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/x86.h>
+#include <core/mmu.h>
+#include <core/proc.h>
+#include <defs.h>
+
+#include "hal.h"
+
+static int block_queue_execute(struct BlockDevice* blk, int write, unsigned int lba,
+							   unsigned int count, void* buf) {
+	if (write) {
+		return blk->driver->block_write(blk->private, lba, count, buf);
+	} else {
+		return blk->driver->block_read(blk->private, lba, count, buf);
+	}
+}
+
+static void block_queue_complete(struct BlockQueue* q, struct BlockRequest* req, int status) {
+	req->status = status;
+	if (req->done) {
+		// nobody waits for the request, it belongs to the callback now
+		req->done(req);
+		return;
+	}
+	acquire(&q->lock);
+	req->complete = 1;
+	wakeup(req);
+	release(&q->lock);
+}
+
+// Take the next request: the oldest one past its deadline, otherwise the
+// nearest one at or after the last position, wrapping around to the lowest
+static struct BlockRequest* block_queue_pick(struct BlockQueue* q) {
+	struct BlockRequest **expired = 0, **next = 0, **lowest = 0;
+	for (struct BlockRequest** p = &q->pending; *p; p = &(*p)->next) {
+		struct BlockRequest* r = *p;
+		if ((int)(ticks - r->deadline) >= 0 &&
+			(!expired || (int)(r->deadline - (*expired)->deadline) < 0)) {
+			expired = p;
+		}
+		if (r->lba >= q->position && (!next || r->lba < (*next)->lba)) {
+			next = p;
+		}
+		if (!lowest || r->lba < (*lowest)->lba) {
+			lowest = p;
+		}
+	}
+	struct BlockRequest** p = expired ? expired : next ? next : lowest;
+	struct BlockRequest* req = *p;
+	*p = req->next;
+	req->next = 0;
+	q->num_pending--;
+	return req;
+}
+
+// Pages a request spans, an upper bound of its physical segments
+static unsigned int block_request_segments(struct BlockRequest* req) {
+	if (req->sg) {
+		return req->nsg;
+	}
+	unsigned int begin = (unsigned int)req->buf;
+	return (PGROUNDUP(begin + req->count * 512) - PGROUNDDOWN(begin)) / PGSIZE;
+}
+
+// Chain pending requests continuing req on disk to it, return the number of
+// sectors of the chain. Drivers without submit take one contiguous buffer.
+static unsigned int block_queue_merge(struct BlockDevice* blk, struct BlockRequest* req) {
+	struct BlockQueue* q = &blk->queue;
+	const struct BlockDeviceDriver* driver = blk->driver;
+	unsigned int max_sectors = driver->max_sectors ? driver->max_sectors : HAL_BLOCK_REQUEST_MAX;
+	struct BlockRequest* tail = req;
+	unsigned int count = req->count, segments = block_request_segments(req);
+	for (struct BlockRequest** p = &q->pending; *p;) {
+		struct BlockRequest* r = *p;
+		if (r->write == req->write && r->lba == req->lba + count &&
+			count + r->count <= max_sectors &&
+			(driver->submit && driver->max_segments
+				 ? segments + block_request_segments(r) <= driver->max_segments
+				 : r->buf == req->buf + count * 512)) {
+			*p = r->next;
+			r->next = 0;
+			q->num_pending--;
+			tail->next = r;
+			tail = r;
+			count += r->count;
+			segments += block_request_segments(r);
+			p = &q->pending; // a later request may continue this one
+		} else {
+			p = &r->next;
+		}
+	}
+	return count;
+}
+
+static void block_queue_dispatcher(void* arg) {
+	struct BlockDevice* blk = arg;
+	struct BlockQueue* q = &blk->queue;
+
+	acquire(&q->lock);
+	for (;;) {
+		while (!q->pending || (q->plugged && q->num_pending < HAL_BLOCK_QUEUE_BATCH)) {
+			sleep(q, &q->lock);
+		}
+		struct BlockRequest* req = block_queue_pick(q);
+		unsigned int count = block_queue_merge(blk, req);
+		q->position = req->lba + count;
+		release(&q->lock);
+
+		// drivers with submit keep several requests outstanding
+		if (blk->driver->submit) {
+			int status = blk->driver->submit(blk->private, req, count);
+			if (status < 0) {
+				hal_block_complete(req, status);
+			}
+		} else {
+			hal_block_complete(
+				req, block_queue_execute(blk, req->write, req->lba, count, req->buf));
+		}
+		acquire(&q->lock);
+	}
+}
+
+void hal_block_queue_init(int id) {
+	struct BlockQueue* q = &hal_block_map[id].queue;
+	initlock(&q->lock, "block-queue");
+	q->pending = 0;
+	q->num_pending = 0;
+	q->plugged = 0;
+	q->position = 0;
+	char name[16] = "blkqueue0";
+	name[8] = '0' + id;
+	q->dispatcher = kthread_create(name, block_queue_dispatcher, &hal_block_map[id],
+								   PROC_AFFINITY_ALL);
+	if (!q->dispatcher) {
+		panic("block queue dispatcher");
+	}
+}
+
+// Complete a dispatched request and the requests merged into it
+void hal_block_complete(struct BlockRequest* req, int status) {
+	struct BlockQueue* q = &hal_block_map[req->dev].queue;
+	while (req) {
+		struct BlockRequest* next = req->next;
+		block_queue_complete(q, req, status);
+		req = next;
+	}
+}
+
+// Queue a request, when it completes req->done is called if set, otherwise
+// waiters are woken.
+// Requests are executed at once while booting, before the dispatcher can run.
+void hal_block_submit(struct BlockRequest* req) {
+	struct BlockDevice* blk = &hal_block_map[req->dev];
+	struct BlockQueue* q = &blk->queue;
+	req->complete = 0;
+	req->next = 0;
+	pushcli();
+	req->cpu = cpuid();
+	popcli();
+	if (!myproc()) {
+		block_queue_complete(
+			q, req, block_queue_execute(blk, req->write, req->lba, req->count, req->buf));
+		return;
+	}
+	acquire(&q->lock);
+	// polled devices skip the dispatcher when there is nothing to sort
+	if (blk->poll && blk->driver->submit && !q->plugged && !q->pending) {
+		q->position = req->lba + req->count;
+		release(&q->lock);
+		int status = blk->driver->submit(blk->private, req, req->count);
+		if (status < 0) {
+			hal_block_complete(req, status);
+		}
+		return;
+	}
+	req->deadline = ticks + (req->write ? HAL_BLOCK_WRITE_DEADLINE : HAL_BLOCK_READ_DEADLINE);
+	req->next = q->pending;
+	q->pending = req;
+	q->num_pending++;
+	if (!q->plugged || q->num_pending >= HAL_BLOCK_QUEUE_BATCH) {
+		wakeup(q);
+	}
+	release(&q->lock);
+}
+
+int hal_block_wait(struct BlockRequest* req) {
+	struct BlockDevice* blk = &hal_block_map[req->dev];
+	struct BlockQueue* q = &blk->queue;
+	// hybrid polling, reap completions for a while before sleeping
+	if (blk->poll && blk->driver->poll && myproc()) {
+		uint64_t end = rdtsc() + blk->poll;
+		while (!*(volatile int*)&req->complete && rdtsc() < end) {
+			blk->driver->poll(blk->private, req->cpu);
+		}
+	}
+	acquire(&q->lock);
+	while (!req->complete) {
+		sleep(req, &q->lock);
+	}
+	release(&q->lock);
+	return req->status;
+}
+
+// Submit a request and wait for it, split to what the driver takes at once
+int hal_block_request(int id, int write, unsigned int lba, unsigned int count, void* buf) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
+	}
+	const struct BlockDeviceDriver* driver = hal_block_map[id].driver;
+	while (count) {
+		unsigned int n = count;
+		if (driver->max_sectors) {
+			unsigned int room =
+				(driver->max_segments * PGSIZE - (unsigned int)buf % PGSIZE) / 512;
+			if (n > driver->max_sectors) {
+				n = driver->max_sectors;
+			}
+			if (n > room) {
+				n = room;
+			}
+		} else if (n > HAL_BLOCK_REQUEST_MAX) {
+			n = HAL_BLOCK_REQUEST_MAX;
+		}
+		struct BlockRequest req;
+		memset(&req, 0, sizeof(req));
+		req.dev = id;
+		req.write = write;
+		req.lba = lba;
+		req.count = n;
+		req.buf = buf;
+		hal_block_submit(&req);
+		int ret = hal_block_wait(&req);
+		if (ret < 0) {
+			return ret;
+		}
+		lba += n;
+		count -= n;
+		buf += n * 512;
+	}
+	return 0;
+}
+
+// Hold back dispatching so requests queued until unplug can be sorted and merged
+void hal_block_plug(int id) {
+	struct BlockQueue* q = &hal_block_map[id].queue;
+	acquire(&q->lock);
+	q->plugged++;
+	release(&q->lock);
+}
+
+void hal_block_unplug(int id) {
+	struct BlockQueue* q = &hal_block_map[id].queue;
+	acquire(&q->lock);
+	if (--q->plugged == 0) {
+		wakeup(q);
+	}
+	release(&q->lock);
+}
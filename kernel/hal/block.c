@@ -18,35 +18,98 @@
  */
 
 #include <common/errorcode.h>
+#include <core/mmu.h>
+#include <core/proc.h>
 #include <defs.h>
+#include <proc/kcall.h>
 
 #include "hal.h"
 
 struct BlockDevice hal_block_map[HAL_BLOCK_MAX];
-struct HalPartitionMap hal_partition_map[HAL_PARTITION_MAX];
+// slots taken by devices being registered or registered, RAM disks come at run time
+static struct spinlock hal_block_lock;
+static unsigned int hal_block_used;
+
+// Partition map in kalloc'd chunks, an id stays valid once it is inserted
+static struct spinlock hal_partition_lock;
+static struct HalPartitionMap* hal_partition_chunk[HAL_PARTITION_CHUNK_MAX];
+unsigned int hal_partition_max; // ids below are allocated
+
+// Buffers shared by all devices, looked up by (dev, block) hash and
+// recycled least recently used first
+static struct {
+	struct spinlock lock;
+	struct BlockBuffer buf[HAL_BLOCK_CACHE_MAX];
+	struct BlockBuffer* hash[HAL_BLOCK_CACHE_HASH];
+	struct BlockBuffer lru; // lru.lru_next is the most recently used
+	unsigned int hit, miss, evict, readahead;
+	unsigned int waiting; // getters sleeping until a buffer is put
+} block_cache;
+
+// Ranges queued for read-ahead, submitted by their own thread since getting
+// the buffers may sleep. Buffers being read ahead stay locked, so only part
+// of the cache is given to them.
+#define HAL_BLOCK_READAHEAD_MAX 16
+#define HAL_BLOCK_READAHEAD_BUFFERS (HAL_BLOCK_CACHE_MAX / 4)
+
+static struct {
+	struct spinlock lock;
+	struct {
+		unsigned int dev, lba, count;
+	} req[HAL_BLOCK_READAHEAD_MAX];
+	unsigned int head, tail;
+	unsigned int inflight; // buffers submitted and not completed
+} block_readahead;
+
+static struct HalPartitionMap* hal_partition_entry(unsigned int id) {
+	return &hal_partition_chunk[id / HAL_PARTITION_CHUNK][id % HAL_PARTITION_CHUNK];
+}
+
+// Partition id, 0 if it does not exist
+struct HalPartitionMap* hal_partition(int id) {
+	if (id < 0 || id >= hal_partition_max) {
+		return 0;
+	}
+	struct HalPartitionMap* part = hal_partition_entry(id);
+	return part->fs_type == HAL_PARTITION_NONE ? 0 : part;
+}
 
 struct HalPartitionMap* hal_partition_map_insert(enum HalPartitionFsType fs, unsigned int dev,
 												 unsigned int begin, unsigned int size) {
-	for (int i = 0; i < HAL_PARTITION_MAX; i++) {
-		if (hal_partition_map[i].fs_type == HAL_PARTITION_NONE) {
-			hal_partition_map[i].fs_type = fs;
-			hal_partition_map[i].dev = dev;
-			hal_partition_map[i].begin = begin;
-			hal_partition_map[i].size = size;
-			return &hal_partition_map[i];
+	acquire(&hal_partition_lock);
+	unsigned int id = hal_partition_max;
+	if (id % HAL_PARTITION_CHUNK == 0) {
+		struct HalPartitionMap* chunk = 0;
+		if (id / HAL_PARTITION_CHUNK < HAL_PARTITION_CHUNK_MAX) {
+			chunk = kalloc();
+		}
+		if (!chunk) {
+			release(&hal_partition_lock);
+			return 0;
 		}
+		memset(chunk, 0, HAL_PARTITION_CHUNK * sizeof(struct HalPartitionMap));
+		hal_partition_chunk[id / HAL_PARTITION_CHUNK] = chunk;
 	}
-	return 0;
+	struct HalPartitionMap* part = hal_partition_entry(id);
+	part->fs_type = fs;
+	part->dev = dev;
+	part->begin = begin;
+	part->size = size;
+	__sync_synchronize(); // lockless readers see the entry before the id
+	hal_partition_max = id + 1;
+	release(&hal_partition_lock);
+	return part;
 }
 
 static void hal_block_probe_partition(int block_id) {
 	uint64_t* gptsect = kalloc();
+	// a RAM disk may be too small for a partition table
 	if (hal_disk_read(block_id, 1, 1, gptsect) < 0) {
-		panic("disk read error");
-	}
-	if (gptsect[0] == 0x5452415020494645ULL) { // EFI PART
+		cprintf("[hal] cannot read partition table on block %d\n", block_id);
+	} else if (gptsect[0] == 0x5452415020494645ULL) { // EFI PART
 		// GPT
 		cprintf("[hal] GPT partition table on block %d\n", block_id);
+		gpt_probe_partition(block_id);
 	} else {
 		// MBR
 		cprintf("[hal] MBR partition table on block %d\n", block_id);
@@ -55,127 +118,802 @@ static void hal_block_probe_partition(int block_id) {
 	kfree(gptsect);
 }
 
-static void hal_block_cache_init(int block_id) {
-	hal_block_map[block_id].cache = kalloc();
-	memset(hal_block_map[block_id].cache, 0, 4096);
-	hal_block_map[block_id].cache_next = 0;
-	initlock(&hal_block_map[block_id].cache_lock, "block-cache");
+static int hal_block_kcall_handler(unsigned int block_struct) {
+	enum BlockKCallOp {
+		BLOCK_KCALL_OP_CACHE_STAT = 0,
+		BLOCK_KCALL_OP_GET_POLL = 1,
+		BLOCK_KCALL_OP_SET_POLL = 2,
+		BLOCK_KCALL_OP_DISK_READ = 3,
+	};
+
+	struct BlockKcall {
+		enum BlockKCallOp op;
+		unsigned int hit, miss, evict;
+		unsigned int buffers;
+		unsigned int readahead;
+		unsigned int dev;
+		unsigned int poll; // TSC cycles
+		unsigned int lba, count; // disk read bypassing the cache
+		void* buf;
+	}* bc = (void*)block_struct;
+
+	switch (bc->op) {
+	case BLOCK_KCALL_OP_CACHE_STAT:
+		acquire(&block_cache.lock);
+		bc->hit = block_cache.hit;
+		bc->miss = block_cache.miss;
+		bc->evict = block_cache.evict;
+		bc->buffers = HAL_BLOCK_CACHE_MAX;
+		bc->readahead = block_cache.readahead;
+		release(&block_cache.lock);
+		return 0;
+	case BLOCK_KCALL_OP_GET_POLL:
+		if (bc->dev >= HAL_BLOCK_MAX || !hal_block_map[bc->dev].driver) {
+			return ERROR_INVAILD;
+		}
+		bc->poll = hal_block_map[bc->dev].poll;
+		return 0;
+	case BLOCK_KCALL_OP_SET_POLL:
+		if (bc->dev >= HAL_BLOCK_MAX || !hal_block_map[bc->dev].driver ||
+			(bc->poll && !hal_block_map[bc->dev].driver->poll)) {
+			return ERROR_INVAILD;
+		}
+		hal_block_map[bc->dev].poll = bc->poll;
+		return 0;
+	case BLOCK_KCALL_OP_DISK_READ: {
+		if (bc->count == 0 || bc->count > HAL_BLOCK_SECTORS) {
+			return ERROR_INVAILD;
+		}
+		void* buf = kalloc();
+		if (!buf) {
+			return ERROR_OUT_OF_SPACE;
+		}
+		int ret = hal_disk_read(bc->dev, bc->lba, bc->count, buf);
+		if (ret == 0) {
+			memmove(bc->buf, buf, bc->count * 512);
+		}
+		kfree(buf);
+		return ret;
+	}
+	}
+	return ERROR_INVAILD;
+}
+
+static unsigned int block_cache_hash(unsigned int dev, unsigned int block) {
+	return (block ^ (dev << 7)) % HAL_BLOCK_CACHE_HASH;
 }
 
-void hal_block_register_device(const char* name, void* private,
-							   const struct BlockDeviceDriver* driver) {
+static void block_cache_lru_remove(struct BlockBuffer* b) {
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void block_cache_lru_insert(struct BlockBuffer* b) {
+	b->lru_next = block_cache.lru.lru_next;
+	b->lru_prev = &block_cache.lru;
+	block_cache.lru.lru_next->lru_prev = b;
+	block_cache.lru.lru_next = b;
+}
+
+static void block_cache_hash_remove(struct BlockBuffer* b) {
+	struct BlockBuffer** p = &block_cache.hash[block_cache_hash(b->dev, b->block)];
+	while (*p != b) {
+		p = &(*p)->hash_next;
+	}
+	*p = b->hash_next;
+}
+
+static void block_cache_init(void) {
+	memset(&block_cache, 0, sizeof(block_cache));
+	initlock(&block_cache.lock, "block-cache");
+	block_cache.lru.lru_next = block_cache.lru.lru_prev = &block_cache.lru;
+	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
+		struct BlockBuffer* b = &block_cache.buf[i];
+		b->dev = 0xffffffff;
+		initsleeplock(&b->lock, "block-buffer");
+		block_cache_lru_insert(b);
+	}
+}
+
+static int block_cache_flush(int dev, unsigned int age, int skip_busy);
+
+// Return the locked buffer of a block, recycling the least recently used
+// free buffer if the block is not cached. Data pages are allocated on first use,
+// 0 if that fails. Waits for a buffer to be put while all of them are in use,
+// or with try set returns 0 rather than wait or write back.
+static struct BlockBuffer* block_cache_get(unsigned int dev, unsigned int block, int try) {
+	acquire(&block_cache.lock);
+	struct BlockBuffer* b;
+	for (;;) {
+		b = block_cache.hash[block_cache_hash(dev, block)];
+		while (b && (b->dev != dev || b->block != block)) {
+			b = b->hash_next;
+		}
+		if (b) {
+			break;
+		}
+		int busy = 1;
+		for (b = block_cache.lru.lru_prev; b != &block_cache.lru; b = b->lru_prev) {
+			if (b->refcnt == 0) {
+				if (!b->dirty) {
+					break;
+				}
+				busy = 0;
+			}
+		}
+		if (b != &block_cache.lru) {
+			if (!b->data && !(b->data = kalloc())) {
+				release(&block_cache.lock);
+				return 0;
+			}
+			if (b->dev != 0xffffffff) {
+				block_cache_hash_remove(b);
+				if (b->valid) {
+					block_cache.evict++;
+				}
+			}
+			b->dev = dev;
+			b->block = block;
+			b->valid = 0;
+			unsigned int h = block_cache_hash(dev, block);
+			b->hash_next = block_cache.hash[h];
+			block_cache.hash[h] = b;
+			break;
+		}
+		if (try) {
+			release(&block_cache.lock);
+			return 0;
+		}
+		if (busy) {
+			block_cache.waiting++;
+			sleep(&block_cache.waiting, &block_cache.lock);
+			block_cache.waiting--;
+		} else {
+			// every free buffer is dirty, write them back and look again
+			release(&block_cache.lock);
+			if (block_cache_flush(-1, 0, 1) < 0) {
+				return 0;
+			}
+			acquire(&block_cache.lock);
+		}
+	}
+	b->refcnt++;
+	release(&block_cache.lock);
+	acquiresleep(&b->lock);
+	return b;
+}
+
+// Find the locked buffer of a cached block without allocating one
+static struct BlockBuffer* block_cache_lookup(unsigned int dev, unsigned int block) {
+	acquire(&block_cache.lock);
+	struct BlockBuffer* b = block_cache.hash[block_cache_hash(dev, block)];
+	while (b && (b->dev != dev || b->block != block)) {
+		b = b->hash_next;
+	}
+	if (b) {
+		b->refcnt++;
+	}
+	release(&block_cache.lock);
+	if (b) {
+		acquiresleep(&b->lock);
+	}
+	return b;
+}
+
+// driver takes any kernel buffer
+static int block_dev_sglist(unsigned int dev) {
+	return hal_block_map[dev].driver->max_sectors != 0;
+}
+
+static int block_disk_write(int id, int begin, int count, const void* buf) {
+	return hal_block_request(id, 1, begin, count, (void*)buf);
+}
+
+static void block_cache_count(unsigned int* counter) {
+	acquire(&block_cache.lock);
+	(*counter)++;
+	release(&block_cache.lock);
+}
+
+// Make sectors sect..sect+count of a locked buffer valid, reading the whole
+// block in one request when possible. Return 1 if the disk was read.
+static int block_cache_fill(struct BlockBuffer* b, unsigned int sect, unsigned int count) {
+	unsigned int mask = ((1 << count) - 1) << sect;
+	if ((b->valid & mask) == mask) {
+		return 0;
+	}
+
+	if (!b->valid) {
+		if (hal_disk_read(b->dev, b->block * HAL_BLOCK_SECTORS, HAL_BLOCK_SECTORS, b->data) == 0) {
+			b->valid = (1 << HAL_BLOCK_SECTORS) - 1;
+			return 1;
+		}
+	}
+	// partly written block or one crossing the end of the device, scatter-gather
+	// drivers read single sectors in place
+	int sglist = block_dev_sglist(b->dev);
+	void* bounce = sglist ? 0 : kalloc();
+	if (!sglist && !bounce) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	for (unsigned int i = sect; i < sect + count; i++) {
+		if (b->valid & (1 << i)) {
+			continue;
+		}
+		void* dest = bounce ? bounce : b->data + i * 512;
+		if (hal_disk_read(b->dev, b->block * HAL_BLOCK_SECTORS + i, 1, dest) < 0) {
+			if (bounce) {
+				kfree(bounce);
+			}
+			return ERROR_READ_FAIL;
+		}
+		if (bounce) {
+			memmove(b->data + i * 512, bounce, 512);
+		}
+		b->valid |= 1 << i;
+	}
+	if (bounce) {
+		kfree(bounce);
+	}
+	return 1;
+}
+
+// Write sectors sect..sect+count of a locked buffer to disk. Drivers without
+// scatter-gather want page aligned buffers, so valid sectors before them in
+// the block are written along, otherwise the sectors go through a bounce page.
+static int block_cache_write(struct BlockBuffer* b, unsigned int sect, unsigned int count) {
+	unsigned int lba = b->block * HAL_BLOCK_SECTORS;
+	if (block_dev_sglist(b->dev)) {
+		return block_disk_write(b->dev, lba + sect, count, b->data + sect * 512);
+	}
+	unsigned int prefix = (1 << (sect + count)) - 1;
+	if ((b->valid & prefix) == prefix) {
+		return block_disk_write(b->dev, lba, sect + count, b->data);
+	}
+	void* bounce = kalloc();
+	if (!bounce) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	memmove(bounce, b->data + sect * 512, count * 512);
+	int ret = block_disk_write(b->dev, lba + sect, count, bounce);
+	kfree(bounce);
+	return ret;
+}
+
+// Remember a failed write back for the next sync of the device
+static void block_writeback_failed(struct BlockBuffer* b, unsigned int lba) {
+	cprintf("[hal] block %d lba %d write back failed\n", b->dev, lba);
+	acquire(&block_cache.lock);
+	hal_block_map[b->dev].writeback_error = ERROR_WRITE_FAIL;
+	release(&block_cache.lock);
+}
+
+// Write back the dirty sectors of a locked buffer, one request for each
+// run of valid sectors covering them
+static void block_cache_writeback(struct BlockBuffer* b, unsigned int dirty) {
+	unsigned int sect = 0;
+	while (sect < HAL_BLOCK_SECTORS) {
+		if (!(dirty & (1 << sect))) {
+			sect++;
+			continue;
+		}
+		unsigned int end = sect + 1, last = sect;
+		while (end < HAL_BLOCK_SECTORS && (b->valid & (1 << end))) {
+			if (dirty & (1 << end)) {
+				last = end;
+			}
+			end++;
+		}
+		if (block_cache_write(b, sect, last - sect + 1) < 0) {
+			block_writeback_failed(b, b->block * HAL_BLOCK_SECTORS + sect);
+			b->valid &= ~(((1 << (last - sect + 1)) - 1) << sect);
+		}
+		sect = last + 1;
+	}
+}
+
+// Write back dirty blocks of a device (all devices if dev < 0) dirty for at
+// least age ticks. Blocks in use are skipped if skip_busy, the caller may
+// hold them. Return number of blocks written.
+static int block_cache_flush(int dev, unsigned int age, int skip_busy) {
+	struct BlockBuffer** list = kalloc();
+	if (!list) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	int n = 0;
+	acquire(&block_cache.lock);
+	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
+		struct BlockBuffer* b = &block_cache.buf[i];
+		if (!b->dirty || (dev >= 0 && b->dev != (unsigned int)dev) ||
+			ticks - b->dirty_time < age || (skip_busy && b->refcnt)) {
+			continue;
+		}
+		b->refcnt++;
+		list[n++] = b;
+	}
+	release(&block_cache.lock);
+
+	for (int i = 0; i < n; i++) {
+		struct BlockBuffer* b = list[i];
+		acquiresleep(&b->lock);
+		acquire(&block_cache.lock);
+		unsigned int dirty = b->dirty;
+		b->dirty = 0;
+		release(&block_cache.lock);
+		memset(&b->req, 0, sizeof(b->req));
+		b->req.dev = 0xffffffff;
+		if (!dirty) {
+			continue; // written back meanwhile
+		}
+
+		// dirty sectors and the valid sectors between them in one request,
+		// starting at the block for drivers wanting page aligned buffers
+		unsigned int first = 0, last = HAL_BLOCK_SECTORS - 1;
+		while (!(dirty & (1 << last))) {
+			last--;
+		}
+		if (block_dev_sglist(b->dev)) {
+			while (!(dirty & (1 << first))) {
+				first++;
+			}
+		}
+		unsigned int span = ((1 << (last + 1)) - 1) & ~((1 << first) - 1);
+		if ((b->valid & span) != span) {
+			block_cache_writeback(b, dirty);
+			continue;
+		}
+		b->req.dev = b->dev;
+		b->req.write = 1;
+		b->req.lba = b->block * HAL_BLOCK_SECTORS + first;
+		b->req.count = last - first + 1;
+		b->req.buf = b->data + first * 512;
+	}
+
+	// queue the writes plugged, so the device queue sorts and merges them.
+	// Buffers are locked before plugging, their holders may wait for a request.
 	for (int i = 0; i < HAL_BLOCK_MAX; i++) {
-		if (!hal_block_map[i].driver) {
-			cprintf("[hal] Block device %s added\n", name);
-			hal_block_map[i].driver = driver;
-			hal_block_map[i].private = private;
-			hal_block_probe_partition(i);
-			hal_block_cache_init(i);
-			return;
+		if (hal_block_map[i].driver) {
+			hal_block_plug(i);
+		}
+	}
+	for (int i = 0; i < n; i++) {
+		if (list[i]->req.dev != 0xffffffff) {
+			hal_block_submit(&list[i]->req);
 		}
 	}
-	panic("too many block devices");
+	for (int i = 0; i < HAL_BLOCK_MAX; i++) {
+		if (hal_block_map[i].driver) {
+			hal_block_unplug(i);
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct BlockBuffer* b = list[i];
+		if (b->req.dev != 0xffffffff && hal_block_wait(&b->req) < 0) {
+			block_writeback_failed(b, b->req.lba);
+			b->valid &= ~(((1 << b->req.count) - 1) << (b->req.lba % HAL_BLOCK_SECTORS));
+		}
+		hal_block_put(b);
+	}
+	kfree(list);
+	return n;
+}
+
+static void block_cache_flusher(void* arg) {
+	for (;;) {
+		acquire(&tickslock);
+		unsigned int ticks0 = ticks;
+		while (ticks - ticks0 < HAL_BLOCK_DIRTY_AGE / 2) {
+			sleep(&ticks, &tickslock);
+		}
+		release(&tickslock);
+		block_cache_flush(-1, HAL_BLOCK_DIRTY_AGE, 0);
+	}
+}
+
+// Drop the cached copies of sectors begin..begin+count, the rest of a
+// partly covered block stays cached
+static void block_cache_invalidate(unsigned int dev, unsigned int begin, unsigned int count) {
+	while (count) {
+		unsigned int sect = begin % HAL_BLOCK_SECTORS;
+		unsigned int n = HAL_BLOCK_SECTORS - sect;
+		if (n > count) {
+			n = count;
+		}
+		struct BlockBuffer* b = block_cache_lookup(dev, begin / HAL_BLOCK_SECTORS);
+		if (b) {
+			b->valid &= ~(((1 << n) - 1) << sect);
+			acquire(&block_cache.lock);
+			b->dirty &= ~(((1 << n) - 1) << sect);
+			release(&block_cache.lock);
+			hal_block_put(b);
+		}
+		begin += n;
+		count -= n;
+	}
+}
+
+// Get the locked buffer holding sector lba, reading it if needed.
+// Release with hal_block_put().
+struct BlockBuffer* hal_block_get(int id, unsigned int lba) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return 0;
+	}
+	struct BlockBuffer* b = block_cache_get(id, lba / HAL_BLOCK_SECTORS, 0);
+	if (!b) {
+		return 0;
+	}
+	int ret = block_cache_fill(b, lba % HAL_BLOCK_SECTORS, 1);
+	if (ret < 0) {
+		hal_block_put(b);
+		return 0;
+	}
+	block_cache_count(ret ? &block_cache.miss : &block_cache.hit);
+	return b;
+}
+
+struct BlockBuffer* hal_partition_get(int id, unsigned int lba) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
+		return 0;
+	}
+	return hal_block_get(part->dev, part->begin + lba);
+}
+
+void hal_block_put(struct BlockBuffer* b) {
+	releasesleep(&b->lock);
+	acquire(&block_cache.lock);
+	b->refcnt--;
+	if (b->refcnt == 0) {
+		block_cache_lru_remove(b);
+		block_cache_lru_insert(b);
+		if (block_cache.waiting) {
+			wakeup(&block_cache.waiting);
+		}
+	}
+	release(&block_cache.lock);
+}
+
+// Completion of a read-ahead request, its buffer stayed locked since submission
+static void block_readahead_done(struct BlockRequest* req) {
+	struct BlockBuffer* b = req->private;
+	if (req->status == 0) {
+		b->valid = (1 << HAL_BLOCK_SECTORS) - 1;
+		block_cache_count(&block_cache.readahead);
+	}
+	hal_block_put(b);
+	acquire(&block_readahead.lock);
+	block_readahead.inflight--;
+	release(&block_readahead.lock);
+}
+
+static void block_readahead_thread(void* arg) {
+	struct BlockBuffer** list = 0;
+	for (;;) {
+		acquire(&block_readahead.lock);
+		while (block_readahead.head == block_readahead.tail) {
+			sleep(&block_readahead, &block_readahead.lock);
+		}
+		unsigned int i = block_readahead.head % HAL_BLOCK_READAHEAD_MAX;
+		unsigned int dev = block_readahead.req[i].dev, lba = block_readahead.req[i].lba,
+					 count = block_readahead.req[i].count;
+		block_readahead.head++;
+		release(&block_readahead.lock);
+		if (!list && !(list = kalloc())) {
+			continue; // a hint, dropped without memory
+		}
+
+		// lock the buffers of blocks not cached yet before plugging, their
+		// holders may wait for a request. Partly valid blocks are left to readers,
+		// blocks without a clean free buffer are skipped. Completions only lower
+		// inflight, so reading it unlocked never overshoots.
+		unsigned int n = 0;
+		for (unsigned int block = lba / HAL_BLOCK_SECTORS;
+			 block <= (lba + count - 1) / HAL_BLOCK_SECTORS &&
+			 block_readahead.inflight + n < HAL_BLOCK_READAHEAD_BUFFERS;
+			 block++) {
+			struct BlockBuffer* b = block_cache_get(dev, block, 1);
+			if (!b) {
+				continue;
+			}
+			if (b->valid) {
+				hal_block_put(b);
+				continue;
+			}
+			memset(&b->req, 0, sizeof(b->req));
+			b->req.dev = dev;
+			b->req.lba = block * HAL_BLOCK_SECTORS;
+			b->req.count = HAL_BLOCK_SECTORS;
+			b->req.buf = b->data;
+			b->req.done = block_readahead_done;
+			b->req.private = b;
+			list[n++] = b;
+		}
+
+		// queue the window plugged so the device queue merges it, the buffers
+		// are released as the reads complete
+		acquire(&block_readahead.lock);
+		block_readahead.inflight += n;
+		release(&block_readahead.lock);
+		hal_block_plug(dev);
+		for (i = 0; i < n; i++) {
+			hal_block_submit(&list[i]->req);
+		}
+		hal_block_unplug(dev);
+	}
+}
+
+// Start reading sectors into the cache without waiting. The request is a
+// hint and is dropped when the queue is full.
+void hal_block_readahead(int id, unsigned int lba, unsigned int count) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver || !count) {
+		return;
+	}
+	acquire(&block_readahead.lock);
+	if (block_readahead.tail - block_readahead.head < HAL_BLOCK_READAHEAD_MAX) {
+		unsigned int i = block_readahead.tail % HAL_BLOCK_READAHEAD_MAX;
+		block_readahead.req[i].dev = id;
+		block_readahead.req[i].lba = lba;
+		block_readahead.req[i].count = count;
+		block_readahead.tail++;
+		wakeup(&block_readahead);
+	}
+	release(&block_readahead.lock);
+}
+
+void hal_partition_readahead(int id, unsigned int lba, unsigned int count) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
+		return;
+	}
+	hal_block_readahead(part->dev, part->begin + lba, count);
+}
+
+// Add a block device and probe its partitions, return its id or
+// ERROR_OUT_OF_SPACE if every slot is taken
+int hal_block_register_device(const char* name, void* private,
+							  const struct BlockDeviceDriver* driver) {
+	int id = -1;
+	acquire(&hal_block_lock);
+	for (int i = 0; i < HAL_BLOCK_MAX; i++) {
+		if (!(hal_block_used & (1 << i))) {
+			hal_block_used |= 1 << i;
+			id = i;
+			break;
+		}
+	}
+	release(&hal_block_lock);
+	if (id < 0) {
+		cprintf("[hal] too many block devices, %s not added\n", name);
+		return ERROR_OUT_OF_SPACE;
+	}
+	cprintf("[hal] Block device %s added\n", name);
+	hal_block_map[id].driver = driver;
+	hal_block_map[id].private = private;
+	hal_block_queue_init(id);
+	hal_block_probe_partition(id);
+	return id;
 }
 
 void hal_block_init(void) {
 	memset(hal_block_map, 0, sizeof(hal_block_map));
-	memset(hal_partition_map, 0, sizeof(hal_partition_map));
+	initlock(&hal_block_lock, "hal-block");
+	hal_block_used = 0;
+	initlock(&hal_partition_lock, "hal-partition");
+	memset(hal_partition_chunk, 0, sizeof(hal_partition_chunk));
+	hal_partition_max = 0;
+	block_cache_init();
+	kcall_set("block", hal_block_kcall_handler);
+	if (!kthread_create("bflush", block_cache_flusher, 0, PROC_AFFINITY_ALL)) {
+		panic("block flusher");
+	}
+	initlock(&block_readahead.lock, "block-readahead");
+	block_readahead.head = block_readahead.tail = 0;
+	block_readahead.inflight = 0;
+	if (!kthread_create("breadahead", block_readahead_thread, 0, PROC_AFFINITY_ALL)) {
+		panic("block readahead");
+	}
 }
 
-int hal_block_read(int id, int begin, int count, void* buf) {
-	if (count > 1) {
-		return hal_disk_read(id, begin, count, buf);
+// Write back the dirty blocks of a device and make them durable, all devices if
+// id is -1. Write back failures since the last sync, also those of the
+// flusher thread, are reported once.
+int hal_block_sync(int id) {
+	if (id < -1 || id >= HAL_BLOCK_MAX || (id >= 0 && !hal_block_map[id].driver)) {
+		return ERROR_INVAILD;
 	}
+	int ret = block_cache_flush(id, 0, 0);
+	ret = ret < 0 ? ret : 0;
+	for (int i = id < 0 ? 0 : id; i < (id < 0 ? HAL_BLOCK_MAX : id + 1); i++) {
+		struct BlockDevice* blk = &hal_block_map[i];
+		if (!blk->driver) {
+			continue;
+		}
+		if (blk->driver->flush) {
+			int err = blk->driver->flush(blk->private);
+			if (err < 0 && err != ERROR_INVAILD && !ret) {
+				ret = err;
+			}
+		}
+		acquire(&block_cache.lock);
+		if (blk->writeback_error && !ret) {
+			ret = blk->writeback_error;
+		}
+		blk->writeback_error = 0;
+		release(&block_cache.lock);
+	}
+	return ret;
+}
 
-	struct BlockDevice* blk = &hal_block_map[id];
-	acquire(&blk->cache_lock);
-	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-		if (blk->cache[i].buf && blk->cache[i].lba == begin) {
-			memmove(buf, blk->cache[i].buf, 512);
-			release(&blk->cache_lock);
-			return 0;
+int hal_partition_sync(int id) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
+		return ERROR_INVAILD;
+	}
+	return hal_block_sync(part->dev);
+}
+
+// Tell the device ranges are unused, a hint which devices may ignore
+int hal_block_discard(int id, const struct BlockRange* range, int count) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
+	}
+	for (int i = 0; i < count; i++) {
+		block_cache_invalidate(id, range[i].lba, range[i].count);
+	}
+	const struct BlockDeviceDriver* driver = hal_block_map[id].driver;
+	if (!driver->discard || !count) {
+		return 0;
+	}
+	int ret = driver->discard(hal_block_map[id].private, range, count);
+	return ret == ERROR_INVAILD ? 0 : ret;
+}
+
+// Discard ranges relative to the partition, which are translated in place
+int hal_partition_discard(int id, struct BlockRange* range, int count) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
+		return ERROR_INVAILD;
+	}
+	for (int i = 0; i < count; i++) {
+		if (range[i].lba + range[i].count > part->size) {
+			return ERROR_INVAILD;
+		}
+		range[i].lba += part->begin;
+	}
+	return hal_block_discard(part->dev, range, count);
+}
+
+// Zero sectors on the device, writing zeroed pages if it can not do it itself
+int hal_block_write_zeroes(int id, unsigned int lba, unsigned int count) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
+	}
+	const struct BlockDeviceDriver* driver = hal_block_map[id].driver;
+	if (driver->write_zeroes) {
+		struct BlockRange range = {lba, count};
+		block_cache_invalidate(id, lba, count);
+		int ret = driver->write_zeroes(hal_block_map[id].private, &range, 1);
+		if (ret != ERROR_INVAILD) {
+			return ret;
 		}
 	}
+	void* zero = kalloc();
+	if (!zero) {
+		return ERROR_OUT_OF_SPACE;
+	}
+	memset(zero, 0, PGSIZE);
+	int ret = 0;
+	while (count && ret >= 0) {
+		unsigned int n = count > PGSIZE / 512 ? PGSIZE / 512 : count;
+		ret = hal_disk_write(id, lba, n, zero);
+		lba += n;
+		count -= n;
+	}
+	kfree(zero);
+	return ret < 0 ? ret : 0;
+}
 
-	if (!blk->cache[blk->cache_next].buf) {
-		blk->cache[blk->cache_next].buf = kalloc();
+// Read through the cache a block at a time
+int hal_block_read(int id, int begin, int count, void* buf) {
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
 	}
-	blk->cache[blk->cache_next].lba = begin;
-	release(&blk->cache_lock);
-	hal_disk_read(id, begin, count, blk->cache[blk->cache_next].buf);
-	acquire(&blk->cache_lock);
-	memmove(buf, blk->cache[blk->cache_next].buf, 512);
-	blk->cache_next++;
-	if (blk->cache_next >= HAL_BLOCK_CACHE_MAX) {
-		blk->cache_next = 0;
+	while (count > 0) {
+		unsigned int sect = begin % HAL_BLOCK_SECTORS;
+		unsigned int n = HAL_BLOCK_SECTORS - sect;
+		if (n > (unsigned int)count) {
+			n = count;
+		}
+		struct BlockBuffer* b = block_cache_get(id, begin / HAL_BLOCK_SECTORS, 0);
+		if (!b) {
+			return ERROR_OUT_OF_SPACE;
+		}
+		int ret = block_cache_fill(b, sect, n);
+		if (ret < 0) {
+			hal_block_put(b);
+			return ERROR_READ_FAIL;
+		}
+		block_cache_count(ret ? &block_cache.miss : &block_cache.hit);
+		memmove(buf, b->data + sect * 512, n * 512);
+		hal_block_put(b);
+		begin += n;
+		count -= n;
+		buf += n * 512;
 	}
-	release(&blk->cache_lock);
 	return 0;
 }
 
 int hal_disk_read(int id, int begin, int count, void* buf) {
-	if (id >= HAL_BLOCK_MAX) {
+	if (id < 0 || id >= HAL_BLOCK_MAX) {
 		return ERROR_INVAILD;
 	}
 	if (!hal_block_map[id].driver) {
 		return ERROR_INVAILD;
 	}
 
-	return hal_block_map[id].driver->block_read(hal_block_map[id].private, begin, count, buf);
+	return hal_block_request(id, 0, begin, count, buf);
 }
 
 int hal_partition_read(int id, int begin, int count, void* buf) {
-	if (id >= HAL_PARTITION_MAX) {
-		return -1;
-	}
-	if (hal_partition_map[id].fs_type == HAL_PARTITION_NONE) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
 		return -1;
 	}
-	return hal_block_read(hal_partition_map[id].dev, hal_partition_map[id].begin + begin, count,
+	return hal_block_read(part->dev, part->begin + begin, count,
 						  buf);
 }
 
+// Update the cache a block at a time, the flusher writes it back later
 int hal_block_write(int id, int begin, int count, const void* buf) {
-	if (count > 1) {
-		for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-			if (hal_block_map[id].cache[i].buf) {
-				kfree(hal_block_map[id].cache[i].buf);
-			}
-		}
-		hal_disk_write(id, begin, count, buf);
+	if (id < 0 || id >= HAL_BLOCK_MAX || !hal_block_map[id].driver) {
+		return ERROR_INVAILD;
 	}
-
-	struct BlockDevice* blk = &hal_block_map[id];
-	acquire(&blk->cache_lock);
-	for (int i = 0; i < HAL_BLOCK_CACHE_MAX; i++) {
-		if (blk->cache[i].buf && blk->cache[i].lba == begin) {
-			memmove(blk->cache[i].buf, buf, 512);
-			release(&blk->cache_lock);
-			return hal_disk_write(id, begin, count, blk->cache[i].buf);
+	while (count > 0) {
+		unsigned int sect = begin % HAL_BLOCK_SECTORS;
+		unsigned int n = HAL_BLOCK_SECTORS - sect;
+		if (n > (unsigned int)count) {
+			n = count;
+		}
+		unsigned int mask = ((1 << n) - 1) << sect;
+		struct BlockBuffer* b = block_cache_get(id, begin / HAL_BLOCK_SECTORS, 0);
+		if (!b) {
+			return ERROR_OUT_OF_SPACE;
 		}
+		memmove(b->data + sect * 512, buf, n * 512);
+		b->valid |= mask;
+		acquire(&block_cache.lock);
+		if (!b->dirty) {
+			b->dirty_time = ticks;
+		}
+		b->dirty |= mask;
+		release(&block_cache.lock);
+		hal_block_put(b);
+		begin += n;
+		count -= n;
+		buf += n * 512;
 	}
-	release(&blk->cache_lock);
-	return hal_disk_write(id, begin, count, buf);
+	return 0;
 }
 
+// Write bypassing the cache, cached copies of the sectors are dropped
 int hal_disk_write(int id, int begin, int count, const void* buf) {
-	if (id >= HAL_BLOCK_MAX) {
-		return -1;
+	if (id < 0 || id >= HAL_BLOCK_MAX) {
+		return ERROR_INVAILD;
 	}
 	if (!hal_block_map[id].driver) {
 		return ERROR_INVAILD;
 	}
 
-	return hal_block_map[id].driver->block_write(hal_block_map[id].private, begin, count, buf);
+	block_cache_invalidate(id, begin, count);
+	return block_disk_write(id, begin, count, buf);
 }
 
 int hal_partition_write(int id, int begin, int count, const void* buf) {
-	if (id >= HAL_PARTITION_MAX) {
-		return -1;
-	}
-	if (hal_partition_map[id].fs_type == HAL_PARTITION_NONE) {
+	struct HalPartitionMap* part = hal_partition(id);
+	if (!part) {
 		return -1;
 	}
-	return hal_block_write(hal_partition_map[id].dev, hal_partition_map[id].begin + begin, count,
+	return hal_block_write(part->dev, part->begin + begin, count,
 						   buf);
 }
@@ -51,8 +51,15 @@ struct EDIDDetailTiming {
 } PACKED;
 
 static void* hal_display_modeswitch(struct FramebufferDevice* fbdev, int xres, int yres) {
-	phyaddr_t fb = fbdev->driver->enable(fbdev->private, xres, yres);
-	mappages(myproc()->pgdir, (void*)PROC_MMAP_BOTTOM, 16 * 1024 * 1024, fb, PTE_U | PTE_W);
+	void* fb = fbdev->driver->enable(fbdev->private, xres, yres);
+	if (!fb) {
+		return 0;
+	}
+	// framebuffer may be physically scattered, map it page by page
+	for (unsigned int off = 0; off < 16 * 1024 * 1024; off += PGSIZE) {
+		mappages(myproc()->pgdir, (void*)PROC_MMAP_BOTTOM + off, PGSIZE, kva2pa(fb + off),
+				 PTE_U | PTE_W);
+	}
 	return (void*)PROC_MMAP_BOTTOM;
 }
 
@@ -95,6 +102,9 @@ static int hal_display_kcall_handler(unsigned int display_struct) {
 			}
 			dc->framebuffer =
 				hal_display_modeswitch(&framebuffer_device[dc->display_id], dc->xres, dc->yres);
+			if (!dc->framebuffer) {
+				return ERROR_INVAILD;
+			}
 			dc->flag = 0;
 			if (framebuffer_device[dc->display_id].driver->update) {
 				dc->flag |= DISPLAY_KCALL_FLAG_NEED_UPDATE;
@@ -0,0 +1,214 @@
+/*
+ * GUID Partition Table support
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <common/errorcode.h>
+#include <common/types.h>
+#include <core/mmu.h>
+#include <defs.h>
+
+#include "hal.h"
+
+struct GPTHeader {
+	uint64_t signature; // EFI PART
+	uint32_t revision;
+	uint32_t header_size;
+	uint32_t header_crc32; // of header_size bytes with this field zero
+	uint32_t reserved;
+	uint64_t my_lba, alternate_lba;
+	uint64_t first_usable_lba, last_usable_lba;
+	uint8_t disk_guid[16];
+	uint64_t entries_lba;
+	uint32_t num_entries;
+	uint32_t entry_size;
+	uint32_t entries_crc32;
+} PACKED;
+
+struct GPTEntry {
+	uint8_t type[16]; // zero if unused
+	uint8_t unique[16];
+	uint64_t first_lba, last_lba; // last is inclusive
+	uint64_t attributes;
+	uint16_t name[36]; // UTF-16LE
+} PACKED;
+
+#define GPT_SIGNATURE 0x5452415020494645ULL
+#define GPT_ENTRIES_MAX (1024 * 1024) // bytes of entry array
+
+// GUIDs as stored on disk, the first three fields little endian
+static const uint8_t gpt_type_basic_data[16] = {0xa2, 0xa0, 0xd0, 0xeb, 0xe5, 0xb9, 0x33, 0x44,
+												0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7};
+static const uint8_t gpt_type_efi_system[16] = {0x28, 0x73, 0x2a, 0xc1, 0x1f, 0xf8, 0xd2, 0x11,
+												0xba, 0x4b, 0x00, 0xa0, 0xc9, 0x3e, 0xc9, 0x3b};
+static const uint8_t gpt_type_linux[16] = {0xaf, 0x3d, 0xc6, 0x0f, 0x83, 0x84, 0x72, 0x47,
+										   0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4};
+static const uint8_t gpt_type_unused[16];
+
+// CRC-32 as used by GPT, continue from crc of preceding data or 0
+static uint32_t gpt_crc32(uint32_t crc, const void* data, unsigned int size) {
+	const uint8_t* p = data;
+	crc = ~crc;
+	while (size--) {
+		crc ^= *p++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+// Read the entry array a page at a time, page is called with the bytes read and
+// stops the walk by returning a negative value
+static int gpt_read_entries(int block_id, const struct GPTHeader* hdr, void* buf,
+							int (*page)(const struct GPTHeader*, void*, unsigned int, void*),
+							void* arg) {
+	unsigned int bytes = hdr->num_entries * hdr->entry_size;
+	unsigned int lba = hdr->entries_lba;
+	for (unsigned int off = 0; off < bytes; off += PGSIZE, lba += PGSIZE / 512) {
+		unsigned int len = bytes - off < PGSIZE ? bytes - off : PGSIZE;
+		if (hal_disk_read(block_id, lba, (len + 511) / 512, buf) < 0) {
+			return ERROR_READ_FAIL;
+		}
+		int ret = page(hdr, buf, len, arg);
+		if (ret < 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int gpt_crc_page(const struct GPTHeader* hdr, void* buf, unsigned int len, void* crc) {
+	*(uint32_t*)crc = gpt_crc32(*(uint32_t*)crc, buf, len);
+	return 0;
+}
+
+// Read the header at lba into hdr and check it and the CRC of its entry array,
+// hdr is zeroed if the sector cannot be read
+static int gpt_read_header(int block_id, unsigned int lba, struct GPTHeader* hdr, void* buf) {
+	memset(hdr, 0, sizeof(struct GPTHeader));
+	if (hal_disk_read(block_id, lba, 1, buf) < 0) {
+		return ERROR_READ_FAIL;
+	}
+	memmove(hdr, buf, sizeof(struct GPTHeader));
+	if (hdr->signature != GPT_SIGNATURE || hdr->my_lba != lba ||
+		hdr->header_size < sizeof(struct GPTHeader) || hdr->header_size > 512) {
+		return ERROR_INVAILD;
+	}
+	((struct GPTHeader*)buf)->header_crc32 = 0;
+	if (gpt_crc32(0, buf, hdr->header_size) != hdr->header_crc32) {
+		cprintf("[gpt] header at %d on block device %d has bad CRC\n", lba, block_id);
+		return ERROR_INVAILD;
+	}
+	// entries are 128 << n bytes
+	if (hdr->entry_size < sizeof(struct GPTEntry) || hdr->entry_size > PGSIZE ||
+		(hdr->entry_size & (hdr->entry_size - 1)) ||
+		(uint64_t)hdr->num_entries * hdr->entry_size > GPT_ENTRIES_MAX || hdr->entries_lba >> 32) {
+		return ERROR_INVAILD;
+	}
+	uint32_t crc = 0;
+	int ret = gpt_read_entries(block_id, hdr, buf, gpt_crc_page, &crc);
+	if (ret < 0) {
+		return ret;
+	}
+	if (crc != hdr->entries_crc32) {
+		cprintf("[gpt] entries of header at %d on block device %d have bad CRC\n", lba,
+				block_id);
+		return ERROR_INVAILD;
+	}
+	return 0;
+}
+
+// Basic data and EFI system partitions hold FAT32 if their boot sector says so
+static enum HalPartitionFsType gpt_fat_type(int block_id, unsigned int lba) {
+	void* sect = kalloc();
+	enum HalPartitionFsType fs = HAL_PARTITION_OTHER;
+	if (hal_disk_read(block_id, lba, 1, sect) == 0 && memcmp(sect + 0x52, "FAT32   ", 8) == 0) {
+		fs = HAL_PARTITION_FAT32;
+	}
+	kfree(sect);
+	return fs;
+}
+
+static int gpt_insert_page(const struct GPTHeader* hdr, void* buf, unsigned int len, void* arg) {
+	int block_id = *(int*)arg;
+	for (unsigned int off = 0; off < len; off += hdr->entry_size) {
+		struct GPTEntry* entry = buf + off;
+		if (memcmp(entry->type, gpt_type_unused, 16) == 0) {
+			continue;
+		}
+		if (entry->first_lba > entry->last_lba || entry->last_lba >> 32) {
+			cprintf("[gpt] Partition on block device %d beyond 2 TiB ignored\n", block_id);
+			continue;
+		}
+		enum HalPartitionFsType fs;
+		if (memcmp(entry->type, gpt_type_basic_data, 16) == 0 ||
+			memcmp(entry->type, gpt_type_efi_system, 16) == 0) {
+			fs = gpt_fat_type(block_id, entry->first_lba);
+		} else if (memcmp(entry->type, gpt_type_linux, 16) == 0) {
+			fs = HAL_PARTITION_LINUX;
+		} else {
+			fs = HAL_PARTITION_OTHER;
+		}
+		cprintf("[gpt] %s partition on block device %d LBA %d size %d\n",
+				fs == HAL_PARTITION_FAT32 ? "FAT32"
+				: fs == HAL_PARTITION_LINUX ? "Linux"
+											: "Other",
+				block_id, (unsigned int)entry->first_lba,
+				(unsigned int)(entry->last_lba - entry->first_lba + 1));
+		if (!hal_partition_map_insert(fs, block_id, entry->first_lba,
+									  entry->last_lba - entry->first_lba + 1)) {
+			cprintf("[gpt] partition map full, rest of block device %d ignored\n", block_id);
+			return ERROR_OUT_OF_SPACE;
+		}
+	}
+	return 0;
+}
+
+// Last sector of the disk, where the backup header is. The protective MBR
+// covers the disk up to 2 TiB, past that only the primary header tells.
+static uint64_t gpt_last_lba(int block_id, const struct GPTHeader* primary, void* buf) {
+	if (hal_disk_read(block_id, 0, 1, buf) == 0) {
+		for (int i = 0; i < 4; i++) {
+			uint8_t* entry = buf + 0x1be + i * 16;
+			uint32_t begin = *(uint32_t*)(entry + 8), size = *(uint32_t*)(entry + 12);
+			if (entry[4] == 0xee && begin == 1 && size && size != 0xffffffff) {
+				return size;
+			}
+		}
+	}
+	return primary->signature == GPT_SIGNATURE ? primary->alternate_lba : 0;
+}
+
+void gpt_probe_partition(int block_id) {
+	void* buf = kalloc();
+	struct GPTHeader hdr;
+	if (gpt_read_header(block_id, 1, &hdr, buf) < 0) {
+		uint64_t backup = gpt_last_lba(block_id, &hdr, buf);
+		if (backup <= 1 || backup >> 32 || gpt_read_header(block_id, backup, &hdr, buf) < 0) {
+			cprintf("[gpt] no valid GPT on block device %d\n", block_id);
+			kfree(buf);
+			return;
+		}
+		cprintf("[gpt] using backup GPT on block device %d\n", block_id);
+	}
+	if (gpt_read_entries(block_id, &hdr, buf, gpt_insert_page, &block_id) == ERROR_READ_FAIL) {
+		cprintf("[gpt] cannot read entries on block device %d\n", block_id);
+	}
+	kfree(buf);
+}
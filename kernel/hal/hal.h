@@ -1,28 +1,99 @@
 #ifndef _HAL_HAL_H
 #define _HAL_HAL_H
 
+#include <common/sleeplock.h>
 #include <common/spinlock.h>
 #include <common/types.h>
 
 // HAL Block Device
+struct BlockRequest;
+
+// range of sectors for discard and write zeroes
+struct BlockRange {
+	unsigned int lba, count;
+};
+
 struct BlockDeviceDriver {
 	int (*block_read)(void* private, unsigned int begin, int count, void* buf);
 	int (*block_write)(void* private, unsigned int begin, int count, const void* buf);
+	// optional, start count sectors of the request chain headed by req without
+	// waiting, the driver calls hal_block_complete(req) when it finishes.
+	// Buffers of the chained requests need not be contiguous.
+	int (*submit)(void* private, struct BlockRequest* req, unsigned int count);
+	// largest request in sectors and physical segments for scatter-gather
+	// drivers taking any kernel buffer, 0 if the buffer must be page aligned
+	// and at most HAL_BLOCK_REQUEST_MAX sectors
+	unsigned int max_sectors, max_segments;
+	// optional, complete finished requests of the queue used by cpu without
+	// waiting for an interrupt, return the number completed
+	int (*poll)(void* private, int cpu);
+	// optional, return ERROR_INVAILD if the device lacks the command.
+	// flush makes completed writes durable, discard drops ranges the
+	// filesystem no longer uses and write_zeroes zeroes them on the device
+	int (*flush)(void* private);
+	int (*discard)(void* private, const struct BlockRange* range, int count);
+	int (*write_zeroes)(void* private, const struct BlockRange* range, int count);
 };
 
-#define HAL_BLOCK_CACHE_MAX 512
-
-struct BlockCache {
-	int lba;
+// Block request on a kernel buffer, or on physical segments such as pinned
+// user pages for drivers with submit and max_segments
+struct BlockRequest {
+	unsigned int dev;
+	int write;
+	unsigned int lba, count;
 	void* buf;
+	struct SGEntry* sg; // used instead of buf if set
+	unsigned int nsg;
+	int status; // driver result, valid once complete
+	int complete;
+	unsigned int deadline; // ticks
+	int cpu; // submitting CPU, drivers with a queue per CPU complete on it
+	// called on completion instead of waking waiters, the request is not
+	// touched after it so done may release or reuse it
+	void (*done)(struct BlockRequest* req);
+	void* private;
+	struct BlockRequest* next;
+};
+
+#define HAL_BLOCK_REQUEST_MAX 8 // sectors drivers without scatter-gather take in one request
+#define HAL_BLOCK_READ_DEADLINE 50 // ticks
+#define HAL_BLOCK_WRITE_DEADLINE 500
+#define HAL_BLOCK_QUEUE_BATCH 32 // pending requests dispatched even when plugged
+
+struct BlockQueue {
+	struct spinlock lock;
+	struct BlockRequest* pending;
+	unsigned int num_pending;
+	unsigned int plugged;
+	unsigned int position; // LBA after the last dispatched request
+	struct proc* dispatcher;
+};
+
+// Block cache, each buffer holds a 4 KiB aligned block of sectors
+#define HAL_BLOCK_CACHE_MAX 512
+#define HAL_BLOCK_CACHE_HASH 128
+#define HAL_BLOCK_SECTORS 8
+#define HAL_BLOCK_DIRTY_AGE 300 // ticks before a dirty block is written back
+
+struct BlockBuffer {
+	unsigned int dev, block; // block is lba / HAL_BLOCK_SECTORS
+	unsigned int refcnt;
+	unsigned int valid; // bitmap of sectors read from or written to disk
+	unsigned int dirty; // bitmap of sectors not written back yet
+	unsigned int dirty_time; // ticks when the block became dirty
+	void* data;
+	struct BlockBuffer* hash_next;
+	struct BlockBuffer *lru_prev, *lru_next;
+	struct sleeplock lock;
+	struct BlockRequest req; // write back request
 };
 
 struct BlockDevice {
 	const struct BlockDeviceDriver* driver;
 	void* private;
-	struct BlockCache* cache;
-	int cache_next;
-	struct spinlock cache_lock;
+	struct BlockQueue queue;
+	unsigned int poll; // TSC cycles waiters poll before sleeping, 0 to sleep at once
+	int writeback_error; // a write back failed since the last sync
 };
 
 #define HAL_BLOCK_MAX 8
@@ -42,23 +113,59 @@ struct HalPartitionMap {
 	unsigned int size;
 };
 
-#define HAL_PARTITION_MAX 8
+// the partition map grows by a page of entries at a time, entries never move
+#define HAL_PARTITION_CHUNK 256
+#define HAL_PARTITION_CHUNK_MAX 16
 
 // block.c
 extern struct BlockDevice hal_block_map[HAL_BLOCK_MAX];
-extern struct HalPartitionMap hal_partition_map[HAL_PARTITION_MAX];
+extern unsigned int hal_partition_max;
+struct HalPartitionMap* hal_partition(int id);
 struct HalPartitionMap* hal_partition_map_insert(enum HalPartitionFsType fs,
 												 unsigned int dev, unsigned int begin,
 												 unsigned int size);
 void hal_block_init(void);
-void hal_block_register_device(const char* name, void* private,
-							   const struct BlockDeviceDriver* driver);
+int hal_block_register_device(const char* name, void* private,
+							  const struct BlockDeviceDriver* driver);
 int hal_block_read(int id, int begin, int count, void* buf);
 int hal_disk_read(int id, int begin, int count, void* buf);
 int hal_partition_read(int id, int begin, int count, void* buf);
 int hal_block_write(int id, int begin, int count, const void* buf);
 int hal_disk_write(int id, int begin, int count, const void* buf);
 int hal_partition_write(int id, int begin, int count, const void* buf);
+struct BlockBuffer* hal_block_get(int id, unsigned int lba);
+struct BlockBuffer* hal_partition_get(int id, unsigned int lba);
+void hal_block_put(struct BlockBuffer* b);
+int hal_block_sync(int id);
+int hal_partition_sync(int id);
+int hal_block_discard(int id, const struct BlockRange* range, int count);
+int hal_partition_discard(int id, struct BlockRange* range, int count);
+int hal_block_write_zeroes(int id, unsigned int lba, unsigned int count);
+void hal_block_readahead(int id, unsigned int lba, unsigned int count);
+void hal_partition_readahead(int id, unsigned int lba, unsigned int count);
+
+// data of sector lba in a buffer returned by hal_block_get
+static inline void* hal_block_data(struct BlockBuffer* b, unsigned int lba) {
+	return b->data + (lba % HAL_BLOCK_SECTORS) * 512;
+}
+
+// data of sector lba of a partition in a buffer returned by hal_partition_get,
+// partitions need not start on a block boundary
+static inline void* hal_partition_data(int id, struct BlockBuffer* b, unsigned int lba) {
+	return hal_block_data(b, hal_partition(id)->begin + lba);
+}
+
+// block-queue.c
+void hal_block_queue_init(int id);
+void hal_block_submit(struct BlockRequest* req);
+int hal_block_wait(struct BlockRequest* req);
+void hal_block_complete(struct BlockRequest* req, int status);
+int hal_block_request(int id, int write, unsigned int lba, unsigned int count, void* buf);
+void hal_block_plug(int id);
+void hal_block_unplug(int id);
+
+// gpt.c
+void gpt_probe_partition(int block_id);
 
 // mbr.c
 void mbr_probe_partition(int block_id);
@@ -66,7 +173,8 @@ void mbr_probe_partition(int block_id);
 // display.c
 
 struct FramebufferDriver {
-	phyaddr_t (*enable)(void* private, int xres, int yres);
+	// kernel address of framebuffer, 0 if it cannot be mapped
+	void* (*enable)(void* private, int xres, int yres);
 	void (*disable)(void* private);
 	void (*update)(void* private);
 	unsigned int (*read_edid)(void* private, void* buffer, unsigned int bytes);
@@ -33,7 +33,9 @@ struct MBREntry {
 void mbr_probe_partition(int block_id) {
 	void* bootsect = kalloc();
 	if (hal_disk_read(block_id, 0, 1, bootsect) < 0) {
-		panic("disk read error");
+		cprintf("[mbr] cannot read block device %d\n", block_id);
+		kfree(bootsect);
+		return;
 	}
 	for (int j = 0; j < 4; j++) {
 		struct MBREntry* entry = bootsect + 0x1be + j * 0x10;
@@ -52,7 +54,8 @@ void mbr_probe_partition(int block_id) {
 			fs = HAL_PARTITION_OTHER;
 		}
 		if (!hal_partition_map_insert(fs, block_id, entry->lba, entry->size)) {
-			panic("hal too many partition");
+			cprintf("[mbr] partition map full, rest of block device %d ignored\n", block_id);
+			break;
 		}
 	}
 	kfree(bootsect);
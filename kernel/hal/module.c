@@ -18,6 +18,7 @@
  */
 
 #include <common/spinlock.h>
+#include <core/proc.h>
 #include <defs.h>
 #include <driver/pci/pci.h>
 #include <driver/usb/usb.h>
@@ -192,12 +193,46 @@ static struct KernerServiceTable {
 	int (*usb_get_configuration_descriptor)(struct USBDevice*, unsigned int, uint8_t*);
 	int (*usb_set_configuration)(struct USBDevice*, uint8_t);
 	// hal/hal.h
-	void (*hal_block_register_device)(const char*, void*, const struct BlockDeviceDriver*);
+	int (*hal_block_register_device)(const char*, void*, const struct BlockDeviceDriver*);
 	void (*hal_display_register_device)(const char*, void*, const struct FramebufferDriver*);
 	void (*hal_mouse_update)(unsigned int);
 	void (*hal_keyboard_update)(unsigned int);
+	// core/proc.h
+	struct proc* (*kthread_create)(const char*, void (*)(void*), void*, unsigned int);
+	void (*work_init)(struct WorkItem*, void (*)(void*), void*);
+	int (*work_schedule)(struct WorkItem*);
+	int (*work_schedule_on)(int, struct WorkItem*);
+	// core/vm.c
+	void* (*vmalloc)(size_t);
+	void (*vfree)(void*);
+	int (*kva_sglist)(const void*, size_t, struct SGEntry*, int);
+	// driver/pci/pci.h
+	int (*pci_msix_enable)(const struct PciAddress*);
+	int (*pci_msix_set_vector)(const struct PciAddress*, int, int, int);
+	void (*pci_msix_disable)(const struct PciAddress*);
+	// hal/hal.h
+	void (*hal_block_complete)(struct BlockRequest*, int);
+	// core/proc.h
+	int (*cpu_count)(void);
+	int (*cpu_current)(void);
+	int (*cpu_apicid)(int);
 }* kernsrv = (void*)0x80010000;
 
+static int module_cpu_count(void) {
+	return ncpu;
+}
+
+static int module_cpu_current(void) {
+	pushcli();
+	int cpu = cpuid();
+	popcli();
+	return cpu;
+}
+
+static int module_cpu_apicid(int cpu) {
+	return cpus[cpu].apicid;
+}
+
 void module_init(void) {
 	memset(module_info, 0, sizeof(module_info));
 	kernsrv->cprintf = cprintf;
@@ -247,4 +282,18 @@ void module_init(void) {
 	kernsrv->hal_display_register_device = hal_display_register_device;
 	kernsrv->hal_mouse_update = hal_mouse_update;
 	kernsrv->hal_keyboard_update = hal_keyboard_update;
+	kernsrv->kthread_create = kthread_create;
+	kernsrv->work_init = work_init;
+	kernsrv->work_schedule = work_schedule;
+	kernsrv->work_schedule_on = work_schedule_on;
+	kernsrv->vmalloc = vmalloc;
+	kernsrv->vfree = vfree;
+	kernsrv->kva_sglist = kva_sglist;
+	kernsrv->pci_msix_enable = pci_msix_enable;
+	kernsrv->pci_msix_set_vector = pci_msix_set_vector;
+	kernsrv->pci_msix_disable = pci_msix_disable;
+	kernsrv->hal_block_complete = hal_block_complete;
+	kernsrv->cpu_count = module_cpu_count;
+	kernsrv->cpu_current = module_cpu_current;
+	kernsrv->cpu_apicid = module_cpu_apicid;
 }
@@ -32,9 +32,11 @@
 static int power_kcall_handler(unsigned int op) {
 	switch (op) {
 	case POWER_KCALL_OP_SHUTDOWN:
+		hal_block_sync(-1);
 		hal_shutdown();
 		break;
 	case POWER_KCALL_OP_REBOOT:
+		hal_block_sync(-1);
 		hal_reboot();
 		break;
 	case POWER_KCALL_OP_SUSPEND:
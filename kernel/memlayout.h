@@ -12,6 +12,14 @@
 #define KERNLINK (KERNBASE + EXTMEM) // Address where kernel is linked
 #define INITRAMFS_BASE 0x80400000 // initramfs load address
 
+// Kernel areas above the direct map, their page tables are shared by all page directories
+#define KSHARED_BASE 0x88000000
+#define KSTACK_BASE 0x88000000 // kernel stacks, each with a guard page below
+#define KSTACK_TOP 0x8C000000
+#define VMALLOC_BASE 0x8C000000 // virtually contiguous memory from scattered pages
+#define VMALLOC_TOP 0x90000000
+#define KSHARED_TOP 0x90000000
+
 #define V2P(a) (((unsigned int)(a)) - KERNBASE)
 #define P2V(a) ((void*)(((char*)(a)) + KERNBASE))
 
@@ -2,7 +2,7 @@
 #define _PARAM_H
 
 #define NPROC 64 // maximum number of processes
-#define KSTACKSIZE 4096 // size of per-process kernel stack
+#define KSTACKSIZE 16384 // size of per-process kernel stack
 #define NCPU 8 // maximum number of CPUs
 #define NOFILE 16 // open files per process
 #define NFILE 100 // open files per system
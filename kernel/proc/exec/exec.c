@@ -30,6 +30,16 @@ int exec(char* path, char** argv) {
 	struct proc* curproc = myproc();
 	unsigned int entry, dynamic, interp = 0;
 
+	// other threads still use the address space
+	if (curproc->leader != curproc)
+		return -1;
+	acquire(&ptable.lock);
+	if (proc_group_busy(curproc)) {
+		release(&ptable.lock);
+		return -1;
+	}
+	release(&ptable.lock);
+
 	// get a new page directory
 	if ((pgdir = setupkvm()) == 0)
 		goto bad;
@@ -79,6 +89,7 @@ int exec(char* path, char** argv) {
 	curproc->stack_size = PGSIZE;
 	curproc->heap_size = 0;
 	curproc->dyn_base = PROC_DYNAMIC_BOTTOM;
+	curproc->tls_base = 0;
 	curproc->tf->eip = entry; // _start
 	curproc->tf->esp = sp;
 	switchuvm(curproc);
@@ -0,0 +1,79 @@
+/*
+ * Fast userspace mutex
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <common/errorcode.h>
+#include <common/spinlock.h>
+#include <core/mmu.h>
+#include <core/proc.h>
+#include <defs.h>
+#include <memlayout.h>
+
+#include "futex.h"
+
+static struct spinlock futex_lock;
+
+void futex_init(void) {
+	initlock(&futex_lock, "futex");
+}
+
+// Sleep channel of a user word, its address in the kernel direct map,
+// so every mapping of the same memory agrees on it.
+static int* futex_chan(unsigned int uaddr) {
+	char* page;
+	if (uaddr % 4 || uaddr >= KERNBASE) {
+		return 0;
+	}
+	if ((page = uva2ka(myproc()->pgdir, (char*)PGROUNDDOWN(uaddr))) == 0) {
+		return 0;
+	}
+	return (int*)(page + uaddr % PGSIZE);
+}
+
+// Sleep if the word at uaddr still holds val.
+// Returns 0 when woken or when the value already changed.
+int futex_wait(unsigned int uaddr, int val) {
+	int* chan = futex_chan(uaddr);
+	if (!chan) {
+		return ERROR_INVAILD;
+	}
+	acquire(&futex_lock);
+	if (*chan != val) {
+		release(&futex_lock);
+		return 0;
+	}
+	if (myproc()->killed) {
+		release(&futex_lock);
+		return -1;
+	}
+	sleep(chan, &futex_lock);
+	release(&futex_lock);
+	return 0;
+}
+
+// Wake at most count waiters on uaddr, returns the number woken.
+int futex_wake(unsigned int uaddr, int count) {
+	int* chan = futex_chan(uaddr);
+	if (!chan) {
+		return ERROR_INVAILD;
+	}
+	acquire(&futex_lock);
+	int woken = wakeup_count(chan, count);
+	release(&futex_lock);
+	return woken;
+}
@@ -0,0 +1,13 @@
+#ifndef _PROC_FUTEX_H
+#define _PROC_FUTEX_H
+
+enum FutexOp {
+	FUTEX_WAIT,
+	FUTEX_WAKE,
+};
+
+void futex_init(void);
+int futex_wait(unsigned int uaddr, int val);
+int futex_wake(unsigned int uaddr, int count);
+
+#endif
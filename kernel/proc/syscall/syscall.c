@@ -121,6 +121,17 @@ extern int sys_pty_close(void);
 extern int sys_pty_switch(void);
 extern int sys_proc_status(void);
 extern int sys_module_load(void);
+extern int sys_thread_create(void);
+extern int sys_thread_join(void);
+extern int sys_gettid(void);
+extern int sys_set_tls(void);
+extern int sys_futex(void);
+extern int sys_proc_set_priority(void);
+extern int sys_proc_get_priority(void);
+extern int sys_proc_set_affinity(void);
+extern int sys_proc_get_affinity(void);
+extern int sys_sync(void);
+extern int sys_fsync(void);
 
 static int (*syscalls[])(void) = {
 	[SYS_fork] = sys_fork,
@@ -164,6 +175,17 @@ static int (*syscalls[])(void) = {
 	[SYS_pty_switch] = sys_pty_switch,
 	[SYS_proc_status] = sys_proc_status,
 	[SYS_module_load] = sys_module_load,
+	[SYS_thread_create] = sys_thread_create,
+	[SYS_thread_join] = sys_thread_join,
+	[SYS_gettid] = sys_gettid,
+	[SYS_set_tls] = sys_set_tls,
+	[SYS_futex] = sys_futex,
+	[SYS_proc_set_priority] = sys_proc_set_priority,
+	[SYS_proc_get_priority] = sys_proc_get_priority,
+	[SYS_proc_set_affinity] = sys_proc_set_affinity,
+	[SYS_proc_get_affinity] = sys_proc_get_affinity,
+	[SYS_sync] = sys_sync,
+	[SYS_fsync] = sys_fsync,
 };
 
 void syscall(void) {
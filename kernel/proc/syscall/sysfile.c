@@ -22,6 +22,7 @@
 #include <core/proc.h>
 #include <defs.h>
 #include <filesystem/initramfs/initramfs.h>
+#include <hal/hal.h>
 #include <memlayout.h>
 #include <param.h>
 #include <proc/pty.h>
@@ -37,13 +38,13 @@ int sys_read(void) {
 	if (argint(0, &fd) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
 		return -1;
 	if (fd < 3) {
-		if (myproc()->pty == 0) {
+		if (myproc()->leader->pty == 0) {
 			return consoleread(p, n);
 		} else {
-			return pty_read(myproc()->pty - 1, p, n);
+			return pty_read(myproc()->leader->pty - 1, p, n);
 		}
 	}
-	return vfs_fd_read(&myproc()->files[fd], p, n);
+	return vfs_fd_read(&myproc()->leader->files[fd], p, n);
 }
 
 int sys_write(void) {
@@ -53,14 +54,14 @@ int sys_write(void) {
 	if (argint(0, &fd) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
 		return -1;
 	if (fd < 3) {
-		if (myproc()->pty == 0) {
+		if (myproc()->leader->pty == 0) {
 			return consolewrite(p, n);
 		} else {
-			return pty_write(myproc()->pty - 1, p, n);
+			return pty_write(myproc()->leader->pty - 1, p, n);
 		}
 	}
 
-	return vfs_fd_write(&myproc()->files[fd], p, n);
+	return vfs_fd_write(&myproc()->leader->files[fd], p, n);
 }
 
 int sys_close(void) {
@@ -68,7 +69,7 @@ int sys_close(void) {
 	if (argint(0, &fd) < 0) {
 		return -1;
 	}
-	return vfs_fd_close(&myproc()->files[fd]);
+	return vfs_fd_close(&myproc()->leader->files[fd]);
 }
 
 // Create the path new as a link to the same inode as old.
@@ -92,9 +93,9 @@ int sys_open(void) {
 		return -1;
 
 	for (int i = 3; i < PROC_FILE_MAX; i++) {
-		if (myproc()->files[i].used == 0) {
+		if (myproc()->leader->files[i].used == 0) {
 			int ret;
-			if ((ret = vfs_fd_open(&myproc()->files[i], path, omode)) < 0) {
+			if ((ret = vfs_fd_open(&myproc()->leader->files[i], path, omode)) < 0) {
 				return ret;
 			}
 			return i;
@@ -149,8 +150,8 @@ int sys_dir_open(void) {
 		return -1;
 	}
 	for (int i = 3; i < PROC_FILE_MAX; i++) {
-		if (myproc()->files[i].used == 0) {
-			if (vfs_dir_open(&myproc()->files[i], dirname) < 0) {
+		if (myproc()->leader->files[i].used == 0) {
+			if (vfs_dir_open(&myproc()->leader->files[i], dirname) < 0) {
 				return -1;
 			}
 			return i;
@@ -165,7 +166,7 @@ int sys_dir_read(void) {
 	if ((argint(0, &handle) < 0) || (argptr(1, &buffer, 256) < 0)) {
 		return -1;
 	}
-	return vfs_dir_read(&myproc()->files[handle], buffer);
+	return vfs_dir_read(&myproc()->leader->files[handle], buffer);
 }
 
 int sys_dir_close(void) {
@@ -173,7 +174,7 @@ int sys_dir_close(void) {
 	if (argint(0, &handle) < 0) {
 		return -1;
 	}
-	return vfs_dir_close(&myproc()->files[handle]);
+	return vfs_dir_close(&myproc()->leader->files[handle]);
 }
 
 int sys_file_get_size(void) {
@@ -189,7 +190,19 @@ int sys_lseek(void) {
 	if (argint(0, &fd) < 0 || argint(1, &offset) < 0 || argint(2, &whence) < 0) {
 		return -1;
 	}
-	return vfs_fd_seek(&myproc()->files[fd], offset, whence);
+	return vfs_fd_seek(&myproc()->leader->files[fd], offset, whence);
+}
+
+int sys_sync(void) {
+	return hal_block_sync(-1);
+}
+
+int sys_fsync(void) {
+	int fd;
+	if (argint(0, &fd) < 0 || fd < 3 || fd >= PROC_FILE_MAX) {
+		return -1;
+	}
+	return vfs_fd_sync(&myproc()->leader->files[fd]);
 }
 
 int sys_file_get_mode(void) {
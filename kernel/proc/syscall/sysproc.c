@@ -25,6 +25,7 @@
 #include <defs.h>
 #include <memlayout.h>
 #include <param.h>
+#include <proc/futex.h>
 #include <proc/kcall.h>
 #include <proc/pty.h>
 
@@ -52,7 +53,7 @@ int sys_kill(void) {
 }
 
 int sys_getpid(void) {
-	return myproc()->pid;
+	return myproc()->leader->pid;
 }
 
 int sys_sbrk(void) {
@@ -61,8 +62,7 @@ int sys_sbrk(void) {
 
 	if (argint(0, &n) < 0)
 		return -1;
-	addr = PROC_HEAP_BOTTOM + myproc()->heap_size;
-	if (growproc(n) < 0)
+	if ((addr = growproc(n)) < 0)
 		return -1;
 	return addr;
 }
@@ -109,7 +109,7 @@ int sys_chdir(void) {
 			return mode;
 		}
 		if (mode & 0040000) { // is a directory
-			struct proc* p = myproc();
+			struct proc* p = myproc()->leader;
 			p->cwd.parts = vfs_path_split(dir, p->cwd.pathbuf);
 		} else { // not a directory
 			return ERROR_NOT_DIRECTORY;
@@ -127,7 +127,7 @@ int sys_chdir(void) {
 			return mode;
 		}
 		if (mode & 0040000) { // is a directory
-			struct proc* p = myproc();
+			struct proc* p = myproc()->leader;
 			kfree(p->cwd.pathbuf);
 			p->cwd = newpath;
 		} else { // not a directory
@@ -143,7 +143,7 @@ int sys_getcwd(void) {
 	if (argstr(0, &dir) < 0) {
 		return -1;
 	}
-	vfs_path_tostring(myproc()->cwd, dir);
+	vfs_path_tostring(myproc()->leader->cwd, dir);
 	return 0;
 }
 
@@ -177,9 +177,10 @@ int sys_message_send(void) {
 	if (!destproc) {
 		return -1;
 	}
+	destproc = destproc->leader; // threads share the process queue
 	acquire(&destproc->msgqueue.lock);
 	struct Message* destmsg = &destproc->msgqueue.queue[destproc->msgqueue.begin];
-	destmsg->pid = myproc()->pid;
+	destmsg->pid = myproc()->leader->pid;
 	destmsg->size = size;
 	destmsg->addr = pgalloc(PGROUNDUP(size) / 4096);
 	memmove(destmsg->addr, data, size);
@@ -197,20 +198,21 @@ int sys_message_receive(void) {
 	if (argptr(0, (char**)&data, 4 * 1024 * 1024) < 0) {
 		return -1;
 	}
-	acquire(&myproc()->msgqueue.lock);
-	if (myproc()->msgqueue.begin == myproc()->msgqueue.end) {
-		release(&myproc()->msgqueue.lock);
+	struct MessageQueue* mq = &myproc()->leader->msgqueue;
+	acquire(&mq->lock);
+	if (mq->begin == mq->end) {
+		release(&mq->lock);
 		return 0;
 	}
-	struct Message* thismsg = &myproc()->msgqueue.queue[myproc()->msgqueue.end];
+	struct Message* thismsg = &mq->queue[mq->end];
 	int ret = thismsg->pid;
 	memmove(data, thismsg->addr, thismsg->size);
 	pgfree(thismsg->addr, PGROUNDUP(thismsg->size) / 4096);
-	myproc()->msgqueue.end++;
-	if (myproc()->msgqueue.end == MESSAGE_MAX) {
-		myproc()->msgqueue.end = 0;
+	mq->end++;
+	if (mq->end == MESSAGE_MAX) {
+		mq->end = 0;
 	}
-	release(&myproc()->msgqueue.lock);
+	release(&mq->lock);
 	return ret;
 }
 
@@ -219,24 +221,29 @@ int sys_message_wait(void) {
 	if (argptr(0, (char**)&data, 4 * 1024 * 1024) < 0) {
 		return -1;
 	}
-	acquire(&myproc()->msgqueue.lock);
-	while (myproc()->msgqueue.begin == myproc()->msgqueue.end) {
-		sleep(&myproc()->msgqueue, &myproc()->msgqueue.lock);
+	struct MessageQueue* mq = &myproc()->leader->msgqueue;
+	acquire(&mq->lock);
+	while (mq->begin == mq->end) {
+		if (myproc()->killed) {
+			release(&mq->lock);
+			return -1;
+		}
+		sleep(mq, &mq->lock);
 	}
-	struct Message* thismsg = &myproc()->msgqueue.queue[myproc()->msgqueue.end];
+	struct Message* thismsg = &mq->queue[mq->end];
 	int ret = thismsg->pid;
 	memmove(data, thismsg->addr, thismsg->size);
 	pgfree(thismsg->addr, PGROUNDUP(thismsg->size) / 4096);
-	myproc()->msgqueue.end++;
-	if (myproc()->msgqueue.end == MESSAGE_MAX) {
-		myproc()->msgqueue.end = 0;
+	mq->end++;
+	if (mq->end == MESSAGE_MAX) {
+		mq->end = 0;
 	}
-	release(&myproc()->msgqueue.lock);
+	release(&mq->lock);
 	return ret;
 }
 
 int sys_getppid(void) {
-	return myproc()->parent->pid;
+	return myproc()->leader->parent->pid;
 }
 
 int sys_proc_search(void) {
@@ -291,7 +298,7 @@ int sys_pty_switch(void) {
 	if (argint(0, &ptyid) < 0) {
 		return -1;
 	}
-	myproc()->pty = ptyid;
+	myproc()->leader->pty = ptyid;
 	return 0;
 }
 
@@ -315,7 +322,7 @@ int sys_proc_status(void) {
 	if (p->state == RUNNING || p->state == RUNNABLE) {
 		release(&ptable.lock);
 		return PROC_RUNNING;
-	} else if (p->state == ZOMBIE) {
+	} else if (p->state == ZOMBIE && !proc_group_busy(p)) {
 		*exit_status = p->exit_status;
 		proc_free(p);
 		release(&ptable.lock);
@@ -332,3 +339,101 @@ int sys_module_load(void) {
 	}
 	return module_load(name);
 }
+
+int sys_thread_create(void) {
+	int entry, arg, stack, tls;
+	if (argint(0, &entry) < 0 || argint(1, &arg) < 0 || argint(2, &stack) < 0 ||
+		argint(3, &tls) < 0) {
+		return -1;
+	}
+	return thread_create(entry, arg, stack, tls);
+}
+
+int sys_thread_join(void) {
+	int tid;
+	int* status;
+	if (argint(0, &tid) < 0 || argptr(1, (char**)&status, sizeof(int)) < 0) {
+		return -1;
+	}
+	int exit_status;
+	if (thread_join(tid, &exit_status) < 0) {
+		return -1;
+	}
+	if (status) {
+		*status = exit_status;
+	}
+	return 0;
+}
+
+int sys_gettid(void) {
+	return myproc()->pid;
+}
+
+int sys_set_tls(void) {
+	int base;
+	if (argint(0, &base) < 0) {
+		return -1;
+	}
+	myproc()->tls_base = base;
+	myproc()->tf->gs = (SEG_UTLS << 3) | DPL_USER;
+	switchuvm(myproc());
+	return 0;
+}
+
+int sys_futex(void) {
+	int uaddr, op, val;
+	if (argint(0, &uaddr) < 0 || argint(1, &op) < 0 || argint(2, &val) < 0) {
+		return -1;
+	}
+	switch (op) {
+	case FUTEX_WAIT:
+		return futex_wait(uaddr, val);
+	case FUTEX_WAKE:
+		return futex_wake(uaddr, val);
+	}
+	return ERROR_INVAILD;
+}
+
+int sys_proc_set_priority(void) {
+	int pid, nice;
+	if (argint(0, &pid) < 0 || argint(1, &nice) < 0) {
+		return -1;
+	}
+	return proc_set_priority(pid, nice);
+}
+
+int sys_proc_get_priority(void) {
+	int pid;
+	int* nice;
+	if (argint(0, &pid) < 0 || argptr(1, (char**)&nice, sizeof(int)) < 0) {
+		return -1;
+	}
+	struct proc* p = pid ? proc_search_pid(pid) : myproc();
+	if (!p) {
+		return ERROR_NOT_EXIST;
+	}
+	*nice = p->nice;
+	return 0;
+}
+
+int sys_proc_set_affinity(void) {
+	int pid, mask;
+	if (argint(0, &pid) < 0 || argint(1, &mask) < 0) {
+		return -1;
+	}
+	return proc_set_affinity(pid, mask);
+}
+
+int sys_proc_get_affinity(void) {
+	int pid;
+	unsigned int* mask;
+	if (argint(0, &pid) < 0 || argptr(1, (char**)&mask, sizeof(unsigned int)) < 0) {
+		return -1;
+	}
+	struct proc* p = pid ? proc_search_pid(pid) : myproc();
+	if (!p) {
+		return ERROR_NOT_EXIST;
+	}
+	*mask = p->affinity & ((1 << ncpu) - 1);
+	return 0;
+}
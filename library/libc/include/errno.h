@@ -3,4 +3,10 @@
 
 extern int errno;
 
+// POSIX error numbers returned by libposix functions
+#define ESRCH 3
+#define EAGAIN 11
+#define EBUSY 16
+#define EINVAL 22
+
 #endif
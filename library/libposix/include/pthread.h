@@ -0,0 +1,74 @@
+/*
+ * pthread.h header
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _POSIX_PTHREAD_H
+#define _POSIX_PTHREAD_H
+
+struct __pthread {
+	struct __pthread* self; // %gs:0
+	int tid;
+	void* (*start_routine)(void*);
+	void* arg;
+	void* retval;
+	void* stack;
+};
+
+typedef struct __pthread* pthread_t;
+
+typedef struct {
+	unsigned int stacksize;
+} pthread_attr_t;
+
+typedef struct {
+	volatile int state; // 0 unlocked, 1 locked, 2 locked with waiters
+} pthread_mutex_t;
+
+typedef struct {
+	volatile int seq;
+} pthread_cond_t;
+
+typedef int pthread_mutexattr_t;
+typedef int pthread_condattr_t;
+
+#define PTHREAD_MUTEX_INITIALIZER {0}
+#define PTHREAD_COND_INITIALIZER {0}
+
+int pthread_attr_init(pthread_attr_t* attr);
+int pthread_attr_destroy(pthread_attr_t* attr);
+int pthread_attr_setstacksize(pthread_attr_t* attr, unsigned int stacksize);
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*),
+				   void* arg);
+int pthread_join(pthread_t thread, void** retval);
+_Noreturn void pthread_exit(void* retval);
+pthread_t pthread_self(void);
+int pthread_equal(pthread_t t1, pthread_t t2);
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr);
+int pthread_mutex_destroy(pthread_mutex_t* mutex);
+int pthread_mutex_lock(pthread_mutex_t* mutex);
+int pthread_mutex_trylock(pthread_mutex_t* mutex);
+int pthread_mutex_unlock(pthread_mutex_t* mutex);
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr);
+int pthread_cond_destroy(pthread_cond_t* cond);
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex);
+int pthread_cond_signal(pthread_cond_t* cond);
+int pthread_cond_broadcast(pthread_cond_t* cond);
+
+#endif
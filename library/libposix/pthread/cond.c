@@ -0,0 +1,50 @@
+/*
+ * pthread condition variable
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <pthread.h>
+
+int pthread_cond_init(pthread_cond_t* cond, const pthread_condattr_t* attr) {
+	cond->seq = 0;
+	return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t* cond) {
+	return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+	int seq = cond->seq;
+	pthread_mutex_unlock(mutex);
+	futex((int*)&cond->seq, FUTEX_WAIT, seq);
+	pthread_mutex_lock(mutex);
+	return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t* cond) {
+	__atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+	futex((int*)&cond->seq, FUTEX_WAKE, 1);
+	return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t* cond) {
+	__atomic_fetch_add(&cond->seq, 1, __ATOMIC_RELEASE);
+	futex((int*)&cond->seq, FUTEX_WAKE, 0x7fffffff);
+	return 0;
+}
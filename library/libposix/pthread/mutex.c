@@ -0,0 +1,62 @@
+/*
+ * pthread mutex
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <panicos.h>
+#include <pthread.h>
+
+int pthread_mutex_init(pthread_mutex_t* mutex, const pthread_mutexattr_t* attr) {
+	mutex->state = 0;
+	return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t* mutex) {
+	return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex) {
+	int c = __sync_val_compare_and_swap(&mutex->state, 0, 1);
+	if (c == 0) {
+		return 0;
+	}
+	// mark contended and sleep until the owner hands it over
+	if (c != 2) {
+		c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+	}
+	while (c != 0) {
+		futex((int*)&mutex->state, FUTEX_WAIT, 2);
+		c = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+	}
+	return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex) {
+	if (__sync_val_compare_and_swap(&mutex->state, 0, 1) != 0) {
+		return EBUSY;
+	}
+	return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* mutex) {
+	if (__atomic_fetch_sub(&mutex->state, 1, __ATOMIC_RELEASE) != 1) {
+		mutex->state = 0;
+		futex((int*)&mutex->state, FUTEX_WAKE, 1);
+	}
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * pthread thread management
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <panicos.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#define PTHREAD_STACK_DEFAULT (64 * 1024)
+
+static struct __pthread pthread_main;
+
+// The main thread gets its TLS segment on first use
+static void pthread_init_main(void) {
+	if (pthread_main.self) {
+		return;
+	}
+	pthread_main.self = &pthread_main;
+	pthread_main.tid = gettid();
+	set_tls(&pthread_main);
+}
+
+static void pthread_start(void* arg) {
+	struct __pthread* thread = arg;
+	pthread_exit(thread->start_routine(thread->arg));
+}
+
+int pthread_attr_init(pthread_attr_t* attr) {
+	attr->stacksize = PTHREAD_STACK_DEFAULT;
+	return 0;
+}
+
+int pthread_attr_destroy(pthread_attr_t* attr) {
+	return 0;
+}
+
+int pthread_attr_setstacksize(pthread_attr_t* attr, unsigned int stacksize) {
+	if (stacksize < 4096) {
+		return EINVAL;
+	}
+	attr->stacksize = stacksize;
+	return 0;
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr, void* (*start_routine)(void*),
+				   void* arg) {
+	pthread_init_main();
+	unsigned int stacksize = attr ? attr->stacksize : PTHREAD_STACK_DEFAULT;
+	struct __pthread* t = malloc(sizeof(struct __pthread));
+	if (!t) {
+		return EAGAIN;
+	}
+	t->stack = malloc(stacksize);
+	if (!t->stack) {
+		free(t);
+		return EAGAIN;
+	}
+	t->self = t;
+	t->start_routine = start_routine;
+	t->arg = arg;
+	t->retval = NULL;
+	t->tid = thread_create(pthread_start, t, (char*)t->stack + stacksize, t);
+	if (t->tid < 0) {
+		free(t->stack);
+		free(t);
+		return EAGAIN;
+	}
+	*thread = t;
+	return 0;
+}
+
+int pthread_join(pthread_t thread, void** retval) {
+	if (thread_join(thread->tid, NULL) < 0) {
+		return ESRCH;
+	}
+	if (retval) {
+		*retval = thread->retval;
+	}
+	free(thread->stack);
+	free(thread);
+	return 0;
+}
+
+_Noreturn void pthread_exit(void* retval) {
+	pthread_self()->retval = retval;
+	proc_exit(0);
+}
+
+pthread_t pthread_self(void) {
+	pthread_t self;
+	pthread_init_main();
+	__asm__ volatile("movl %%gs:0, %0" : "=r"(self));
+	return self;
+}
+
+int pthread_equal(pthread_t t1, pthread_t t2) {
+	return t1 == t2;
+}
@@ -0,0 +1,78 @@
+/*
+ * Block device user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LIBSYS_KCALL_BLOCK_H
+#define _LIBSYS_KCALL_BLOCK_H
+
+#include <panicos.h>
+
+enum BlockKCallOp {
+	BLOCK_KCALL_OP_CACHE_STAT = 0,
+	BLOCK_KCALL_OP_GET_POLL = 1,
+	BLOCK_KCALL_OP_SET_POLL = 2,
+	BLOCK_KCALL_OP_DISK_READ = 3,
+};
+
+struct BlockKcall {
+	enum BlockKCallOp op;
+	unsigned int hit, miss, evict;
+	unsigned int buffers;
+	unsigned int readahead; // blocks read ahead of use
+	unsigned int dev;
+	unsigned int poll; // TSC cycles
+	unsigned int lba, count;
+	void* buf;
+};
+
+static inline int block_cache_stat(struct BlockKcall* stat) {
+	stat->op = BLOCK_KCALL_OP_CACHE_STAT;
+	return kcall("block", (unsigned int)stat);
+}
+
+// TSC cycles waiters on a device poll for completion before sleeping
+static inline int block_get_poll(unsigned int dev, unsigned int* poll) {
+	struct BlockKcall bc;
+	bc.op = BLOCK_KCALL_OP_GET_POLL;
+	bc.dev = dev;
+	int ret = kcall("block", (unsigned int)&bc);
+	*poll = bc.poll;
+	return ret;
+}
+
+static inline int block_set_poll(unsigned int dev, unsigned int poll) {
+	struct BlockKcall bc;
+	bc.op = BLOCK_KCALL_OP_SET_POLL;
+	bc.dev = dev;
+	bc.poll = poll;
+	return kcall("block", (unsigned int)&bc);
+}
+
+// Read up to 8 sectors from a device bypassing the block cache
+static inline int block_disk_read(unsigned int dev, unsigned int lba, unsigned int count,
+								  void* buf) {
+	struct BlockKcall bc;
+	bc.op = BLOCK_KCALL_OP_DISK_READ;
+	bc.dev = dev;
+	bc.lba = lba;
+	bc.count = count;
+	bc.buf = buf;
+	return kcall("block", (unsigned int)&bc);
+}
+
+#endif
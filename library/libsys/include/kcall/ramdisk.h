@@ -0,0 +1,43 @@
+/*
+ * RAM disk user mode API
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef _LIBSYS_KCALL_RAMDISK_H
+#define _LIBSYS_KCALL_RAMDISK_H
+
+#include <panicos.h>
+
+struct RamdiskKcall {
+	unsigned int sectors;
+	const void* image; // copied to the start of the disk if set
+	unsigned int image_size; // bytes
+};
+
+// Create a RAM disk, starting with image if given so its partitions are
+// probed and its FAT32 volumes mounted, return its block device id
+static inline int ramdisk_create(unsigned int sectors, const void* image,
+								 unsigned int image_size) {
+	struct RamdiskKcall rk;
+	rk.sectors = sectors;
+	rk.image = image;
+	rk.image_size = image ? image_size : 0;
+	return kcall("ramdisk", (unsigned int)&rk);
+}
+
+#endif
@@ -69,6 +69,17 @@ int pty_close(int pty);
 int pty_switch(int pty);
 int proc_status(int pid, int* exit_status);
 int module_load(const char* name);
+int thread_create(void (*entry)(void*), void* arg, void* stack, void* tls);
+int thread_join(int tid, int* exit_status);
+int gettid(void);
+int set_tls(void* base);
+int futex(int* uaddr, int op, int val);
+int proc_set_priority(int pid, int nice);
+int proc_get_priority(int pid, int* nice);
+int proc_set_affinity(int pid, unsigned int mask);
+int proc_get_affinity(int pid, unsigned int* mask);
+int sync(void);
+int fsync(int fd);
 
 enum OpenMode {
 	O_READ = 1,
@@ -84,6 +95,11 @@ enum FileSeekMode {
 	FILE_SEEK_END,
 };
 
+enum FutexOp {
+	FUTEX_WAIT,
+	FUTEX_WAKE,
+};
+
 enum ProcStatus {
 	PROC_RUNNING,
 	PROC_EXITED,
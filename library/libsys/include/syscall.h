@@ -61,5 +61,16 @@
 #define SYS_pty_switch 39
 #define SYS_proc_status 40
 #define SYS_module_load 41
+#define SYS_thread_create 42
+#define SYS_thread_join 43
+#define SYS_gettid 44
+#define SYS_set_tls 45
+#define SYS_futex 46
+#define SYS_proc_set_priority 47
+#define SYS_proc_get_priority 48
+#define SYS_proc_set_affinity 49
+#define SYS_proc_get_affinity 50
+#define SYS_sync 51
+#define SYS_fsync 52
 
 #endif
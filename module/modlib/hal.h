@@ -22,23 +22,54 @@
 
 #include <kernsrv.h>
 
+struct BlockRange {
+	unsigned int lba, count;
+};
+
+struct BlockRequest {
+	unsigned int dev;
+	int write;
+	unsigned int lba, count;
+	void* buf;
+	struct SGEntry* sg;
+	unsigned int nsg;
+	int status;
+	int complete;
+	unsigned int deadline;
+	int cpu;
+	void (*done)(struct BlockRequest* req);
+	void* private;
+	struct BlockRequest* next;
+};
+
 struct BlockDeviceDriver {
 	int (*block_read)(void* private, unsigned int begin, int count, void* buf);
 	int (*block_write)(void* private, unsigned int begin, int count, const void* buf);
+	int (*submit)(void* private, struct BlockRequest* req, unsigned int count);
+	unsigned int max_sectors, max_segments;
+	int (*poll)(void* private, int cpu);
+	int (*flush)(void* private);
+	int (*discard)(void* private, const struct BlockRange* range, int count);
+	int (*write_zeroes)(void* private, const struct BlockRange* range, int count);
 };
 
 struct FramebufferDriver {
-	phyaddr_t (*enable)(void* private, int xres, int yres);
+	// kernel address of framebuffer, 0 if it cannot be mapped
+	void* (*enable)(void* private, int xres, int yres);
 	void (*disable)(void* private);
 	void (*update)(void* private);
 	unsigned int (*read_edid)(void* private, void* buffer, unsigned int bytes);
 };
 
-static inline void hal_block_register_device(const char* name, void* private,
-											 const struct BlockDeviceDriver* driver) {
+static inline int hal_block_register_device(const char* name, void* private,
+											const struct BlockDeviceDriver* driver) {
 	return kernsrv->hal_block_register_device(name, private, driver);
 }
 
+static inline void hal_block_complete(struct BlockRequest* req, int status) {
+	return kernsrv->hal_block_complete(req, status);
+}
+
 static inline void hal_display_register_device(const char* name, void* private,
 											   const struct FramebufferDriver* driver) {
 	return kernsrv->hal_display_register_device(name, private, driver);
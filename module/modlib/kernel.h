@@ -48,4 +48,34 @@ static inline void release(struct spinlock* lock) {
 	return kernsrv->release(lock);
 }
 
+static inline struct proc* kthread_create(const char* name, void (*fn)(void*), void* arg,
+										  unsigned int affinity) {
+	return kernsrv->kthread_create(name, fn, arg, affinity);
+}
+
+static inline void work_init(struct WorkItem* work, void (*func)(void*), void* arg) {
+	return kernsrv->work_init(work, func, arg);
+}
+
+static inline int work_schedule(struct WorkItem* work) {
+	return kernsrv->work_schedule(work);
+}
+
+static inline int work_schedule_on(int cpu, struct WorkItem* work) {
+	return kernsrv->work_schedule_on(cpu, work);
+}
+
+static inline int cpu_count(void) {
+	return kernsrv->cpu_count();
+}
+
+// CPU running the caller, which may move to another CPU afterwards
+static inline int cpu_current(void) {
+	return kernsrv->cpu_current();
+}
+
+static inline int cpu_apicid(int cpu) {
+	return kernsrv->cpu_apicid(cpu);
+}
+
 #endif
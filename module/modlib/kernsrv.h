@@ -48,11 +48,21 @@ struct VirtioDriver;
 struct VirtioDevice;
 struct VirtioQueue;
 struct BlockDeviceDriver;
+struct BlockRequest;
 struct FramebufferDriver;
 struct USBDevice;
 struct USBBus;
 struct USBDriver;
 struct USBHostControllerDriver;
+struct proc;
+
+// core/proc.h
+struct WorkItem {
+	struct WorkItem* next;
+	void (*func)(void* arg);
+	void* arg;
+	int pending;
+};
 
 const static struct KernerServiceTable {
 	// basic functions
@@ -110,12 +120,30 @@ const static struct KernerServiceTable {
 	int (*usb_get_configuration_descriptor)(struct USBDevice*, unsigned int, uint8_t*);
 	int (*usb_set_configuration)(struct USBDevice*, uint8_t);
 	// hal/hal.h
-	void (*hal_block_register_device)(const char*, void*,
-									  const struct BlockDeviceDriver*);
+	int (*hal_block_register_device)(const char*, void*, const struct BlockDeviceDriver*);
 	void (*hal_display_register_device)(const char*, void*,
 										const struct FramebufferDriver*);
 	void (*hal_mouse_update)(unsigned int);
 	void (*hal_keyboard_update)(unsigned int);
+	// core/proc.h
+	struct proc* (*kthread_create)(const char*, void (*)(void*), void*, unsigned int);
+	void (*work_init)(struct WorkItem*, void (*)(void*), void*);
+	int (*work_schedule)(struct WorkItem*);
+	int (*work_schedule_on)(int, struct WorkItem*);
+	// core/vm.c
+	void* (*vmalloc)(size_t);
+	void (*vfree)(void*);
+	int (*kva_sglist)(const void*, size_t, struct SGEntry*, int);
+	// driver/pci/pci.h
+	int (*pci_msix_enable)(const struct PciAddress*);
+	int (*pci_msix_set_vector)(const struct PciAddress*, int, int, int);
+	void (*pci_msix_disable)(const struct PciAddress*);
+	// hal/hal.h
+	void (*hal_block_complete)(struct BlockRequest*, int);
+	// core/proc.h
+	int (*cpu_count)(void);
+	int (*cpu_current)(void);
+	int (*cpu_apicid)(int);
 }* kernsrv = (void*)0x80010000;
 
 #define KERNBASE 0x80000000 // First kernel virtual address
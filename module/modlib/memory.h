@@ -42,6 +42,18 @@ static inline void* map_rom_region(phyaddr_t phyaddr, size_t size) {
 	return kernsrv->map_rom_region(phyaddr, size);
 }
 
+static inline void* vmalloc(size_t size) {
+	return kernsrv->vmalloc(size);
+}
+
+static inline void vfree(void* va) {
+	return kernsrv->vfree(va);
+}
+
+static inline int kva_sglist(const void* va, size_t size, struct SGEntry* sg, int max) {
+	return kernsrv->kva_sglist(va, size, sg, max);
+}
+
 static inline void* kalloc(void) {
 	return pgalloc(1);
 }
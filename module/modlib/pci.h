@@ -127,6 +127,19 @@ static inline void pci_msi_disable(const struct PciAddress* addr) {
 	return kernsrv->pci_msi_disable(addr);
 }
 
+static inline int pci_msix_enable(const struct PciAddress* addr) {
+	return kernsrv->pci_msix_enable(addr);
+}
+
+static inline int pci_msix_set_vector(const struct PciAddress* addr, int entry, int vector,
+									  int lapicid) {
+	return kernsrv->pci_msix_set_vector(addr, entry, vector, lapicid);
+}
+
+static inline void pci_msix_disable(const struct PciAddress* addr) {
+	return kernsrv->pci_msix_disable(addr);
+}
+
 static inline void pci_register_driver(const struct PCIDriver* driver) {
 	return kernsrv->pci_register_driver(driver);
 }
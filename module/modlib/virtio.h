@@ -39,6 +39,8 @@ struct VirtioDevice {
 	volatile void* devcfg;
 	volatile unsigned int* notify_begin;
 	unsigned int notify_off_multiplier;
+	unsigned int features; // negotiated
+	int msix; // queues interrupt through their own MSI-X vectors
 };
 
 struct VirtioDriver {
@@ -97,6 +99,13 @@ struct VirtioQueue {
 	volatile struct VirtqAvail* avail;
 	volatile struct VirtqUsed* used;
 	volatile unsigned int* notify;
+	unsigned int free_head, num_free; // free descriptors linked through next
+	unsigned short kicked; // avail index at the last notification
+	unsigned short used_last; // used entries taken
+	int event_idx; // VIRTIO_RING_F_EVENT_IDX negotiated
+	struct VirtioDevice* dev;
+	int queue_n;
+	int vector; // MSI-X vector, 0 with INTx
 };
 
 static inline void virtio_register_driver(const struct VirtioDriver* driver) {
@@ -110,12 +119,24 @@ static inline void virtio_init_queue(struct VirtioDevice* dev,
 
 static inline void virtio_queue_notify(struct VirtioDevice* dev,
 									   struct VirtioQueue* queue) {
+	__sync_synchronize();
+	uint16_t old = queue->kicked, idx = queue->avail->idx;
+	queue->kicked = idx;
+	if (queue->event_idx) {
+		uint16_t event = *(volatile uint16_t*)(queue->used->ring + queue->size);
+		if ((uint16_t)(idx - event - 1) >= (uint16_t)(idx - old)) {
+			return;
+		}
+	} else if (queue->used->flags & VIRTQ_USED_F_NO_NOTIFY) {
+		return;
+	}
 	*queue->notify = 0;
 }
 
 static inline void virtio_queue_notify_wait(struct VirtioDevice* dev,
 											struct VirtioQueue* queue) {
 	int prev = queue->used->idx;
+	queue->kicked = queue->avail->idx;
 	*queue->notify = 0;
 	while (prev == queue->used->idx) {
 	}
@@ -123,35 +144,33 @@ static inline void virtio_queue_notify_wait(struct VirtioDevice* dev,
 
 static inline void virtio_queue_avail_insert(struct VirtioQueue* queue, int desc) {
 	queue->avail->ring[queue->avail->idx % queue->size] = desc;
+	__sync_synchronize();
 	queue->avail->idx++;
 }
 
 static inline int* virtio_alloc_desc(struct VirtioQueue* queue, int* desc, int num) {
-	for (int i = 0; i < num; i++) {
-		desc[i] = -1;
-		for (int j = 0; j < queue->size; j++) {
-			if (queue->desc[j].addr == 0) {
-				queue->desc[j].addr = 0xffffffff;
-				desc[i] = j;
-				break;
-			}
-		}
-		if (desc[i] == -1) {
-			return 0;
+	if (queue->num_free < (unsigned int)num) {
+		for (int i = 0; i < num; i++) {
+			desc[i] = -1;
 		}
+		return 0;
 	}
+	for (int i = 0; i < num; i++) {
+		desc[i] = queue->free_head;
+		queue->free_head = queue->desc[desc[i]].next;
+	}
+	queue->num_free -= num;
 	return desc;
 }
 
 static inline void virtio_free_desc(struct VirtioQueue* queue, int desc) {
-	do {
-		queue->desc[desc].addr = 0;
-		if (queue->desc[desc].flags & VIRTQ_DESC_F_NEXT) {
-			desc = queue->desc[desc].next;
-		} else {
-			desc = -1;
-		}
-	} while (desc != -1);
+	while (desc != -1) {
+		int next = queue->desc[desc].flags & VIRTQ_DESC_F_NEXT ? queue->desc[desc].next : -1;
+		queue->desc[desc].next = queue->free_head;
+		queue->free_head = desc;
+		queue->num_free++;
+		desc = next;
+	}
 }
 
 #endif
@@ -0,0 +1,72 @@
+#ifndef _NVME_REGS_H
+#define _NVME_REGS_H
+
+#include <kernel-types.h>
+
+// controller registers, 64-bit ones are accessed as two halves
+struct NVMeRegs {
+	uint32_t cap_lo, cap_hi; // capabilities
+	uint32_t vs;
+	uint32_t intms, intmc; // INTx interrupt mask set/clear
+	uint32_t cc; // configuration
+	uint32_t reserved0;
+	uint32_t csts; // status
+	uint32_t nssr;
+	uint32_t aqa; // admin queue attributes
+	uint32_t asq_lo, asq_hi;
+	uint32_t acq_lo, acq_hi;
+};
+
+#define NVME_CAP_MQES(lo) ((lo)&0xffff) // maximum queue entries - 1
+#define NVME_CAP_DSTRD(hi) ((hi)&0xf) // doorbell stride is 4 << DSTRD
+
+#define NVME_CC_EN (1 << 0)
+#define NVME_CC_IOSQES (6 << 16) // 64 byte submission entries
+#define NVME_CC_IOCQES (4 << 20) // 16 byte completion entries
+
+#define NVME_CSTS_RDY (1 << 0)
+#define NVME_CSTS_CFS (1 << 1) // controller fatal status
+
+#define NVME_DOORBELL_BASE 0x1000
+
+struct NVMeSubmission {
+	uint8_t opcode;
+	uint8_t flags;
+	uint16_t cid; // command identifier
+	uint32_t nsid;
+	uint32_t reserved[2];
+	uint64_t mptr;
+	uint64_t prp1, prp2;
+	uint32_t cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+};
+
+struct NVMeCompletion {
+	uint32_t result; // command specific
+	uint32_t reserved;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	uint16_t status; // bit 0 phase tag, status field above
+};
+
+enum NVMeAdminOpcode {
+	NVME_ADMIN_CREATE_SQ = 0x01,
+	NVME_ADMIN_CREATE_CQ = 0x05,
+	NVME_ADMIN_IDENTIFY = 0x06,
+	NVME_ADMIN_SET_FEATURES = 0x09,
+};
+
+enum NVMeIoOpcode {
+	NVME_IO_FLUSH = 0x00,
+	NVME_IO_WRITE = 0x01,
+	NVME_IO_READ = 0x02,
+};
+
+#define NVME_IDENTIFY_NAMESPACE 0
+#define NVME_IDENTIFY_CONTROLLER 1
+#define NVME_FEATURE_NUM_QUEUES 0x07
+
+#define NVME_QUEUE_PC (1 << 0) // physically contiguous
+#define NVME_QUEUE_IEN (1 << 1) // interrupts enabled
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * NVM Express driver
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <hal.h>
+#include <kernel.h>
+#include <klibc.h>
+#include <memory.h>
+#include <pci.h>
+
+#include "nvme-regs.h"
+#include "nvme.h"
+
+static struct NVMeQueue* nvme_alloc_queue(struct NVMeController* ctrl, int qid,
+										  unsigned int size) {
+	struct NVMeQueue* q = kalloc();
+	memset(q, 0, sizeof(struct NVMeQueue));
+	q->ctrl = ctrl;
+	q->qid = qid;
+	q->size = size;
+	q->phase = 1;
+	initlock(&q->lock, "nvme");
+	q->sq = kalloc();
+	q->cq = kalloc();
+	memset((void*)q->sq, 0, NVME_PAGE_SIZE);
+	memset((void*)q->cq, 0, NVME_PAGE_SIZE);
+	q->sq_doorbell = ctrl->mmio + NVME_DOORBELL_BASE + 2 * qid * ctrl->doorbell_stride;
+	q->cq_doorbell = ctrl->mmio + NVME_DOORBELL_BASE + (2 * qid + 1) * ctrl->doorbell_stride;
+	return q;
+}
+
+// Copy a command to the submission queue tail and ring the doorbell
+static void nvme_sq_push(struct NVMeQueue* q, const struct NVMeSubmission* cmd) {
+	volatile uint32_t* dst = (volatile uint32_t*)&q->sq[q->sq_tail];
+	const uint32_t* src = (const uint32_t*)cmd;
+	for (unsigned int i = 0; i < sizeof(struct NVMeSubmission) / 4; i++) {
+		dst[i] = src[i];
+	}
+	q->sq_tail = (q->sq_tail + 1) % q->size;
+	__sync_synchronize();
+	*q->sq_doorbell = q->sq_tail;
+}
+
+// Admin command, polled since admin commands are only sent while probing
+static int nvme_admin(struct NVMeController* ctrl, struct NVMeSubmission* cmd,
+					  uint32_t* result) {
+	struct NVMeQueue* q = ctrl->admin;
+	acquire(&q->lock);
+	cmd->cid = q->sq_tail;
+	nvme_sq_push(q, cmd);
+	volatile struct NVMeCompletion* cqe = &q->cq[q->cq_head];
+	while ((cqe->status & 1) != q->phase) {
+	}
+	int status = cqe->status >> 1;
+	if (result) {
+		*result = cqe->result;
+	}
+	if (++q->cq_head == q->size) {
+		q->cq_head = 0;
+		q->phase ^= 1;
+	}
+	*q->cq_doorbell = q->cq_head;
+	release(&q->lock);
+	if (status) {
+		cprintf("[nvme] admin command %x status %x\n", cmd->opcode, status);
+		return ERROR_INVAILD;
+	}
+	return 0;
+}
+
+static int nvme_identify(struct NVMeController* ctrl, unsigned int cns, unsigned int nsid,
+						 void* buf) {
+	struct NVMeSubmission cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_ADMIN_IDENTIFY;
+	cmd.nsid = nsid;
+	cmd.prp1 = V2P(buf);
+	cmd.cdw10 = cns;
+	return nvme_admin(ctrl, &cmd, 0);
+}
+
+// Build the PRP entries of the segments in q->sg. Only the first segment may
+// start inside a page and only the last may end inside one.
+static int nvme_prp(struct NVMeQueue* q, struct NVMeCommand* c, int nseg,
+					struct NVMeSubmission* cmd) {
+	unsigned int n = 0;
+	for (int i = 0; i < nseg; i++) {
+		phyaddr_t addr = q->sg[i].addr, end = addr + q->sg[i].length;
+		if ((i > 0 && addr % NVME_PAGE_SIZE) || (i < nseg - 1 && end % NVME_PAGE_SIZE)) {
+			return ERROR_INVAILD;
+		}
+		for (phyaddr_t p = addr; p < end; p = (p & ~(NVME_PAGE_SIZE - 1)) + NVME_PAGE_SIZE) {
+			if (n == 0) {
+				cmd->prp1 = p;
+			} else {
+				if (!c->prp_list) {
+					c->prp_list = kalloc();
+				}
+				if (n - 1 >= NVME_PAGE_SIZE / sizeof(uint64_t)) {
+					return ERROR_INVAILD;
+				}
+				c->prp_list[n - 1] = p;
+			}
+			n++;
+		}
+	}
+	// the second page directly, or a list of the rest
+	cmd->prp2 = n == 2 ? c->prp_list[0] : n > 2 ? V2P(c->prp_list) : 0;
+	return 0;
+}
+
+// Describe the data of a request chain, or bytes of buf if there is no
+// request, in q->sg. Return the number of segments.
+static int nvme_sglist(struct NVMeQueue* q, struct BlockRequest* req, const void* buf,
+					   unsigned int bytes) {
+	if (!req) {
+		return bytes ? kva_sglist(buf, bytes, q->sg, NVME_SEG_MAX) : 0;
+	}
+	int n = 0;
+	for (; req; req = req->next) {
+		int ret;
+		if (req->sg) {
+			ret = req->nsg <= NVME_SEG_MAX - n ? (int)req->nsg : ERROR_INVAILD;
+			if (ret > 0) {
+				memcpy(q->sg + n, req->sg, req->nsg * sizeof(struct SGEntry));
+			}
+		} else {
+			ret = kva_sglist(req->buf, req->count * 512, q->sg + n, NVME_SEG_MAX - n);
+		}
+		if (ret < 0) {
+			return ret;
+		}
+		n += ret;
+	}
+	return n;
+}
+
+// Queue an I/O command, waiting for a free command identifier if needed, return
+// the identifier or ERROR_INVAILD if the data can not be described by PRPs.
+// Called with q->lock held.
+static int nvme_start(struct NVMeQueue* q, uint8_t opcode, unsigned int lba, unsigned int count,
+					  struct BlockRequest* req, const void* buf, unsigned int bytes) {
+	uint32_t free;
+	while (!(free = ~q->used & ((1u << (q->size - 1)) - 1))) {
+		sleep(q, &q->lock);
+	}
+	int cid = __builtin_ctz(free);
+	struct NVMeCommand* c = &q->cmd[cid];
+	struct NVMeSubmission cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	int nseg = nvme_sglist(q, req, buf, bytes);
+	if (nseg < 0 || nvme_prp(q, c, nseg, &cmd) < 0) {
+		return ERROR_INVAILD;
+	}
+	q->used |= 1 << cid;
+	c->req = req;
+	c->write = opcode != NVME_IO_READ;
+	c->done = 0;
+	c->status = 0;
+
+	cmd.opcode = opcode;
+	cmd.cid = cid;
+	cmd.nsid = q->ctrl->nsid;
+	cmd.cdw10 = lba;
+	cmd.cdw11 = 0;
+	cmd.cdw12 = count ? count - 1 : 0; // number of blocks, zero based
+	nvme_sq_push(q, &cmd);
+	return cid;
+}
+
+// Queue of the CPU submitting, completions come back on it
+static struct NVMeQueue* nvme_queue(struct NVMeController* ctrl, int cpu) {
+	if (cpu < 0) {
+		cpu = cpu_current();
+	}
+	return ctrl->queue[cpu % ctrl->nqueues];
+}
+
+// Process completions, return the number of commands completed
+static int nvme_reap(struct NVMeQueue* q) {
+	int n = 0;
+	acquire(&q->lock);
+	for (;;) {
+		volatile struct NVMeCompletion* cqe = &q->cq[q->cq_head];
+		if ((cqe->status & 1) != q->phase) {
+			break;
+		}
+		unsigned int cid = cqe->cid;
+		int error = cqe->status >> 1;
+		if (++q->cq_head == q->size) {
+			q->cq_head = 0;
+			q->phase ^= 1;
+		}
+		*q->cq_doorbell = q->cq_head;
+		if (cid >= NVME_QUEUE_SIZE) {
+			continue;
+		}
+		n++;
+		struct NVMeCommand* c = &q->cmd[cid];
+		c->status = error ? (c->write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL) : 0;
+		struct BlockRequest* req = c->req;
+		if (!req) {
+			c->done = 1;
+			wakeup(c);
+			continue;
+		}
+		c->req = 0;
+		int status = c->status;
+		q->used &= ~(1 << cid);
+		wakeup(q);
+		release(&q->lock);
+		hal_block_complete(req, status);
+		acquire(&q->lock);
+	}
+	release(&q->lock);
+	return n;
+}
+
+static void nvme_complete(void* private) {
+	struct NVMeQueue* q = private;
+	nvme_reap(q);
+	// INTx stays masked until the completions are consumed
+	if (!q->ctrl->msix) {
+		q->ctrl->regs->intmc = 1;
+	}
+}
+
+// Synchronous command, sleeps until the completion interrupt
+static int nvme_exec(struct NVMeController* ctrl, uint8_t opcode, unsigned int lba,
+					 unsigned int count, const void* buf) {
+	struct NVMeQueue* q = nvme_queue(ctrl, -1);
+	acquire(&q->lock);
+	int cid = nvme_start(q, opcode, lba, count, 0, buf, count * 512);
+	if (cid < 0) {
+		release(&q->lock);
+		return opcode == NVME_IO_READ ? ERROR_READ_FAIL : ERROR_WRITE_FAIL;
+	}
+	struct NVMeCommand* c = &q->cmd[cid];
+	while (!c->done) {
+		sleep(c, &q->lock);
+	}
+	// the waiter owns the identifier until here
+	int status = c->status;
+	q->used &= ~(1 << cid);
+	wakeup(q);
+	release(&q->lock);
+	return status;
+}
+
+static int nvme_read(void* private, unsigned int begin, int count, void* buf) {
+	if (count <= 0 || count > NVME_MAX_SECTORS)
+		panic("nvme count");
+	return nvme_exec(private, NVME_IO_READ, begin, count, buf);
+}
+
+static int nvme_write(void* private, unsigned int begin, int count, const void* buf) {
+	if (count <= 0 || count > NVME_MAX_SECTORS)
+		panic("nvme count");
+	return nvme_exec(private, NVME_IO_WRITE, begin, count, buf);
+}
+
+static int nvme_flush(void* private) {
+	return nvme_exec(private, NVME_IO_FLUSH, 0, 0, 0);
+}
+
+static int nvme_req_page_start(struct BlockRequest* req) {
+	phyaddr_t addr = req->sg ? req->sg[0].addr : (phyaddr_t)req->buf;
+	return addr % NVME_PAGE_SIZE == 0;
+}
+
+static int nvme_req_page_end(struct BlockRequest* req) {
+	phyaddr_t end = req->sg ? req->sg[req->nsg - 1].addr + req->sg[req->nsg - 1].length
+							: (phyaddr_t)req->buf + req->count * 512;
+	return end % NVME_PAGE_SIZE == 0;
+}
+
+// Asynchronous request, completed from nvme_reap. Merged requests which do
+// not meet at page boundaries can not share a PRP list and are sent as
+// separate commands.
+static int nvme_submit(void* private, struct BlockRequest* req, unsigned int count) {
+	struct NVMeController* ctrl = private;
+	if (count == 0 || count > ctrl->block_driver.max_sectors)
+		panic("nvme count");
+	struct NVMeQueue* q = nvme_queue(ctrl, req->cpu);
+	while (req) {
+		struct BlockRequest* tail = req;
+		unsigned int n = req->count;
+		while (tail->next && nvme_req_page_end(tail) && nvme_req_page_start(tail->next)) {
+			tail = tail->next;
+			n += tail->count;
+		}
+		struct BlockRequest* rest = tail->next;
+		tail->next = 0;
+		acquire(&q->lock);
+		int cid = nvme_start(q, req->write ? NVME_IO_WRITE : NVME_IO_READ, req->lba, n, req, 0, 0);
+		release(&q->lock);
+		if (cid < 0) {
+			hal_block_complete(req, req->write ? ERROR_WRITE_FAIL : ERROR_READ_FAIL);
+		}
+		req = rest;
+	}
+	return 0;
+}
+
+static int nvme_poll(void* private, int cpu) {
+	return nvme_reap(nvme_queue(private, cpu));
+}
+
+static void nvme_msix_intr(void* private) {
+	struct NVMeQueue* q = private;
+	work_schedule(&q->complete_work);
+}
+
+// INTx does not tell the queue, mask it until the queues are processed
+static void nvme_intx_intr(struct PCIDevice* pcidev) {
+	struct NVMeController* ctrl = pcidev->private;
+	ctrl->regs->intms = 1;
+	for (int i = 0; i < ctrl->nqueues; i++) {
+		work_schedule(&ctrl->queue[i]->complete_work);
+	}
+}
+
+// Create I/O queue pair qid, serving CPU qid - 1 through MSI-X entry qid
+static int nvme_create_queue(struct NVMeController* ctrl, int qid) {
+	struct NVMeQueue* q = nvme_alloc_queue(ctrl, qid, NVME_QUEUE_SIZE);
+	q->cpu = (qid - 1) % cpu_count();
+	work_init(&q->complete_work, nvme_complete, q);
+	int iv = 0;
+	if (ctrl->msix) {
+		int vector = pci_msi_alloc_vector(nvme_msix_intr, q);
+		if (!vector) {
+			panic("nvme msix vector");
+		}
+		if (pci_msix_set_vector(&ctrl->pcidev->addr, qid, vector, cpu_apicid(q->cpu)) < 0) {
+			panic("nvme msix entry");
+		}
+		iv = qid;
+	}
+
+	struct NVMeSubmission cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_ADMIN_CREATE_CQ;
+	cmd.prp1 = V2P(q->cq);
+	cmd.cdw10 = qid | (q->size - 1) << 16;
+	cmd.cdw11 = NVME_QUEUE_PC | NVME_QUEUE_IEN | iv << 16;
+	if (nvme_admin(ctrl, &cmd, 0) < 0) {
+		return ERROR_INVAILD;
+	}
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_ADMIN_CREATE_SQ;
+	cmd.prp1 = V2P(q->sq);
+	cmd.cdw10 = qid | (q->size - 1) << 16;
+	cmd.cdw11 = NVME_QUEUE_PC | qid << 16; // completions go to the CQ of the same id
+	if (nvme_admin(ctrl, &cmd, 0) < 0) {
+		return ERROR_INVAILD;
+	}
+	ctrl->queue[qid - 1] = q;
+	return 0;
+}
+
+// Reset the controller and bring it up with the admin queue
+static int nvme_enable(struct NVMeController* ctrl) {
+	volatile struct NVMeRegs* regs = ctrl->regs;
+	if ((regs->cap_hi >> 16) & 0xf) {
+		cprintf("[nvme] 4 KiB pages not supported\n");
+		return ERROR_INVAILD;
+	}
+	if (regs->cc & NVME_CC_EN) {
+		regs->cc &= ~NVME_CC_EN;
+	}
+	while (regs->csts & NVME_CSTS_RDY) {
+	}
+	ctrl->doorbell_stride = 4 << NVME_CAP_DSTRD(regs->cap_hi);
+	ctrl->admin = nvme_alloc_queue(ctrl, 0, NVME_ADMIN_QUEUE_SIZE);
+	regs->aqa = (NVME_ADMIN_QUEUE_SIZE - 1) | (NVME_ADMIN_QUEUE_SIZE - 1) << 16;
+	regs->asq_lo = V2P(ctrl->admin->sq);
+	regs->asq_hi = 0;
+	regs->acq_lo = V2P(ctrl->admin->cq);
+	regs->acq_hi = 0;
+	regs->cc = NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES;
+	while (!(regs->csts & NVME_CSTS_RDY)) {
+		if (regs->csts & NVME_CSTS_CFS) {
+			cprintf("[nvme] controller fatal status\n");
+			return ERROR_INVAILD;
+		}
+	}
+	return 0;
+}
+
+// Identify the controller and namespace 1, return its sector count or 0
+static unsigned int nvme_probe(struct NVMeController* ctrl, unsigned int* mdts) {
+	uint8_t* identify = kalloc();
+	if (nvme_identify(ctrl, NVME_IDENTIFY_CONTROLLER, 0, identify) < 0) {
+		kfree(identify);
+		return 0;
+	}
+	char model[41];
+	memcpy(model, identify + 24, 40);
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; i--) {
+		model[i] = '\0';
+	}
+	*mdts = identify[77];
+	unsigned int nn = *(uint32_t*)(identify + 516);
+	cprintf("[nvme] Controller %s namespaces %d version %x\n", model, nn, ctrl->regs->vs);
+
+	ctrl->nsid = 1;
+	if (nn < 1 || nvme_identify(ctrl, NVME_IDENTIFY_NAMESPACE, ctrl->nsid, identify) < 0) {
+		kfree(identify);
+		return 0;
+	}
+	uint32_t* ns = (uint32_t*)identify;
+	unsigned int flbas = identify[26] & 0xf;
+	unsigned int lbads = (ns[32 + flbas] >> 16) & 0xff;
+	unsigned int sectors = ns[1] ? 0xffffffff : ns[0]; // beyond 32 bits is not reachable
+	kfree(identify);
+	if (lbads != 9) {
+		cprintf("[nvme] namespace 1 block size %d not supported\n", 1 << lbads);
+		return 0;
+	}
+	return sectors;
+}
+
+// Ask for a queue pair per CPU, return the number granted
+static int nvme_set_queues(struct NVMeController* ctrl, int want) {
+	struct NVMeSubmission cmd;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.opcode = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEATURE_NUM_QUEUES;
+	cmd.cdw11 = (want - 1) | (want - 1) << 16;
+	uint32_t result;
+	if (nvme_admin(ctrl, &cmd, &result) < 0) {
+		return 0;
+	}
+	int nsq = (result & 0xffff) + 1, ncq = (result >> 16) + 1;
+	int n = nsq < ncq ? nsq : ncq;
+	return n < want ? n : want;
+}
+
+static void nvme_dev_init(struct PCIDevice* pcidev) {
+	const struct PciAddress* addr = &pcidev->addr;
+	struct NVMeController* ctrl = kalloc();
+	memset(ctrl, 0, sizeof(struct NVMeController));
+	ctrl->pcidev = pcidev;
+	pcidev->private = ctrl;
+	ctrl->mmio = map_mmio_region(pci_read_bar(addr, 0), pci_read_bar_size(addr, 0));
+	ctrl->regs = ctrl->mmio;
+	pci_enable_bus_mastering(addr);
+	if (nvme_enable(ctrl) < 0) {
+		return;
+	}
+	unsigned int mdts;
+	ctrl->sectors = nvme_probe(ctrl, &mdts);
+	if (!ctrl->sectors) {
+		return;
+	}
+
+	// a queue pair and MSI-X entry per CPU, entry 0 is left to the admin queue
+	int want = cpu_count() < NVME_QUEUE_MAX ? cpu_count() : NVME_QUEUE_MAX;
+	int msix_entries = pci_msix_enable(addr);
+	if (msix_entries >= 2) {
+		ctrl->msix = 1;
+		if (want > msix_entries - 1) {
+			want = msix_entries - 1;
+		}
+	} else {
+		if (msix_entries) {
+			pci_msix_disable(addr);
+		}
+		// masked while the admin queue is polled
+		ctrl->regs->intms = 1;
+		pci_register_intr_handler(pcidev, nvme_intx_intr);
+		pci_enable_intx_intr(addr);
+	}
+	ctrl->nqueues = nvme_set_queues(ctrl, want);
+	for (int i = 0; i < ctrl->nqueues; i++) {
+		if (nvme_create_queue(ctrl, i + 1) < 0) {
+			ctrl->nqueues = i;
+			break;
+		}
+	}
+	if (!ctrl->nqueues) {
+		cprintf("[nvme] no I/O queue\n");
+		return;
+	}
+	if (!ctrl->msix) {
+		ctrl->regs->intmc = 1;
+	}
+
+	struct BlockDeviceDriver* driver = &ctrl->block_driver;
+	driver->block_read = nvme_read;
+	driver->block_write = nvme_write;
+	driver->submit = nvme_submit;
+	driver->max_sectors = NVME_MAX_SECTORS;
+	if (mdts && (NVME_PAGE_SIZE << mdts) / 512 < NVME_MAX_SECTORS) {
+		driver->max_sectors = (NVME_PAGE_SIZE << mdts) / 512;
+	}
+	driver->max_segments = NVME_SEG_MAX;
+	driver->poll = nvme_poll;
+	driver->flush = nvme_flush;
+	cprintf("[nvme] namespace 1 %d sectors queues %d %s\n", ctrl->sectors, ctrl->nqueues,
+			ctrl->msix ? "MSI-X" : "INTx");
+	hal_block_register_device("nvme", ctrl, driver);
+}
+
+static struct PCIDriver nvme_pci_driver;
+
+void module_init(void) {
+	nvme_pci_driver.name = "nvme";
+	nvme_pci_driver.match_table = 0;
+	nvme_pci_driver.class_type = 0x010802; // NVM Express
+	nvme_pci_driver.init = nvme_dev_init;
+	pci_register_driver(&nvme_pci_driver);
+}
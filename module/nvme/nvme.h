@@ -0,0 +1,55 @@
+#ifndef _NVME_H
+#define _NVME_H
+
+#include <hal.h>
+#include <kernel.h>
+
+#include "nvme-regs.h"
+
+#define NVME_PAGE_SIZE 4096
+#define NVME_QUEUE_SIZE 32 // entries of each I/O queue, one is always left empty
+#define NVME_ADMIN_QUEUE_SIZE 8
+#define NVME_QUEUE_MAX 8 // I/O queue pairs, one per CPU
+#define NVME_MAX_SECTORS 1024 // per command, less if the controller's MDTS is lower
+#define NVME_SEG_MAX 128 // pages per command, a PRP list fits in a page
+
+// command in flight, indexed by its command identifier
+struct NVMeCommand {
+	struct BlockRequest* req; // asynchronous request, 0 if a thread is waiting
+	uint64_t* prp_list; // allocated on first use
+	uint8_t write;
+	uint8_t done;
+	int status;
+};
+
+struct NVMeQueue {
+	struct NVMeController* ctrl;
+	int qid;
+	int cpu; // interrupts go to this CPU
+	struct spinlock lock;
+	struct WorkItem complete_work; // completion processing outside IRQ
+	volatile struct NVMeSubmission* sq;
+	volatile struct NVMeCompletion* cq;
+	volatile uint32_t *sq_doorbell, *cq_doorbell;
+	uint16_t size, sq_tail, cq_head;
+	uint8_t phase; // of the completions not consumed yet
+	uint32_t used; // command identifiers in use
+	struct NVMeCommand cmd[NVME_QUEUE_SIZE];
+	struct SGEntry sg[NVME_SEG_MAX]; // data of the command being queued
+};
+
+struct NVMeController {
+	struct PCIDevice* pcidev;
+	volatile struct NVMeRegs* regs;
+	volatile void* mmio;
+	unsigned int doorbell_stride;
+	struct NVMeQueue* admin;
+	int nqueues;
+	struct NVMeQueue* queue[NVME_QUEUE_MAX];
+	int msix;
+	unsigned int nsid;
+	unsigned int sectors;
+	struct BlockDeviceDriver block_driver; // limits depend on the controller
+};
+
+#endif
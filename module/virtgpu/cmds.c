@@ -287,23 +287,36 @@ void virtio_gpu_xfer_to_host_2d(struct VirtioGPUDevice* dev, unsigned int resour
 	release(&dev->lock);
 }
 
-void virtio_gpu_attach_banking(struct VirtioGPUDevice* dev, unsigned int resource_id, phyaddr_t fb,
+void virtio_gpu_attach_banking(struct VirtioGPUDevice* dev, unsigned int resource_id, void* fb,
 							   size_t length) {
+	// one memory entry per physically contiguous piece of the framebuffer
+	unsigned int max_entries = (length + 4095) / 4096;
+	unsigned int sg_pages = (max_entries * sizeof(struct SGEntry) + 4095) / 4096;
+	unsigned int mement_pages = (max_entries * sizeof(struct virtio_gpu_mem_entry) + 4095) / 4096;
+	struct SGEntry* sg = pgalloc(sg_pages);
+	int nents = kva_sglist(fb, length, sg, max_entries);
+	if (nents < 0) {
+		panic("virtio-gpu backing not mapped");
+	}
+
 	acquire(&dev->lock);
 
 	struct virtio_gpu_resource_attach_backing* req = kalloc();
 	volatile struct virtio_gpu_ctrl_hdr* resp = kalloc();
-	struct virtio_gpu_mem_entry* mement = kalloc();
+	struct virtio_gpu_mem_entry* mement = pgalloc(mement_pages);
 
 	req->hdr.type = VIRTIO_GPU_CMD_RESOURCE_ATTACH_BACKING;
 	req->hdr.flags = 0;
 	req->hdr.fence_id = 0;
 	req->hdr.ctx_id = 0;
 	req->resource_id = resource_id;
-	req->nr_entries = 1;
+	req->nr_entries = nents;
 
-	mement->addr = fb;
-	mement->length = length;
+	for (int i = 0; i < nents; i++) {
+		mement[i].addr = sg[i].addr;
+		mement[i].length = sg[i].length;
+		mement[i].padding = 0;
+	}
 
 	int desc[3];
 	if (!virtio_alloc_desc(&dev->controlq, desc, 3)) {
@@ -316,7 +329,7 @@ void virtio_gpu_attach_banking(struct VirtioGPUDevice* dev, unsigned int resourc
 	dev->controlq.desc[desc[0]].next = desc[1];
 
 	dev->controlq.desc[desc[1]].addr = V2P(mement);
-	dev->controlq.desc[desc[1]].len = sizeof(struct virtio_gpu_mem_entry);
+	dev->controlq.desc[desc[1]].len = nents * sizeof(struct virtio_gpu_mem_entry);
 	dev->controlq.desc[desc[1]].flags = VIRTQ_DESC_F_NEXT;
 	dev->controlq.desc[desc[1]].next = desc[2];
 
@@ -329,8 +342,9 @@ void virtio_gpu_attach_banking(struct VirtioGPUDevice* dev, unsigned int resourc
 	virtio_queue_notify_wait(dev->virtio_dev, &dev->controlq);
 
 	kfree(req);
-	kfree(mement);
+	pgfree(mement, mement_pages);
 	kfree((void*)resp);
 	virtio_free_desc(&dev->controlq, desc[0]);
 	release(&dev->lock);
+	pgfree(sg, sg_pages);
 }
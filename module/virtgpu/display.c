@@ -30,10 +30,13 @@ static void virtio_gpu_display_update(void* private) {
 	virtio_gpu_flush(disp->gpu, disp->resource_id, disp->xres, disp->yres);
 }
 
-static phyaddr_t virtio_gpu_display_enable(void* private, int xres, int yres) {
+static void* virtio_gpu_display_enable(void* private, int xres, int yres) {
 	struct VirtioGPUDisplay* disp = private;
 	disp->resource_id = virtio_gpu_alloc_resource_id(disp->gpu);
-	disp->framebuffer = V2P(pgalloc(4096));
+	disp->framebuffer = vmalloc(16 * 1024 * 1024);
+	if (!disp->framebuffer) {
+		panic("virtio-gpu framebuffer");
+	}
 	virtio_gpu_res_create_2d(disp->gpu, disp->resource_id, VIRTIO_GPU_FORMAT_B8G8R8X8_UNORM, xres,
 							 yres);
 	virtio_gpu_attach_banking(disp->gpu, disp->resource_id, disp->framebuffer, 16 * 1024 * 1024);
@@ -46,7 +49,8 @@ static phyaddr_t virtio_gpu_display_enable(void* private, int xres, int yres) {
 static void virtio_gpu_display_disable(void* private) {
 	struct VirtioGPUDisplay* disp = private;
 	if (disp->framebuffer) {
-		pgfree(P2V(disp->framebuffer), 4096);
+		vfree(disp->framebuffer);
+		disp->framebuffer = 0;
 	}
 }
 
@@ -21,7 +21,7 @@ struct VirtioGPUDevice {
 struct VirtioGPUDisplay {
 	struct VirtioGPUDevice* gpu;
 	int xres, yres;
-	phyaddr_t framebuffer;
+	void* framebuffer;
 	unsigned int enabled;
 	unsigned int resource_id, scanout;
 };
@@ -41,7 +41,7 @@ void virtio_gpu_flush(struct VirtioGPUDevice* dev, unsigned int resource_id,
 void virtio_gpu_xfer_to_host_2d(struct VirtioGPUDevice* dev, unsigned int resource_id,
 								unsigned int w, unsigned int h);
 void virtio_gpu_attach_banking(struct VirtioGPUDevice* dev, unsigned int resource_id,
-							   phyaddr_t fb, size_t length);
+							   void* fb, size_t length);
 
 // display.c
 void virtio_gpu_display_dev_init(struct VirtioGPUDevice* dev);
@@ -0,0 +1,153 @@
+/*
+ * Block device latency benchmark
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <kcall/block.h>
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct KernelTime {
+	unsigned int year, month, day_of_week, day_of_month;
+	unsigned int hour, minute, second;
+};
+
+static void usage(void) {
+	fputs("usage: blkbench [-d dev] [-n ios] [-p poll_us] [-s sectors]\n"
+		  "4 KiB random reads within the first sectors of a device, bypassing\n"
+		  "the cache, with interrupts and with hybrid polling\n",
+		  stderr);
+}
+
+static inline unsigned long long rdtsc(void) {
+	unsigned long long tsc;
+	__asm__ volatile("rdtsc" : "=A"(tsc));
+	return tsc;
+}
+
+static unsigned int rtc_second(void) {
+	struct KernelTime time;
+	kcall("date", (unsigned int)&time);
+	return time.second;
+}
+
+// TSC cycles per microsecond, counted over one RTC second
+static unsigned int tsc_per_us(void) {
+	unsigned int sec = rtc_second();
+	while (rtc_second() == sec) {
+	}
+	unsigned long long begin = rdtsc();
+	sec = rtc_second();
+	while (rtc_second() == sec) {
+	}
+	unsigned int cycles = rdtsc() - begin;
+	return cycles / 1000000 ? cycles / 1000000 : 1;
+}
+
+static void sort(unsigned int* a, int n) {
+	for (int gap = n / 2; gap > 0; gap /= 2) {
+		for (int i = gap; i < n; i++) {
+			unsigned int v = a[i];
+			int j = i;
+			for (; j >= gap && a[j - gap] > v; j -= gap) {
+				a[j] = a[j - gap];
+			}
+			a[j] = v;
+		}
+	}
+}
+
+// Latency of each read in TSC cycles, sorted
+static int run(unsigned int dev, unsigned int* lat, int n, unsigned int span, void* buf) {
+	unsigned int seed = 12345;
+	for (int i = 0; i < n; i++) {
+		seed = seed * 1103515245 + 12345;
+		unsigned int lba = (seed >> 8) % (span / 8) * 8;
+		unsigned long long begin = rdtsc();
+		if (block_disk_read(dev, lba, 8, buf) < 0) {
+			printf("read of lba %d failed\n", lba);
+			return -1;
+		}
+		lat[i] = rdtsc() - begin;
+	}
+	sort(lat, n);
+	return 0;
+}
+
+static void report(const char* mode, unsigned int* lat, int n, unsigned int mhz) {
+	printf("%s\t%u\t%u\t%u\t%u\t%u\n", mode, lat[n / 2] / mhz, lat[n * 9 / 10] / mhz,
+		   lat[n * 99 / 100] / mhz, lat[n * 999 / 1000] / mhz, lat[n - 1] / mhz);
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned int dev = 0, span = 16384, poll_us = 50;
+	int n = 1000;
+	for (int i = 1; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage();
+			return 1;
+		}
+		if (strcmp(argv[i], "-d") == 0) {
+			dev = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-n") == 0) {
+			n = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-p") == 0) {
+			poll_us = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0) {
+			span = atoi(argv[++i]);
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	if (n <= 0 || span < 8) {
+		usage();
+		return 1;
+	}
+
+	unsigned int old_poll;
+	if (block_get_poll(dev, &old_poll) < 0) {
+		printf("no block device %d\n", dev);
+		return 1;
+	}
+	unsigned int* lat = malloc(n * sizeof(unsigned int));
+	void* buf = malloc(4096);
+	unsigned int mhz = tsc_per_us();
+	printf("block device %d, %d reads, TSC %u MHz\n", dev, n, mhz);
+	printf("mode\tp50\tp90\tp99\tp99.9\tmax (us)\n");
+
+	int ret = 0;
+	block_set_poll(dev, 0);
+	if (run(dev, lat, n, span, buf) < 0) {
+		ret = 1;
+	} else {
+		report("irq", lat, n, mhz);
+		if (block_set_poll(dev, poll_us * mhz) < 0) {
+			printf("block device %d can not poll\n", dev);
+		} else if (run(dev, lat, n, span, buf) < 0) {
+			ret = 1;
+		} else {
+			report("poll", lat, n, mhz);
+		}
+	}
+	block_set_poll(dev, old_poll);
+	free(lat);
+	free(buf);
+	return ret;
+}
@@ -0,0 +1,74 @@
+/*
+ * nice program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void) {
+	fputs("usage: nice [-n priority] program [args]\n"
+		  "       nice -p pid [priority]\n",
+		  stderr);
+}
+
+static int run(const char* name, const char** argv) {
+	char exe[100];
+	if (strchr(name, '/')) {
+		strcpy(exe, name);
+	} else {
+		strcpy(exe, "/bin/");
+		strcat(exe, name);
+	}
+	exec(exe, argv);
+	printf("exec %s failed\n", name);
+	return 1;
+}
+
+int main(int argc, const char* argv[]) {
+	if (argc >= 3 && strcmp(argv[1], "-p") == 0) {
+		int pid = atoi(argv[2]);
+		if (argc >= 4 && proc_set_priority(pid, atoi(argv[3])) < 0) {
+			printf("set priority of %d failed\n", pid);
+			return 1;
+		}
+		int nice;
+		if (proc_get_priority(pid, &nice) < 0) {
+			printf("no process %d\n", pid);
+			return 1;
+		}
+		printf("%d: priority %d\n", pid, nice);
+		return 0;
+	}
+
+	int nice = 10, arg = 1;
+	if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+		nice = atoi(argv[2]);
+		arg = 3;
+	}
+	if (arg >= argc) {
+		usage();
+		return 1;
+	}
+	if (proc_set_priority(0, nice) < 0) {
+		printf("invalid priority %d\n", nice);
+		return 1;
+	}
+	return run(argv[arg], &argv[arg]);
+}
@@ -0,0 +1,59 @@
+/*
+ * Create a RAM disk
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+
+#include <kcall/ramdisk.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char* argv[]) {
+	if (argc < 2 || argc > 3) {
+		puts("ramdisk size_kib [image], size 0 to fit the image");
+		return 0;
+	}
+	unsigned int sectors = atoi(argv[1]) * 2;
+	void* image = NULL;
+	long size = 0;
+	if (argc == 3) {
+		FILE* file = fopen(argv[2], "rb");
+		if (file == NULL) {
+			fputs("File not found\n", stderr);
+			return 1;
+		}
+		fseek(file, 0, SEEK_END);
+		size = ftell(file);
+		fseek(file, 0, SEEK_SET);
+		image = malloc(size);
+		if (image == NULL || fread(image, 1, size, file) != (size_t)size) {
+			fputs("cannot read image\n", stderr);
+			return 1;
+		}
+		fclose(file);
+		if (sectors == 0) { // size of the image
+			sectors = (size + 511) / 512;
+		}
+	}
+	int dev = ramdisk_create(sectors, image, size);
+	if (dev < 0) {
+		printf("create failed with %d\n", dev);
+		return 1;
+	}
+	printf("block device %d\n", dev);
+	return 0;
+}
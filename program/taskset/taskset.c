@@ -0,0 +1,98 @@
+/*
+ * taskset program
+ *
+ * This file is part of PanicOS.
+ *
+ * PanicOS is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PanicOS is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PanicOS.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <panicos.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void usage(void) {
+	fputs("usage: taskset mask program [args]\n"
+		  "       taskset -p pid [mask]\n"
+		  "mask is a hexadecimal CPU bitmask\n",
+		  stderr);
+}
+
+static int parse_mask(const char* s, unsigned int* mask) {
+	if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+		s += 2;
+	}
+	if (!*s) {
+		return -1;
+	}
+	*mask = 0;
+	for (; *s; s++) {
+		if (*s >= '0' && *s <= '9') {
+			*mask = *mask * 16 + *s - '0';
+		} else if (*s >= 'a' && *s <= 'f') {
+			*mask = *mask * 16 + *s - 'a' + 10;
+		} else if (*s >= 'A' && *s <= 'F') {
+			*mask = *mask * 16 + *s - 'A' + 10;
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int run(const char* name, const char** argv) {
+	char exe[100];
+	if (strchr(name, '/')) {
+		strcpy(exe, name);
+	} else {
+		strcpy(exe, "/bin/");
+		strcat(exe, name);
+	}
+	exec(exe, argv);
+	printf("exec %s failed\n", name);
+	return 1;
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned int mask;
+	if (argc >= 3 && strcmp(argv[1], "-p") == 0) {
+		int pid = atoi(argv[2]);
+		if (argc >= 4) {
+			if (parse_mask(argv[3], &mask) < 0) {
+				usage();
+				return 1;
+			}
+			if (proc_set_affinity(pid, mask) < 0) {
+				printf("set affinity of %d failed\n", pid);
+				return 1;
+			}
+		}
+		if (proc_get_affinity(pid, &mask) < 0) {
+			printf("no process %d\n", pid);
+			return 1;
+		}
+		printf("%d: affinity mask %x\n", pid, mask);
+		return 0;
+	}
+
+	if (argc < 3 || parse_mask(argv[1], &mask) < 0) {
+		usage();
+		return 1;
+	}
+	if (proc_set_affinity(0, mask) < 0) {
+		printf("invalid mask %x\n", mask);
+		return 1;
+	}
+	return run(argv[2], &argv[2]);
+}